@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../language.h"
+
+/* Measures how fast values are converted to and from interpreter objects,
+   by passing them through an identity function (in-process, no sandbox). */
+
+static const char*languages[] = {"py", "lua", "js", "rb", NULL};
+
+static const char* identity_script(const char*language)
+{
+    if(!strcmp(language, "py"))
+        return "def identity(x):\n    return x\n";
+    if(!strcmp(language, "lua"))
+        return "function identity(x)\n    return x\nend\n";
+    if(!strcmp(language, "rb"))
+        return "def identity(x)\n    return x\nend\n";
+    return "function identity(x) {\n    return x;\n}\n";
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static value_t* make_payload(const char*kind, int size)
+{
+    value_t*array = array_new_sized(size);
+    int i;
+    for(i=0;i<size;i++) {
+        if(!strcmp(kind, "int32")) {
+            array_append_int32(array, i);
+        } else if(!strcmp(kind, "float32")) {
+            array_append_float32(array, i * 0.5);
+        } else if(!strcmp(kind, "string")) {
+            array_append_string(array, "payload");
+        } else {
+            value_t*pair = array_new_sized(2);
+            array_append_int32(pair, i);
+            array_append_boolean(pair, i&1);
+            array_append(array, pair);
+        }
+    }
+    return array;
+}
+
+static void bench(language_t*l, const char*language, const char*kind, int size)
+{
+    value_t*args = array_new();
+    array_append(args, make_payload(kind, size));
+
+    int calls = 0;
+    double start = now();
+    double elapsed;
+    do {
+        value_t*ret = l->call_function(l, "identity", args);
+        if(!ret || ret->type != TYPE_ARRAY || ret->length != size) {
+            fprintf(stderr, "%s: identity(%s[%d]) failed\n", language, kind, size);
+            exit(1);
+        }
+        value_destroy(ret);
+        calls++;
+        elapsed = now() - start;
+    } while(elapsed < 0.5 || calls < 3);
+
+    printf("%-4s %-8s %8d %12.1f calls/s %12.1f entries/s\n",
+            language, kind, size, calls / elapsed, calls * (double)size / elapsed);
+    value_destroy(args);
+}
+
+int main(int argn, char*argv[])
+{
+    const char*kinds[] = {"int32", "float32", "string", "nested", NULL};
+    int sizes[] = {10, 1000, 100000};
+
+    const char**selected = languages;
+    if(argn > 1) {
+        selected = (const char**)argv + 1;
+    }
+
+    int i;
+    for(i=0;selected[i];i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "bench.%s", selected[i]);
+        language_t*l = unsafe_interpreter_by_extension(filename);
+        if(!l || !l->compile_script(l, identity_script(selected[i]))) {
+            fprintf(stderr, "Couldn't initialize interpreter for %s\n", selected[i]);
+            return 1;
+        }
+        int k, s;
+        for(k=0;kinds[k];k++) {
+            for(s=0;s<sizeof(sizes)/sizeof(sizes[0]);s++) {
+                bench(l, selected[i], kinds[k], sizes[s]);
+            }
+        }
+        l->destroy(l);
+    }
+    return 0;
+}
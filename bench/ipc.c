@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../language.h"
+#include "../stats.h"
+
+/* Measures the cost of crossing the language boundary: an empty call, a
+   callback from the guest into the host, and passing payloads of growing
+   size into the guest. Runs each language both in-process (-u) and in the
+   sandbox, so the difference is what the proxy pipe costs.
+
+   Results go to stdout as a table, and with -o as CSV for plotting or
+   comparing runs. Latencies are in nanoseconds.
+
+   Payloads are only sent one way: the sandbox caps what comes back to the
+   host (MAX_ARRAY_SIZE, MAX_STRING_SIZE), so the guest just returns 0. */
+
+static const char*languages[] = {"py", "lua", "js", "rb", NULL};
+
+#define CALLBACKS_PER_CALL 100
+
+static const char* ipc_script(const char*language)
+{
+    if(!strcmp(language, "py"))
+        return "def noop():\n    pass\n"
+               "def callbacks(n):\n    for i in range(n):\n        ping()\n"
+               "def sink(x):\n    return 0\n";
+    if(!strcmp(language, "lua"))
+        return "function noop()\nend\n"
+               "function callbacks(n)\n    for i=1,n do\n        ping()\n    end\nend\n"
+               "function sink(x)\n    return 0\nend\n";
+    if(!strcmp(language, "rb"))
+        return "def noop\nend\n"
+               "def callbacks(n)\n    n.times { ping() }\nend\n"
+               "def sink(x)\n    return 0\nend\n";
+    return "function noop() {\n}\n"
+           "function callbacks(n) {\n    for(var i=0;i<n;i++) {\n        ping();\n    }\n}\n"
+           "function sink(x) {\n    return 0;\n}\n";
+}
+
+typedef struct _payload {
+    const char*name;
+    char kind;
+    int size;
+} payload_t;
+
+static payload_t payloads[] = {
+    {"int", 'i', 1},
+    {"array", '[', 1024},
+    {"array", '[', 65536},
+    {"array", '[', 1048576},
+    {"string", 's', 1024},
+    {"string", 's', 65536},
+    {"string", 's', 1048576},
+    {NULL, 0, 0},
+};
+
+static double min_time = 1.0;
+static FILE*csv = NULL;
+
+/* time of the previous ping() during a callbacks() call, 0 before the first */
+static uint64_t last_ping = 0;
+static histogram_t*ping_histogram = NULL;
+
+static void ping(void*context)
+{
+    uint64_t t = stats_now();
+    if(last_ping)
+        histogram_add(ping_histogram, t - last_ping);
+    last_ping = t;
+}
+
+static value_t* make_payload(payload_t*p)
+{
+    if(p->kind == 'i')
+        return value_new_int32(42);
+    if(p->kind == 's') {
+        char*s = malloc(p->size + 1);
+        memset(s, 'x', p->size);
+        s[p->size] = 0;
+        value_t*v = value_new_string(s);
+        free(s);
+        return v;
+    }
+    value_t*array = array_new_sized(p->size);
+    int i;
+    for(i=0;i<p->size;i++) {
+        array_append_int32(array, i);
+    }
+    return array;
+}
+
+static int payload_bytes(payload_t*p)
+{
+    return p->kind == 's' ? p->size : p->size * 4;
+}
+
+static void report(const char*language, const char*mode, const char*test, int size,
+                   histogram_t*h, double elapsed, double bytes)
+{
+    uint64_t p50 = histogram_percentile(h, 50);
+    uint64_t p90 = histogram_percentile(h, 90);
+    uint64_t p99 = histogram_percentile(h, 99);
+    uint64_t mean = h->count ? h->sum / h->count : 0;
+    double throughput = bytes / elapsed / (1024 * 1024);
+
+    printf("%-4s %-7s %-9s %8d %8llu %10llu %10llu %10llu %10llu %10.1f MB/s\n",
+            language, mode, test, size, (unsigned long long)h->count,
+            (unsigned long long)p50, (unsigned long long)p90,
+            (unsigned long long)p99, (unsigned long long)mean, throughput);
+    if(csv) {
+        fprintf(csv, "%s,%s,%s,%d,%llu,%llu,%llu,%llu,%llu,%.0f\n",
+                language, mode, test, size, (unsigned long long)h->count,
+                (unsigned long long)p50, (unsigned long long)p90,
+                (unsigned long long)p99, (unsigned long long)mean,
+                bytes / elapsed);
+        fflush(csv);
+    }
+}
+
+static void call_or_die(language_t*l, const char*language, const char*function, value_t*args)
+{
+    value_t*ret = l->call_function(l, function, args);
+    if(!ret) {
+        fprintf(stderr, "%s: %s() failed\n", language, function);
+        exit(1);
+    }
+    value_destroy(ret);
+}
+
+static void bench_call(language_t*l, const char*language, const char*mode,
+                       const char*function, value_t*args, const char*test, int size, int bytes)
+{
+    histogram_t*h = calloc(1, sizeof(histogram_t));
+    /* warm up caches, lazy initialization and the child's heap */
+    call_or_die(l, language, function, args);
+
+    uint64_t start = stats_now();
+    double elapsed;
+    do {
+        uint64_t t = stats_now();
+        call_or_die(l, language, function, args);
+        histogram_add(h, stats_now() - t);
+        elapsed = (stats_now() - start) / 1e9;
+    } while(elapsed < min_time || h->count < 5);
+
+    report(language, mode, test, size, h, elapsed, (double)bytes * h->count);
+    free(h);
+}
+
+static void bench_callbacks(language_t*l, const char*language, const char*mode)
+{
+    histogram_t*h = calloc(1, sizeof(histogram_t));
+    ping_histogram = h;
+
+    value_t*args = array_new();
+    array_append_int32(args, CALLBACKS_PER_CALL);
+    uint64_t start = stats_now();
+    double elapsed;
+    do {
+        last_ping = 0;
+        call_or_die(l, language, "callbacks", args);
+        elapsed = (stats_now() - start) / 1e9;
+    } while(elapsed < min_time);
+    value_destroy(args);
+
+    report(language, mode, "callback", 0, h, elapsed, 0);
+    ping_histogram = NULL;
+    free(h);
+}
+
+static void bench_language(const char*language, bool sandboxed)
+{
+    const char*mode = sandboxed ? "sandbox" : "unsafe";
+    char filename[32];
+    snprintf(filename, sizeof(filename), "bench.%s", language);
+    language_t*l = sandboxed ? interpreter_by_extension(filename) :
+                               unsafe_interpreter_by_extension(filename);
+    if(!l) {
+        fprintf(stderr, "Couldn't initialize interpreter for %s\n", language);
+        exit(1);
+    }
+    define_function(l, "ping", ping, NULL, "", "");
+    if(!l->compile_script(l, ipc_script(language))) {
+        fprintf(stderr, "Couldn't compile benchmark script for %s\n", language);
+        exit(1);
+    }
+
+    value_t*args = array_new();
+    bench_call(l, language, mode, "noop", args, "empty", 0, 0);
+    value_destroy(args);
+
+    bench_callbacks(l, language, mode);
+
+    payload_t*p;
+    for(p=payloads;p->name;p++) {
+        args = array_new();
+        array_append(args, make_payload(p));
+        bench_call(l, language, mode, "sink", args, p->name, p->size, payload_bytes(p));
+        value_destroy(args);
+    }
+    l->destroy(l);
+}
+
+static void usage(const char*name)
+{
+    fprintf(stderr, "Usage: %s [-u|-s] [-t seconds] [-o results.csv] [language ...]\n", name);
+    fprintf(stderr, "  -u  only run in-process (unsafe) interpreters\n");
+    fprintf(stderr, "  -s  only run sandboxed interpreters\n");
+    fprintf(stderr, "  -t  minimum time per measurement (default: 1.0)\n");
+    fprintf(stderr, "  -o  also write results as CSV to this file\n");
+}
+
+int main(int argn, char*argv[])
+{
+    bool unsafe = true, sandboxed = true;
+    int c;
+    while((c = getopt(argn, argv, "ust:o:h")) != -1) {
+        switch(c) {
+            case 'u':
+                sandboxed = false;
+                break;
+            case 's':
+                unsafe = false;
+                break;
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'o':
+                csv = fopen(optarg, "wb");
+                if(!csv) {
+                    perror(optarg);
+                    return 1;
+                }
+                fprintf(csv, "language,mode,test,size,calls,p50_ns,p90_ns,p99_ns,mean_ns,bytes_per_second\n");
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    const char**selected = languages;
+    if(optind < argn) {
+        selected = (const char**)argv + optind;
+    }
+
+    printf("%-4s %-7s %-9s %8s %8s %10s %10s %10s %10s %15s\n",
+            "lang", "mode", "test", "size", "samples", "p50 ns", "p90 ns", "p99 ns", "mean ns", "throughput");
+    int i;
+    for(i=0;selected[i];i++) {
+        if(unsafe)
+            bench_language(selected[i], false);
+        if(sandboxed)
+            bench_language(selected[i], true);
+    }
+    if(csv)
+        fclose(csv);
+    return 0;
+}
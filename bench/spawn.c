@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../language.h"
+#include "../stats.h"
+#include "../settings.h"
+
+/* Measures how long it takes to get a fresh sandbox: start it, compile
+   and call one trivial function, and tear it down again. The proxy's
+   spawn histograms break the start up into fork, closing inherited file
+   descriptors, interpreter initialization and seccomp lockdown.
+
+   With -f, the benchmark first opens that many extra descriptors, the way
+   a busy host process would have them, since the child has to close all
+   of them. -i minimal measures the minimal init profile, -x starts
+   sandboxes through the cagekeeper-sandbox helper.
+
+   Alternative backends are compared by naming them, e.g. "js qjs" in a
+   QUICKJS=1 build. */
+
+static const char*languages[] = {"py", "lua", "js", "rb", NULL};
+
+static const char* hello_script(const char*language)
+{
+    if(!strcmp(language, "py"))
+        return "def hello():\n    return 1\n";
+    if(!strcmp(language, "lua"))
+        return "function hello()\n    return 1\nend\n";
+    if(!strcmp(language, "rb"))
+        return "def hello\n    return 1\nend\n";
+    return "function hello() {\n    return 1;\n}\n";
+}
+
+static const language_stats_t* find_stats(const cagekeeper_stats_t*stats, const char*language)
+{
+    int i;
+    for(i=0;i<stats->num_languages;i++) {
+        if(stats->languages[i].name && !strcmp(stats->languages[i].name, language))
+            return &stats->languages[i];
+    }
+    return NULL;
+}
+
+static void print_histogram(const char*language, const char*phase, const histogram_t*h)
+{
+    printf("%-4s %-16s %8llu %10.1f %10.1f %10.1f %10.1f\n",
+            language, phase, (unsigned long long)h->count,
+            histogram_percentile(h, 50) / 1000.0,
+            histogram_percentile(h, 90) / 1000.0,
+            histogram_percentile(h, 99) / 1000.0,
+            h->count ? h->sum / 1000.0 / h->count : 0.0);
+}
+
+static void bench(const char*language, int count, init_profile_t profile)
+{
+    histogram_t*total = calloc(1, sizeof(histogram_t));
+    histogram_t*teardown = calloc(1, sizeof(histogram_t));
+    value_t*args = array_new();
+    long rss_sum = 0, rss_max = 0;
+    int i;
+    for(i=0;i<count;i++) {
+        uint64_t start = stats_now();
+        language_t*raw = raw_interpreter_by_name(language);
+        if(raw) {
+            raw->init_profile = profile;
+        }
+        language_t*l = wrap_sandbox(raw);
+        if(!l || !l->compile_script(l, hello_script(language))) {
+            fprintf(stderr, "Couldn't start sandbox for %s\n", language);
+            exit(1);
+        }
+        value_t*ret = l->call_function(l, "hello", args);
+        if(!ret) {
+            fprintf(stderr, "%s: hello() failed\n", language);
+            exit(1);
+        }
+        value_destroy(ret);
+        uint64_t t = stats_now();
+        call_stats_t call_stats;
+        if(get_call_stats(l, &call_stats)) {
+            rss_sum += call_stats.max_rss;
+            if(call_stats.max_rss > rss_max)
+                rss_max = call_stats.max_rss;
+        }
+        l->destroy(l);
+        histogram_add(teardown, stats_now() - t);
+        histogram_add(total, t - start);
+    }
+    value_destroy(args);
+
+    cagekeeper_stats_t*stats = cagekeeper_stats_snapshot();
+    const language_stats_t*l = find_stats(stats, language);
+    if(l) {
+        print_histogram(language, "fork", &l->histograms[HISTOGRAM_SPAWN_FORK]);
+        print_histogram(language, "close fds", &l->histograms[HISTOGRAM_SPAWN_CLOSE_FDS]);
+        print_histogram(language, "initialize", &l->histograms[HISTOGRAM_SPAWN_INITIALIZE]);
+        print_histogram(language, "lockdown", &l->histograms[HISTOGRAM_SPAWN_LOCKDOWN]);
+        print_histogram(language, "spawn", &l->histograms[HISTOGRAM_SPAWN]);
+        print_histogram(language, "compile", &l->histograms[HISTOGRAM_COMPILE]);
+        print_histogram(language, "call", &l->histograms[HISTOGRAM_CALL]);
+    }
+    print_histogram(language, "destroy", teardown);
+    print_histogram(language, "total", total);
+    printf("%-4s %-16s %8d %10ld KB mean %10ld KB max\n", language, "child rss", count, rss_sum / count, rss_max);
+    free(stats);
+    free(total);
+    free(teardown);
+}
+
+int main(int argn, char*argv[])
+{
+    int count = 100;
+    int extra_fds = 0;
+    init_profile_t profile = INIT_PROFILE_FULL;
+    int c;
+    while((c = getopt(argn, argv, "n:f:i:xh")) != -1) {
+        switch(c) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'f':
+                extra_fds = atoi(optarg);
+                break;
+            case 'i':
+                profile = strcmp(optarg, "minimal") ? INIT_PROFILE_FULL : INIT_PROFILE_MINIMAL;
+                break;
+            case 'x':
+                config_sandbox_helper = "./cagekeeper-sandbox";
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n spawns] [-f extra_fds] [-i full|minimal] [-x] [language ...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int i;
+    for(i=0;i<extra_fds;i++) {
+        if(open("/dev/null", O_RDONLY) < 0) {
+            perror("/dev/null");
+            return 1;
+        }
+    }
+
+    const char**selected = languages;
+    if(optind < argn) {
+        selected = (const char**)argv + optind;
+    }
+
+    printf("%-4s %-16s %8s %10s %10s %10s %10s\n",
+            "lang", "phase", "samples", "p50 us", "p90 us", "p99 us", "mean us");
+    for(i=0;selected[i];i++) {
+        bench(selected[i], count, profile);
+    }
+    return 0;
+}
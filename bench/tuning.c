@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../language.h"
+#include "../stats.h"
+#include "../settings.h"
+
+/* Runs a numeric, a string-heavy and an allocation-heavy workload under
+   different runtime tunings (see language_tuning_t), to choose the
+   settings for a kind of guest code. Each tuning gets a fresh
+   interpreter, since tunings only take effect in initialize().
+
+   By default, this compares a built-in list of tunings per language; -c
+   (repeatable) runs just the given ones, in language_tuning_parse()
+   syntax. Only javascript and lua (including luajit) have tunable
+   runtimes. */
+
+static const char*languages[] = {"js", "lua", NULL};
+
+static const char*js_tunings[] = {
+    "", "jit=none", "jit=method", "jit=all",
+    "gc_growth=150", "gc_growth=600",
+    "gc_malloc_bytes=8388608",
+    "stack_chunk_size=65536",
+    NULL};
+
+static const char*lua_tunings[] = {
+    "", "gc_growth=100", "gc_growth=400",
+    "gc_stepmul=100", "gc_stepmul=400",
+    "gc_growth=400,gc_stepmul=400",
+    /* luajit only */
+    "jit=none",
+    NULL};
+
+static const char*workloads[] = {"numeric", "strings", "objects", NULL};
+
+static const char* tuning_script(const char*language)
+{
+    if(!strncmp(language, "lua", 3))
+        return "function numeric(n)\n"
+               "    local s = 0\n"
+               "    for i=0,n-1 do\n        s = s + math.sqrt(i) * (i % 7)\n    end\n"
+               "    return math.floor(s) % 1000\n"
+               "end\n"
+               "function strings(n)\n"
+               "    local parts = {}\n"
+               "    for i=1,n do\n        parts[i] = \"item\" .. i\n    end\n"
+               "    local count = 0\n"
+               "    for part in string.gmatch(table.concat(parts, \",\"), \"[^,]+\") do\n        count = count + 1\n    end\n"
+               "    return count\n"
+               "end\n"
+               "function objects(n)\n"
+               "    local list = {}\n"
+               "    for i=1,n do\n        list[i] = {x=i, y={i}}\n    end\n"
+               "    return #list\n"
+               "end\n";
+    return "function numeric(n) {\n"
+           "    var s = 0;\n"
+           "    for(var i=0;i<n;i++) {\n        s += Math.sqrt(i) * (i % 7);\n    }\n"
+           "    return Math.floor(s) % 1000;\n"
+           "}\n"
+           "function strings(n) {\n"
+           "    var parts = [];\n"
+           "    for(var i=0;i<n;i++) {\n        parts.push(\"item\" + i);\n    }\n"
+           "    return parts.join(\",\").split(\",\").length;\n"
+           "}\n"
+           "function objects(n) {\n"
+           "    var list = [];\n"
+           "    for(var i=0;i<n;i++) {\n        list.push({x:i, y:[i]});\n    }\n"
+           "    return list.length;\n"
+           "}\n";
+}
+
+static int workload_size(const char*workload)
+{
+    return strcmp(workload, "numeric") ? 100000 : 1000000;
+}
+
+static language_t* new_interpreter(const char*language, const language_tuning_t*tuning, bool sandboxed)
+{
+    language_t*li = raw_interpreter_by_name(language);
+    if(!li)
+        return NULL;
+    li->tuning = *tuning;
+    if(sandboxed)
+        return wrap_sandbox(li);
+    if(!li->initialize(li, config_maxmem)) {
+        li->destroy(li);
+        return NULL;
+    }
+    return li;
+}
+
+static void bench(const char*language, const char*tuning_string, int calls, bool sandboxed)
+{
+    language_tuning_t tuning;
+    memset(&tuning, 0, sizeof(tuning));
+    if(!language_tuning_parse(&tuning, tuning_string)) {
+        fprintf(stderr, "Invalid tuning: %s\n", tuning_string);
+        exit(1);
+    }
+    language_t*l = new_interpreter(language, &tuning, sandboxed);
+    if(!l || !l->compile_script(l, tuning_script(language))) {
+        fprintf(stderr, "Couldn't start interpreter for %s with tuning \"%s\"\n", language, tuning_string);
+        exit(1);
+    }
+
+    const char**workload;
+    for(workload=workloads;*workload;workload++) {
+        histogram_t*h = calloc(1, sizeof(histogram_t));
+        value_t*args = array_new();
+        array_append_int32(args, workload_size(*workload));
+        uint64_t peak_heap = 0;
+        int gc_collections = 0;
+        int i;
+        /* the first call warms up the JITs */
+        for(i=0;i<=calls;i++) {
+            uint64_t start = stats_now();
+            value_t*ret = l->call_function(l, *workload, args);
+            uint64_t duration = stats_now() - start;
+            if(!ret) {
+                fprintf(stderr, "%s: %s() failed with tuning \"%s\"\n", language, *workload, tuning_string);
+                exit(1);
+            }
+            value_destroy(ret);
+            if(!i)
+                continue;
+            histogram_add(h, duration);
+            call_stats_t stats;
+            if(get_call_stats(l, &stats)) {
+                if(stats.peak_heap > peak_heap)
+                    peak_heap = stats.peak_heap;
+                gc_collections += stats.gc_collections;
+            }
+        }
+        value_destroy(args);
+
+        printf("%-4s %-32s %-8s %10.2f %10.2f %10.2f %10llu %6d\n",
+                language, *tuning_string ? tuning_string : "(defaults)", *workload,
+                histogram_percentile(h, 50) / 1e6,
+                histogram_percentile(h, 90) / 1e6,
+                h->sum / 1e6 / h->count,
+                (unsigned long long)peak_heap / 1024, gc_collections);
+        free(h);
+    }
+    l->destroy(l);
+}
+
+static void usage(const char*name)
+{
+    fprintf(stderr, "Usage: %s [-n calls] [-s] [-c tuning ...] [language ...]\n", name);
+    fprintf(stderr, "  -n  calls per workload and tuning (default: 20)\n");
+    fprintf(stderr, "  -s  run in the sandbox instead of in-process\n");
+    fprintf(stderr, "  -c  compare this tuning, e.g. jit=method,gc_growth=150 (repeatable)\n");
+}
+
+int main(int argn, char*argv[])
+{
+    int calls = 20;
+    bool sandboxed = false;
+    const char*custom[32];
+    int num_custom = 0;
+    int c;
+    while((c = getopt(argn, argv, "n:sc:h")) != -1) {
+        switch(c) {
+            case 'n':
+                calls = atoi(optarg);
+                break;
+            case 's':
+                sandboxed = true;
+                break;
+            case 'c':
+                if(num_custom < 31)
+                    custom[num_custom++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    custom[num_custom] = NULL;
+    if(calls < 1)
+        calls = 1;
+
+    const char**selected = languages;
+    if(optind < argn) {
+        selected = (const char**)argv + optind;
+    }
+
+    printf("%-4s %-32s %-8s %10s %10s %10s %10s %6s\n",
+            "lang", "tuning", "workload", "p50 ms", "p90 ms", "mean ms", "heap KB", "gcs");
+    int i;
+    for(i=0;selected[i];i++) {
+        const char**tunings = num_custom ? custom :
+                              !strncmp(selected[i], "lua", 3) ? lua_tunings : js_tunings;
+        const char**t;
+        for(t=tunings;*t;t++) {
+            bench(selected[i], *t, calls, sandboxed);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "dict.h"
+#include "cache.h"
+#include "settings.h"
+
+typedef struct _blob {
+    int len;
+    char data[0];
+} blob_t;
+
+struct _compile_cache {
+    char*directory;
+    /* guards entries and size. Files are written under a temporary name and
+       renamed, so they don't need it. */
+    pthread_mutex_t mutex;
+    dict_t*entries;
+    int size;
+    int max_size;
+};
+
+compile_cache_t* compile_cache_new(const char*directory, int max_size)
+{
+    compile_cache_t*cache = calloc(1, sizeof(compile_cache_t));
+    cache->entries = dict_new(&charptr_type);
+    cache->max_size = max_size;
+    pthread_mutex_init(&cache->mutex, NULL);
+    if(directory) {
+        cache->directory = strdup(directory);
+        mkdir_p(directory);
+    }
+    return cache;
+}
+
+/* bytecode is only valid for the build of the runtime that produced it
+   (and e.g. Lua doesn't verify it), so the version is part of the key */
+static char* make_key(const char*language, const char*version, const char*script)
+{
+    return allocprintf("%s\n%s\n%s", language, version ? version : "", script);
+}
+
+/* the file name only needs to narrow down the search; the file itself
+   contains the full key, which is compared on lookup */
+static char* make_filename(compile_cache_t*cache, const char*language, const char*version, const char*key)
+{
+    char name[96];
+    if(!version)
+        version = "";
+    snprintf(name, sizeof(name), "%.32s-%08x-%08x-%x", language, hash_block(version, strlen(version)),
+             hash_block(key, strlen(key)), (int)strlen(key));
+    return concat_paths(cache->directory, name);
+}
+
+static blob_t* blob_new(const void*data, int len)
+{
+    blob_t*blob = malloc(sizeof(blob_t) + len);
+    blob->len = len;
+    memcpy(blob->data, data, len);
+    return blob;
+}
+
+/* called with the mutex held */
+static void cache_put(compile_cache_t*cache, const char*key, blob_t*blob)
+{
+    int size = strlen(key) + blob->len;
+    if(size > cache->max_size) {
+        free(blob);
+        return;
+    }
+    if(cache->size + size > cache->max_size) {
+        /* no eviction order to speak of, so just start over */
+        dict_destroy_with_data(cache->entries);
+        cache->entries = dict_new(&charptr_type);
+        cache->size = 0;
+    }
+    blob_t*old = dict_lookup(cache->entries, key);
+    if(old) {
+        dict_del(cache->entries, key);
+        cache->size -= strlen(key) + old->len;
+        free(old);
+    }
+    dict_put(cache->entries, key, blob);
+    cache->size += size;
+}
+
+/* file layout: key length (int), key, bytecode */
+static blob_t* load_file(const char*filename, const char*key)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(int)) {
+        close(fd);
+        return NULL;
+    }
+    char*map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    blob_t*blob = NULL;
+    int key_len = strlen(key);
+    int stored_len = *(int*)map;
+    if(stored_len == key_len && sizeof(int) + key_len <= st.st_size &&
+       !memcmp(map + sizeof(int), key, key_len)) {
+        int offset = sizeof(int) + key_len;
+        blob = blob_new(map + offset, st.st_size - offset);
+    }
+    munmap(map, st.st_size);
+    return blob;
+}
+
+static void store_file(const char*filename, const char*key, const void*data, int len)
+{
+    char*tmp = allocprintf("%s.XXXXXX", filename);
+    int fd = mkstemp(tmp);
+    FILE*fi = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(!fi) {
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        return;
+    }
+    int key_len = strlen(key);
+    bool ok = fwrite(&key_len, sizeof(key_len), 1, fi) == 1 &&
+              fwrite(key, key_len, 1, fi) == 1 &&
+              (!len || fwrite(data, len, 1, fi) == 1);
+    ok = !fclose(fi) && ok;
+    if(!ok || rename(tmp, filename) < 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+bool compile_cache_lookup(compile_cache_t*cache, const char*language, const char*version, const char*script, void**data, int*len)
+{
+    char*key = make_key(language, version, script);
+    pthread_mutex_lock(&cache->mutex);
+    blob_t*blob = dict_lookup(cache->entries, key);
+    if(blob) {
+        *data = memdup(blob->data, blob->len);
+        *len = blob->len;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    if(!blob && cache->directory) {
+        char*filename = make_filename(cache, language, version, key);
+        blob = load_file(filename, key);
+        free(filename);
+        if(blob) {
+            *data = memdup(blob->data, blob->len);
+            *len = blob->len;
+            pthread_mutex_lock(&cache->mutex);
+            cache_put(cache, key, blob);
+            pthread_mutex_unlock(&cache->mutex);
+        }
+    }
+    free(key);
+    return blob != NULL;
+}
+
+void compile_cache_store(compile_cache_t*cache, const char*language, const char*version, const char*script, const void*data, int len)
+{
+    char*key = make_key(language, version, script);
+    pthread_mutex_lock(&cache->mutex);
+    cache_put(cache, key, blob_new(data, len));
+    pthread_mutex_unlock(&cache->mutex);
+    if(cache->directory) {
+        char*filename = make_filename(cache, language, version, key);
+        store_file(filename, key, data, len);
+        free(filename);
+    }
+    free(key);
+}
+
+void compile_cache_destroy(compile_cache_t*cache)
+{
+    dict_destroy_with_data(cache->entries);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->directory);
+    free(cache);
+}
+
+static compile_cache_t*global_cache = NULL;
+static pthread_once_t global_cache_once = PTHREAD_ONCE_INIT;
+
+static void create_global_cache()
+{
+    global_cache = compile_cache_new(config_compile_cache_dir, config_compile_cache_size);
+}
+
+compile_cache_t* compile_cache_global()
+{
+    pthread_once(&global_cache_once, create_global_cache);
+    return global_cache;
+}
@@ -0,0 +1,22 @@
+#ifndef __cache_h__
+#define __cache_h__
+
+#include <stdbool.h>
+
+/* Content-addressed cache of compiled scripts, keyed by language, runtime
+   version (language_t.version) and script source. Entries are bytecode
+   blobs as produced by a language's compile_to_bytecode(). If a directory
+   is given, entries are also stored there (one file per script), so they
+   survive restarts. Lookups and stores are thread safe. */
+
+typedef struct _compile_cache compile_cache_t;
+
+compile_cache_t* compile_cache_new(const char*directory, int max_size);
+bool compile_cache_lookup(compile_cache_t*cache, const char*language, const char*version, const char*script, void**data, int*len);
+void compile_cache_store(compile_cache_t*cache, const char*language, const char*version, const char*script, const void*data, int len);
+void compile_cache_destroy(compile_cache_t*cache);
+
+/* process wide cache, configured through config_compile_cache* */
+compile_cache_t* compile_cache_global();
+
+#endif
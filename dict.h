@@ -85,6 +85,7 @@ void dict_free_all(dict_t*h, char free_keys, void (*free_data_function)(void*));
 void dict_clear(dict_t*h);
 void dict_destroy_shallow(dict_t*dict);
 void dict_destroy(dict_t*dict);
+void dict_destroy_with_data(dict_t*dict);
 #define DICT_ITERATE_DATA(d,t,v) \
     int v##_i;dictentry_t*v##_e;t v;\
     for(v##_i=0;v##_i<(d)->hashsize;v##_i++) \
@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ffi.h>
 #include "util.h"
 #include "function.h"
+#include "probes.h"
 
 value_t empty_array = {
     type: TYPE_ARRAY,
@@ -95,34 +97,146 @@ const char* type_to_string(type_t type)
     }
 }
 
-value_t* value_clone(const value_t*src)
+void walk_stack_init(walk_stack_t*stack, int frame_size)
+{
+    memset(stack, 0, sizeof(walk_stack_t));
+    stack->frame_size = frame_size;
+}
+
+void* walk_stack_push(walk_stack_t*stack)
+{
+    if(stack->num == stack->size) {
+        stack->size = stack->size * 2 + 16;
+        stack->frames = realloc(stack->frames, stack->size * stack->frame_size);
+    }
+    return stack->frames + (stack->num++) * stack->frame_size;
+}
+
+void* walk_stack_top(walk_stack_t*stack)
+{
+    if(!stack->num)
+        return NULL;
+    return stack->frames + (stack->num - 1) * stack->frame_size;
+}
+
+void walk_stack_pop(walk_stack_t*stack)
 {
+    assert(stack->num > 0);
+    stack->num--;
+}
+
+void walk_stack_destroy(walk_stack_t*stack)
+{
+    free(stack->frames);
+    stack->frames = NULL;
+    stack->num = stack->size = 0;
+}
+
+typedef struct _walk_frame {
+    value_t*array;
+    int pos;
+} walk_frame_t;
+
+bool value_walk(value_t*v, const value_visitor_t*visitor, void*context)
+{
+    if(!visitor->visit(context, v, -1))
+        return false;
+    if(v->type != TYPE_ARRAY)
+        return true;
+
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(walk_frame_t));
+    walk_frame_t*frame = walk_stack_push(&stack);
+    frame->array = v;
+    frame->pos = 0;
+
+    while((frame = walk_stack_top(&stack))) {
+        if(frame->pos == frame->array->length) {
+            value_t*array = frame->array;
+            walk_stack_pop(&stack);
+            if(visitor->leave && !visitor->leave(context, array))
+                break;
+            continue;
+        }
+        int index = frame->pos++;
+        value_t*entry = frame->array->data[index];
+        if(!visitor->visit(context, entry, index))
+            break;
+        if(entry->type == TYPE_ARRAY) {
+            frame = walk_stack_push(&stack);
+            frame->array = entry;
+            frame->pos = 0;
+        }
+    }
+    bool complete = !stack.num;
+    walk_stack_destroy(&stack);
+    return complete;
+}
+
+typedef struct _clone_context {
+    walk_stack_t stack;
+    value_t*root;
+} clone_context_t;
+
+static bool clone_visit(void*_context, value_t*src, int index)
+{
+    clone_context_t*context = _context;
+    value_t*v;
     switch(src->type) {
         case TYPE_VOID:
+            v = value_new_void();
         break;
         case TYPE_FLOAT32:
-            return value_new_float32(src->f32);
+            v = value_new_float32(src->f32);
         break;
         case TYPE_INT32:
-            return value_new_int32(src->i32);
+            v = value_new_int32(src->i32);
         break;
         case TYPE_BOOLEAN:
-            return value_new_boolean(src->b);
+            v = value_new_boolean(src->b);
         break;
         case TYPE_STRING:
-            return value_new_string(src->str);
+            v = value_new_string(src->str);
         break;
-        case TYPE_ARRAY: {
-            value_t*array = array_new();
-            int i;
-            for(i=0;i<src->length;i++) {
-                array_append(array, value_clone(src->data[i]));
-            }
-            return array;
-        }
+        case TYPE_ARRAY:
+            v = array_new_sized(src->length);
         break;
+        default:
+            return false;
     }
-    return NULL;
+    value_t**parent = walk_stack_top(&context->stack);
+    if(parent) {
+        array_append(*parent, v);
+    } else {
+        context->root = v;
+    }
+    if(v->type == TYPE_ARRAY) {
+        *(value_t**)walk_stack_push(&context->stack) = v;
+    }
+    return true;
+}
+
+static bool clone_leave(void*_context, value_t*array)
+{
+    clone_context_t*context = _context;
+    walk_stack_pop(&context->stack);
+    return true;
+}
+
+value_t* value_clone(const value_t*src)
+{
+    static const value_visitor_t clone_visitor = {clone_visit, clone_leave};
+    clone_context_t context;
+    walk_stack_init(&context.stack, sizeof(value_t*));
+    context.root = NULL;
+    bool ok = value_walk((value_t*)src, &clone_visitor, &context);
+    walk_stack_destroy(&context.stack);
+    if(!ok) {
+        if(context.root)
+            value_destroy(context.root);
+        return NULL;
+    }
+    return context.root;
 }
 
 static ffi_type* _type_to_ffi_type(type_t type)
@@ -414,7 +528,9 @@ value_t* cfunction_call(value_t*self, value_t*_args)
 #ifdef DEBUG
     printf("[ffi] call: "); dump_ffi_call(&cif);
 #endif
+    PROBE2(cfunction__entry, f->name, _args->length);
     ffi_call(&cif, f->call, &ret_raw, ffi_args);
+    PROBE1(cfunction__return, f->name);
 
     free(atypes);
     type_t ret_type = sig->ret;
@@ -451,12 +567,10 @@ value_t* cfunction_call(value_t*self, value_t*_args)
     return ret;
 }
 
-void value_dump(value_t*v)
+static bool dump_visit(void*context, value_t*v, int index)
 {
-    if(v == NULL) {
-        printf("NULL value (error)");
-        return;
-    }
+    if(index>0)
+        printf(", ");
 
     switch(v->type) {
         case TYPE_VOID:
@@ -474,22 +588,31 @@ void value_dump(value_t*v)
         case TYPE_STRING:
             printf("\"%s\"", v->str);
         break;
-        case TYPE_ARRAY: {
-            int i;
+        case TYPE_ARRAY:
             printf("[");
-            for(i=0;i<v->length;i++) {
-                if(i>0)
-                    printf(", ");
-                value_dump(v->data[i]);
-            }
-            printf("]");
-        }
         break;
         default: {
             printf("type<%d>", v->type);
         }
         break;
     }
+    return true;
+}
+
+static bool dump_leave(void*context, value_t*array)
+{
+    printf("]");
+    return true;
+}
+
+void value_dump(value_t*v)
+{
+    static const value_visitor_t dump_visitor = {dump_visit, dump_leave};
+    if(v == NULL) {
+        printf("NULL value (error)");
+        return;
+    }
+    value_walk(v, &dump_visitor, NULL);
 }
 void array_append(value_t*array, value_t* value)
 {
@@ -551,15 +674,31 @@ static void value_destroy_string(value_t*v)
 
 static void value_destroy_array(value_t*v)
 {
-    array_internal_t*internal = v->internal;
-    int i;
-    for(i=0;i<v->length;i++) {
-       value_destroy(v->data[i]);
-       v->data[i] = NULL;
+    /* nested arrays are put on a stack instead of recursing into
+       value_destroy() */
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(value_t*));
+    *(value_t**)walk_stack_push(&stack) = v;
+
+    value_t**top;
+    while((top = walk_stack_top(&stack))) {
+        value_t*array = *top;
+        walk_stack_pop(&stack);
+        int i;
+        for(i=0;i<array->length;i++) {
+            value_t*entry = array->data[i];
+            if(entry->type == TYPE_ARRAY && entry->destroy == value_destroy_array) {
+                *(value_t**)walk_stack_push(&stack) = entry;
+            } else {
+                value_destroy(entry);
+            }
+            array->data[i] = NULL;
+        }
+        free(array->data);
+        free(array->internal);
+        free(array);
     }
-    free(v->data);
-    free(v->internal);
-    free(v);
+    walk_stack_destroy(&stack);
 }
 
 static void value_destroy_cfunction(value_t*v)
@@ -629,6 +768,17 @@ value_t* array_new()
     return value_new_array();
 }
 
+value_t* array_new_sized(int size)
+{
+    value_t*v = value_new_array();
+    if(size > 0) {
+        array_internal_t*internal = v->internal;
+        internal->size = size;
+        v->data = malloc(size * sizeof(void*));
+    }
+    return v;
+}
+
 value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*context, const char*params, const char*ret)
 {
     c_function_def_t*f = calloc(sizeof(c_function_def_t), 1);
@@ -648,6 +798,172 @@ value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*co
     return v;
 }
 
+bool signature_is_valid(const char*types)
+{
+    const char*t;
+    for(t=types; *t; t++) {
+        if(!strchr("bifs[BIFS", *t))
+            return false;
+    }
+    return true;
+}
+
+static bool _is_number(value_t*v)
+{
+    return v->type == TYPE_INT32 || v->type == TYPE_FLOAT32;
+}
+
+/* floats are only ints if they convert exactly. This rejects fractions,
+   NaN, infinities and anything outside of the int32 range. */
+static bool _is_int32(value_t*v)
+{
+    if(v->type == TYPE_INT32)
+        return true;
+    if(v->type != TYPE_FLOAT32)
+        return false;
+    if(!(v->f32 >= -2147483648.0f && v->f32 < 2147483648.0f))
+        return false;
+    return v->f32 == (float)(int32_t)v->f32;
+}
+
+bool value_matches_type(value_t*v, char type)
+{
+    int i;
+    switch(type) {
+        case 'b':
+            return v->type == TYPE_BOOLEAN;
+        case 'i':
+            return _is_int32(v);
+        case 'f':
+            return _is_number(v);
+        case 's':
+            return v->type == TYPE_STRING;
+        case '[':
+            return v->type == TYPE_ARRAY;
+        case 'B':
+        case 'I':
+        case 'F':
+        case 'S':
+            if(v->type != TYPE_ARRAY)
+                return false;
+            for(i=0;i<v->length;i++) {
+                if(!value_matches_type(v->data[i], type - 'A' + 'a'))
+                    return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char* type_code_to_string(char type)
+{
+    switch(type) {
+        case '\0': return "void";
+        case 'b': return "boolean";
+        case 'i': return "int32";
+        case 'f': return "float32";
+        case 's': return "string";
+        case '[': return "array";
+        case 'B': return "boolean[]";
+        case 'I': return "int32[]";
+        case 'F': return "float32[]";
+        case 'S': return "string[]";
+        default: return "<unknown>";
+    }
+}
+
+bool signature_is_flat(const char*types)
+{
+    return !strchr(types, '[');
+}
+
+static bool typed_read(typed_reader_t*r, void*data, int len)
+{
+    if(len > r->len - r->pos)
+        return false;
+    memcpy(data, r->data + r->pos, len);
+    r->pos += len;
+    return true;
+}
+
+bool typed_read_boolean(typed_reader_t*r, bool*b)
+{
+    uint8_t byte;
+    if(!typed_read(r, &byte, 1))
+        return false;
+    *b = !!byte;
+    return true;
+}
+
+bool typed_read_int32(typed_reader_t*r, int32_t*i32)
+{
+    return typed_read(r, i32, sizeof(*i32));
+}
+
+bool typed_read_float32(typed_reader_t*r, float*f32)
+{
+    return typed_read(r, f32, sizeof(*f32));
+}
+
+bool typed_read_string(typed_reader_t*r, const char**s, int*len)
+{
+    int32_t l;
+    if(!typed_read_int32(r, &l) || l < 0 || l > r->len - r->pos)
+        return false;
+    *s = r->data + r->pos;
+    *len = l;
+    r->pos += l;
+    return true;
+}
+
+bool typed_read_length(typed_reader_t*r, int*length)
+{
+    int32_t l;
+    /* every entry takes at least one byte */
+    if(!typed_read_int32(r, &l) || l < 0 || l > r->len - r->pos)
+        return false;
+    *length = l;
+    return true;
+}
+
+void typed_write(typed_writer_t*w, const void*data, int len)
+{
+    if(w->len + len > w->size) {
+        w->size = (w->len + len) * 2 + 64;
+        w->data = realloc(w->data, w->size);
+    }
+    memcpy(w->data + w->len, data, len);
+    w->len += len;
+}
+
+void typed_write_boolean(typed_writer_t*w, bool b)
+{
+    uint8_t byte = b;
+    typed_write(w, &byte, 1);
+}
+
+void typed_write_int32(typed_writer_t*w, int32_t i32)
+{
+    typed_write(w, &i32, sizeof(i32));
+}
+
+void typed_write_float32(typed_writer_t*w, float f32)
+{
+    typed_write(w, &f32, sizeof(f32));
+}
+
+void typed_write_string(typed_writer_t*w, const char*s, int len)
+{
+    typed_write_int32(w, len);
+    typed_write(w, s, len);
+}
+
+void typed_write_length(typed_writer_t*w, int length)
+{
+    typed_write_int32(w, length);
+}
+
 int value_to_int(value_t*v)
 {
     switch(v->type) {
@@ -671,3 +987,458 @@ int value_to_int(value_t*v)
     }
 }
 
+
+/* ------------------------------- JSON ------------------------------- */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct _json_writer {
+    char*data;
+    int len;
+    int size;
+} json_writer_t;
+
+static void json_append(json_writer_t*w, const char*s, int len)
+{
+    if(w->len + len + 1 > w->size) {
+        w->size = (w->len + len + 1) * 2;
+        w->data = realloc(w->data, w->size);
+    }
+    memcpy(w->data + w->len, s, len);
+    w->len += len;
+    w->data[w->len] = 0;
+}
+
+/* Returns a pointer to the first '"', '\' or control character in [p,end),
+   or end. Checks 16 bytes at a time if SSE2 is available. */
+static const char* json_scan_string(const char*p, const char*end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i max_ctrl = _mm_set1_epi8(0x1f);
+    while(end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                             _mm_cmpeq_epi8(chunk, backslash)),
+                _mm_cmpeq_epi8(_mm_min_epu8(chunk, max_ctrl), chunk));
+        int mask = _mm_movemask_epi8(special);
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while(p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) {
+        p++;
+    }
+    return p;
+}
+
+static const char* json_skip_whitespace(const char*p, const char*end)
+{
+    while(p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+static int json_hex4(const char*p, const char*end)
+{
+    int i, v = 0;
+    if(end - p < 4)
+        return -1;
+    for(i=0;i<4;i++) {
+        char c = p[i];
+        v <<= 4;
+        if(c >= '0' && c <= '9') v |= c - '0';
+        else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+static void json_append_utf8(json_writer_t*w, int c)
+{
+    char tmp[4];
+    if(c < 0x80) {
+        tmp[0] = c;
+        json_append(w, tmp, 1);
+    } else if(c < 0x800) {
+        tmp[0] = 0xc0 | (c >> 6);
+        tmp[1] = 0x80 | (c & 0x3f);
+        json_append(w, tmp, 2);
+    } else if(c < 0x10000) {
+        tmp[0] = 0xe0 | (c >> 12);
+        tmp[1] = 0x80 | ((c >> 6) & 0x3f);
+        tmp[2] = 0x80 | (c & 0x3f);
+        json_append(w, tmp, 3);
+    } else {
+        tmp[0] = 0xf0 | (c >> 18);
+        tmp[1] = 0x80 | ((c >> 12) & 0x3f);
+        tmp[2] = 0x80 | ((c >> 6) & 0x3f);
+        tmp[3] = 0x80 | (c & 0x3f);
+        json_append(w, tmp, 4);
+    }
+}
+
+static value_t* _value_new_string_nocopy(char*s)
+{
+    value_t*v = calloc(sizeof(value_t),1);
+    v->destroy = value_destroy_string;
+    v->type = TYPE_STRING;
+    v->str = s;
+    return v;
+}
+
+/* p points behind the opening quote */
+static value_t* json_parse_string(const char**_p, const char*end)
+{
+    const char*p = *_p;
+    const char*stop = json_scan_string(p, end);
+    if(stop < end && *stop == '"') {
+        /* fast path: no escapes */
+        char*s = malloc(stop - p + 1);
+        memcpy(s, p, stop - p);
+        s[stop - p] = 0;
+        *_p = stop + 1;
+        return _value_new_string_nocopy(s);
+    }
+
+    json_writer_t w = {0};
+    json_append(&w, "", 0);
+    while(1) {
+        json_append(&w, p, stop - p);
+        p = stop;
+        if(p >= end || (unsigned char)*p < 0x20)
+            goto error;
+        if(*p == '"')
+            break;
+        /* backslash */
+        if(++p >= end)
+            goto error;
+        char c = *p++;
+        switch(c) {
+            case '"': json_append(&w, "\"", 1); break;
+            case '\\': json_append(&w, "\\", 1); break;
+            case '/': json_append(&w, "/", 1); break;
+            case 'b': json_append(&w, "\b", 1); break;
+            case 'f': json_append(&w, "\f", 1); break;
+            case 'n': json_append(&w, "\n", 1); break;
+            case 'r': json_append(&w, "\r", 1); break;
+            case 't': json_append(&w, "\t", 1); break;
+            case 'u': {
+                int u = json_hex4(p, end);
+                if(u < 0)
+                    goto error;
+                p += 4;
+                if(u >= 0xd800 && u < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    int low = json_hex4(p+2, end);
+                    if(low >= 0xdc00 && low < 0xe000) {
+                        u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                }
+                if(u >= 0xd800 && u < 0xe000) {
+                    /* unpaired surrogates aren't valid UTF-8 */
+                    u = 0xfffd;
+                }
+                json_append_utf8(&w, u);
+            }
+            break;
+            default:
+                goto error;
+        }
+        stop = json_scan_string(p, end);
+    }
+    *_p = p + 1;
+    return _value_new_string_nocopy(w.data);
+error:
+    free(w.data);
+    return NULL;
+}
+
+static value_t* json_parse_number(const char**_p, const char*end)
+{
+    const char*p = *_p;
+    const char*start = p;
+    bool negative = false;
+    if(p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+    if(*p == '0' && p+1 < end && p[1] >= '0' && p[1] <= '9')
+        return NULL;
+
+    /* integers that fit into 32 bits are the common case */
+    int64_t i = 0;
+    while(p < end && *p >= '0' && *p <= '9' && i <= INT32_MAX) {
+        i = i * 10 + (*p - '0');
+        p++;
+    }
+    if(p >= end || (*p != '.' && *p != 'e' && *p != 'E' && (*p < '0' || *p > '9'))) {
+        if(negative)
+            i = -i;
+        if(i >= INT32_MIN && i <= INT32_MAX) {
+            *_p = p;
+            return value_new_int32((int32_t)i);
+        }
+    }
+
+    /* the rest of the integer part, then fraction and exponent. Both need
+       at least one digit, which strtod() doesn't insist on. */
+    while(p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    if(p < end && *p == '.') {
+        p++;
+        if(p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while(p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if(p < end && (*p == '+' || *p == '-'))
+            p++;
+        if(p >= end || *p < '0' || *p > '9')
+            return NULL;
+        while(p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    char tmp[64];
+    if(p - start >= sizeof(tmp))
+        return NULL;
+    memcpy(tmp, start, p - start);
+    tmp[p - start] = 0;
+    char*tmp_end;
+    double d = strtod(tmp, &tmp_end);
+    if(tmp_end != tmp + (p - start))
+        return NULL;
+    *_p = p;
+    return value_new_float32(d);
+}
+
+static bool json_match(const char**p, const char*end, const char*literal)
+{
+    int l = strlen(literal);
+    if(end - *p < l || memcmp(*p, literal, l))
+        return false;
+    *p += l;
+    return true;
+}
+
+typedef struct _json_frame {
+    value_t*array;
+    value_t*key;
+    bool is_object;
+} json_frame_t;
+
+/* Parse a JSON document. JSON objects are returned as arrays of [key, value]
+   pairs, since there's no dictionary type. Returns NULL on syntax errors. */
+value_t* value_from_json(const char*json, int len)
+{
+    const char*p = json;
+    const char*end = json + (len < 0 ? strlen(json) : len);
+
+    /* explicit stack, so deeply nested documents don't exhaust the C stack */
+    json_frame_t*stack = NULL;
+    int depth = 0;
+    int stack_size = 0;
+    value_t*v = NULL;
+
+    while(1) {
+        p = json_skip_whitespace(p, end);
+        if(p >= end)
+            goto error;
+
+        /* parse a value, or open a new array/object */
+        switch(*p) {
+            case '[':
+            case '{': {
+                if(depth == stack_size) {
+                    stack_size = stack_size * 2 + 16;
+                    stack = realloc(stack, stack_size * sizeof(json_frame_t));
+                }
+                json_frame_t*frame = &stack[depth++];
+                frame->array = array_new();
+                frame->key = NULL;
+                frame->is_object = *p++ == '{';
+                p = json_skip_whitespace(p, end);
+                if(p < end && *p == (frame->is_object ? '}' : ']')) {
+                    p++;
+                    v = frame->array;
+                    depth--;
+                    break;
+                }
+                if(frame->is_object) {
+                    if(p >= end || *p++ != '"' || !(frame->key = json_parse_string(&p, end)))
+                        goto error;
+                    p = json_skip_whitespace(p, end);
+                    if(p >= end || *p++ != ':')
+                        goto error;
+                }
+                continue;
+            }
+            case '"':
+                p++;
+                v = json_parse_string(&p, end);
+            break;
+            case 't':
+                v = json_match(&p, end, "true") ? value_new_boolean(true) : NULL;
+            break;
+            case 'f':
+                v = json_match(&p, end, "false") ? value_new_boolean(false) : NULL;
+            break;
+            case 'n':
+                v = json_match(&p, end, "null") ? value_new_void() : NULL;
+            break;
+            default:
+                v = json_parse_number(&p, end);
+            break;
+        }
+        if(!v)
+            goto error;
+
+        /* store the value in its container, closing containers as we go */
+        while(1) {
+            if(!depth) {
+                p = json_skip_whitespace(p, end);
+                if(p != end)
+                    goto error;
+                free(stack);
+                return v;
+            }
+            json_frame_t*frame = &stack[depth-1];
+            if(frame->is_object) {
+                value_t*pair = array_new();
+                array_append(pair, frame->key);
+                array_append(pair, v);
+                frame->key = NULL;
+                v = pair;
+            }
+            array_append(frame->array, v);
+            v = NULL;
+
+            p = json_skip_whitespace(p, end);
+            if(p >= end)
+                goto error;
+            if(*p == ',') {
+                p++;
+                if(frame->is_object) {
+                    p = json_skip_whitespace(p, end);
+                    if(p >= end || *p++ != '"' || !(frame->key = json_parse_string(&p, end)))
+                        goto error;
+                    p = json_skip_whitespace(p, end);
+                    if(p >= end || *p++ != ':')
+                        goto error;
+                }
+                break;
+            }
+            if(*p != (frame->is_object ? '}' : ']'))
+                goto error;
+            p++;
+            v = frame->array;
+            depth--;
+        }
+    }
+
+error:
+    if(v)
+        value_destroy(v);
+    while(depth) {
+        json_frame_t*frame = &stack[--depth];
+        if(frame->key)
+            value_destroy(frame->key);
+        value_destroy(frame->array);
+    }
+    free(stack);
+    return NULL;
+}
+
+static void json_write_string(json_writer_t*w, const char*s)
+{
+    const char*end = s + strlen(s);
+    json_append(w, "\"", 1);
+    while(1) {
+        const char*stop = json_scan_string(s, end);
+        json_append(w, s, stop - s);
+        if(stop == end)
+            break;
+        char tmp[8];
+        switch(*stop) {
+            case '"': json_append(w, "\\\"", 2); break;
+            case '\\': json_append(w, "\\\\", 2); break;
+            case '\n': json_append(w, "\\n", 2); break;
+            case '\r': json_append(w, "\\r", 2); break;
+            case '\t': json_append(w, "\\t", 2); break;
+            default:
+                sprintf(tmp, "\\u%04x", (unsigned char)*stop);
+                json_append(w, tmp, 6);
+            break;
+        }
+        s = stop + 1;
+    }
+    json_append(w, "\"", 1);
+}
+
+static bool json_write_visit(void*context, value_t*v, int index)
+{
+    json_writer_t*w = context;
+    char tmp[32];
+    if(index>0)
+        json_append(w, ",", 1);
+
+    switch(v->type) {
+        case TYPE_FLOAT32:
+            if(v->f32 != v->f32 || v->f32 - v->f32 != 0) {
+                /* NaN and infinity */
+                json_append(w, "null", 4);
+            } else {
+                json_append(w, tmp, sprintf(tmp, "%.9g", v->f32));
+            }
+        break;
+        case TYPE_INT32:
+            json_append(w, tmp, sprintf(tmp, "%d", v->i32));
+        break;
+        case TYPE_BOOLEAN:
+            if(v->b)
+                json_append(w, "true", 4);
+            else
+                json_append(w, "false", 5);
+        break;
+        case TYPE_STRING:
+            json_write_string(w, v->str);
+        break;
+        case TYPE_ARRAY:
+            json_append(w, "[", 1);
+        break;
+        default:
+            json_append(w, "null", 4);
+        break;
+    }
+    return true;
+}
+
+static bool json_write_leave(void*context, value_t*array)
+{
+    json_append((json_writer_t*)context, "]", 1);
+    return true;
+}
+
+char* value_to_json(value_t*v)
+{
+    static const value_visitor_t json_visitor = {json_write_visit, json_write_leave};
+    json_writer_t w = {0};
+    json_append(&w, "", 0);
+    value_walk(v, &json_visitor, &w);
+    return w.data;
+}
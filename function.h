@@ -49,12 +49,91 @@ value_t* value_new_int32(int32_t i32);
 value_t* value_new_cfunction(void*runtime, const char*name, fptr_t call, void*context, const char*params, const char*ret);
 value_t* value_new_array();
 
+/* Iterative traversal of nested values, in bounded C stack space.
+   visit() is called for every value (arrays before their entries), with
+   the position in the parent array, or -1 for the root. leave() is called
+   for arrays after their last entry. Returning false from either
+   callback stops the walk, and makes value_walk() return false. */
+typedef struct _value_visitor {
+    bool (*visit)(void*context, value_t*v, int index);
+    bool (*leave)(void*context, value_t*array);
+} value_visitor_t;
+
+bool value_walk(value_t*v, const value_visitor_t*visitor, void*context);
+
+/* Growable stack of fixed-size frames, for converting nested data without
+   recursion. Pointers returned by walk_stack_push() and walk_stack_top()
+   are only valid until the next push. */
+typedef struct _walk_stack {
+    char*frames;
+    int frame_size;
+    int num;
+    int size;
+} walk_stack_t;
+
+void walk_stack_init(walk_stack_t*stack, int frame_size);
+void* walk_stack_push(walk_stack_t*stack);
+void* walk_stack_top(walk_stack_t*stack);
+void walk_stack_pop(walk_stack_t*stack);
+void walk_stack_destroy(walk_stack_t*stack);
+
 value_t* value_clone(const value_t*src);
 void value_dump(value_t*v);
 void value_destroy(value_t*v);
 
 int value_to_int(value_t*v);
 
+/* Type codes for declared guest function signatures. These are the same
+   codes used for cfunction parameters ("b", "i", "f", "s", "["), plus
+   "B", "I", "F" and "S" for arrays whose entries are all booleans, ints,
+   floats or strings. */
+bool signature_is_valid(const char*types);
+/* floats match "i" if they are whole numbers in the int32 range */
+bool value_matches_type(value_t*v, char type);
+const char* type_code_to_string(char type);
+/* true if types has no "[", so values of these types can be passed with
+   the typed_reader_t and typed_writer_t functions below */
+bool signature_is_flat(const char*types);
+
+/* The encoding sandboxes use for arguments and return values of declared
+   guest functions. There are no type tags, since both sides know the
+   signature: "b" is one byte, "i" and "f" are four, "s" is a four byte
+   length followed by that many bytes, and "B", "I", "F" and "S" are a
+   four byte length followed by the entries. */
+typedef struct _typed_reader {
+    const char*data;
+    int len;
+    int pos;
+} typed_reader_t;
+
+/* these fail if there isn't enough data left */
+bool typed_read_boolean(typed_reader_t*r, bool*b);
+bool typed_read_int32(typed_reader_t*r, int32_t*i32);
+bool typed_read_float32(typed_reader_t*r, float*f32);
+/* s points into the reader's data, and isn't null-terminated */
+bool typed_read_string(typed_reader_t*r, const char**s, int*len);
+/* the number of entries of a "B", "I", "F" or "S" array */
+bool typed_read_length(typed_reader_t*r, int*length);
+
+typedef struct _typed_writer {
+    char*data;
+    int len;
+    int size;
+} typed_writer_t;
+
+void typed_write(typed_writer_t*w, const void*data, int len);
+void typed_write_boolean(typed_writer_t*w, bool b);
+void typed_write_int32(typed_writer_t*w, int32_t i32);
+void typed_write_float32(typed_writer_t*w, float f32);
+void typed_write_string(typed_writer_t*w, const char*s, int len);
+void typed_write_length(typed_writer_t*w, int length);
+
+/* JSON documents. Objects are converted to arrays of [key, value] pairs,
+   and unpaired \u surrogates to U+FFFD. len may be -1 for null-terminated
+   input. */
+value_t* value_from_json(const char*json, int len);
+char* value_to_json(value_t*v);
+
 void array_append(value_t*array, value_t* value);
 void array_append_int32(value_t*array, int32_t i32);
 void array_append_float32(value_t*array, float f32);
@@ -65,6 +144,8 @@ void array_destroy(value_t*array);
 #define array_append_value array_append
 #define cfunction_new value_new_cfunction
 value_t* array_new();
+/* new array with room for size entries */
+value_t* array_new_sized(int size);
 
 extern value_t empty_array;
 extern value_t void_value;
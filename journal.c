@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "journal.h"
+#include "settings.h"
+
+static journal_header_t*journal = NULL;
+static journal_event_t*events = NULL;
+static size_t journal_size = 0;
+
+static pthread_once_t journal_once = PTHREAD_ONCE_INIT;
+
+static const char*type_names[NUM_JOURNAL_TYPES] = {
+    "?", "spawn", "compile", "call", "callback", "interrupt", "kill", "log", "destroy"
+};
+static const char*status_names[] = {
+    "ok", "failed", "timeout"
+};
+
+bool journal_open(const char*filename, int num_events)
+{
+    if(journal || num_events <= 0)
+        return false;
+
+    int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd < 0) {
+        perror(filename);
+        return false;
+    }
+    size_t size = sizeof(journal_header_t) + (size_t)num_events * sizeof(journal_event_t);
+    if(ftruncate(fd, size) < 0) {
+        perror(filename);
+        close(fd);
+        return false;
+    }
+    void*map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    journal_header_t*header = map;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = JOURNAL_VERSION;
+    header->event_size = sizeof(journal_event_t);
+    header->capacity = num_events;
+    header->head = 0;
+    header->pid = getpid();
+
+    events = (journal_event_t*)(header + 1);
+    journal_size = size;
+    __atomic_store_n(&journal, header, __ATOMIC_RELEASE);
+    return true;
+}
+
+void journal_close()
+{
+    journal_header_t*header = __atomic_exchange_n(&journal, NULL, __ATOMIC_ACQ_REL);
+    if(header) {
+        munmap(header, journal_size);
+    }
+}
+
+static void open_from_config()
+{
+    if(!config_journal_dir)
+        return;
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/cagekeeper-%d.journal", config_journal_dir, getpid());
+    journal_open(filename, config_journal_events);
+}
+
+void journal_record(journal_type_t type, const char*language, int sandbox, journal_status_t status,
+                    uint64_t duration, uint64_t bytes_sent, uint64_t bytes_received, uint64_t ops)
+{
+    pthread_once(&journal_once, open_from_config);
+    journal_header_t*header = __atomic_load_n(&journal, __ATOMIC_ACQUIRE);
+    if(!header)
+        return;
+
+    uint64_t index = __atomic_fetch_add(&header->head, 1, __ATOMIC_RELAXED);
+    journal_event_t*e = &events[index % header->capacity];
+
+    /* invalidate the slot while we fill it */
+    __atomic_store_n(&e->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e->timestamp = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    e->duration = duration;
+    e->bytes_sent = bytes_sent;
+    e->bytes_received = bytes_received;
+    e->ops = ops;
+    e->sandbox = sandbox;
+    e->type = type;
+    e->status = status;
+    strncpy(e->language, language ? language : "", sizeof(e->language));
+
+    __atomic_store_n(&e->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+const char* journal_type_name(int type)
+{
+    if(type <= 0 || type >= NUM_JOURNAL_TYPES)
+        return "?";
+    return type_names[type];
+}
+
+const char* journal_status_name(int status)
+{
+    if(status < 0 || status >= sizeof(status_names) / sizeof(status_names[0]))
+        return "?";
+    return status_names[status];
+}
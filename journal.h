@@ -0,0 +1,72 @@
+#ifndef __journal_h__
+#define __journal_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Flight recorder: fixed-size binary events, appended without locks to a
+   ring buffer in an mmap'd file. The file survives a crash of the process,
+   and can be decoded with tools/journal_dump. */
+
+#define JOURNAL_MAGIC "CKJRNL\0\1"
+#define JOURNAL_VERSION 1
+
+typedef enum {
+    JOURNAL_SPAWN = 1,
+    JOURNAL_COMPILE,
+    JOURNAL_CALL,
+    JOURNAL_CALLBACK,
+    JOURNAL_INTERRUPT,
+    JOURNAL_KILL,
+    JOURNAL_LOG,
+    JOURNAL_DESTROY,
+    NUM_JOURNAL_TYPES
+} journal_type_t;
+
+typedef enum {
+    JOURNAL_OK = 0,
+    JOURNAL_FAILED,
+    JOURNAL_TIMEOUT,
+} journal_status_t;
+
+typedef struct _journal_event {
+    /* 1 + index of the event since the journal was created. Written last,
+       so a reader can recognize slots that are currently being written. */
+    uint64_t sequence;
+    /* wall clock, in nanoseconds since the epoch */
+    uint64_t timestamp;
+    uint64_t duration;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t ops;
+    int32_t sandbox;
+    uint16_t type;
+    uint16_t status;
+    char language[8];
+} journal_event_t;
+
+typedef struct _journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t capacity;
+    /* number of events ever written */
+    uint64_t head;
+    int32_t pid;
+    uint32_t reserved[7];
+} journal_header_t;
+
+/* Creates (or truncates) the journal file. Returns false if it couldn't
+   be created, in which case events are dropped. */
+bool journal_open(const char*filename, int events);
+void journal_close();
+
+/* Appends an event. Opens <config_journal_dir>/cagekeeper-<pid>.journal
+   on first use, if configured. */
+void journal_record(journal_type_t type, const char*language, int sandbox, journal_status_t status,
+                    uint64_t duration, uint64_t bytes_sent, uint64_t bytes_received, uint64_t ops);
+
+const char* journal_type_name(int type);
+const char* journal_status_name(int status);
+
+#endif
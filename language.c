@@ -1,12 +1,25 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#ifdef LANGUAGE_PLUGINS
+#include <dlfcn.h>
+#endif
 #include "language.h"
 #include "settings.h"
 
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 void language_error(language_t*li, const char*error, ...)
 {
     char buf[1024];
@@ -28,74 +41,217 @@ void language_error(language_t*li, const char*error, ...)
     }
 }
 
-static jmp_buf timeout_jmp;
-static void sigalarm(int signal)
+/* Timeouts use one POSIX timer per call, which signals the calling thread
+   only. The signal carries a pointer to the call's context, so interpreters
+   on different threads (or nested on the same thread) don't interfere.
+
+   When the timer expires, interpreters with an interrupt() hook are asked
+   to stop, and get config_interrupt_grace_ms to do so. Only if they don't
+   (or have no such hook) is the call abandoned with siglongjmp(), which
+   leaves the interpreter in an undefined state. Sandboxes don't use a timer
+   at all: they enforce the time limit passed to set_timeout() themselves.
+
+   The timers use a real-time signal of their own, so the host keeps
+   SIGALRM (and alarm()) to itself. */
+#define TIMEOUT_SIGNAL (SIGRTMIN + 4)
+
+typedef struct _timeout_context {
+    sigjmp_buf jmp;
+    timer_t timer;
+    language_t*language;
+    volatile sig_atomic_t interrupted;
+    struct _timeout_context*prev;
+} timeout_context_t;
+
+static __thread timeout_context_t*current_timeout = NULL;
+static pthread_once_t timeout_handler_once = PTHREAD_ONCE_INIT;
+
+static void set_timer(timer_t timer, int ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    timer_settime(timer, 0, &its, NULL);
+}
+
+static void timeout_signal(int signal, siginfo_t*info, void*ucontext)
+{
+    timeout_context_t*context = info->si_value.sival_ptr;
+    timeout_context_t*c;
+    for(c = current_timeout; c; c = c->prev) {
+        if(c == context)
+            break;
+    }
+    if(!c) {
+        /* late signal from a call that already finished */
+        return;
+    }
+    if(!context->interrupted && context->language->interrupt) {
+        context->interrupted = 1;
+        context->language->interrupt(context->language);
+        set_timer(context->timer, config_interrupt_grace_ms > 0 ? config_interrupt_grace_ms : 1);
+        return;
+    }
+    /* calls nested inside the one that timed out are abandoned, too */
+    while(current_timeout != context) {
+        timer_delete(current_timeout->timer);
+        current_timeout = current_timeout->prev;
+    }
+    current_timeout = context->prev;
+    siglongjmp(context->jmp, 1);
+}
+
+static void install_timeout_handler()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = timeout_signal;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(TIMEOUT_SIGNAL, &sa, NULL);
+}
+
+static uint64_t now_ms()
 {
-    longjmp(timeout_jmp, 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* pass the time left until deadline (in now_ms() time) on to interpreters
+   that time out on their own */
+static void set_remaining_time(language_t*l, uint64_t deadline)
+{
+    if(!l->set_timeout || !deadline)
+        return;
+    uint64_t now = now_ms();
+    l->set_timeout(l, deadline > now ? deadline - now : 1);
+}
+
+static value_t* compile_and_call(language_t*l, const char*script, const char*function, value_t*args, uint64_t deadline)
+{
+    if(script) {
+        set_remaining_time(l, deadline);
+        int ok = l->compile_script(l, script);
+        if(!ok) {
+            language_error(l, "Couldn't compile");
+            return NULL;
+        }
+    }
+
+    if(!function)
+        return NULL;
+    if(!l->is_function(l, function)) {
+        if(!script) {
+            /* Only report an error if we're not also compiling a script;
+               startup functions are usually optional */
+            language_error(l, "No such function: %s\n", function);
+        }
+        return value_new_void();
+    }
+    // TODO: check for errors, allow void function calls
+    set_remaining_time(l, deadline);
+    return l->call_function(l, function, args);
 }
 
-static value_t* with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout)
+static value_t* with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_ms, bool*timeout)
 {
     value_t*ret = NULL;
     if(timeout) {
         *timeout = false;
     }
-    void*old_signal;
-    alarm(max_seconds);
-    if(setjmp(timeout_jmp)) {
-        alarm(0);
+
+    if(l->set_timeout) {
+        ret = compile_and_call(l, script, function, args, max_ms > 0 ? now_ms() + max_ms : 0);
+        l->set_timeout(l, 0);
+        if(!ret && l->timeout) {
+            if(timeout) {
+                *timeout = true;
+            }
+            language_error(l, "TIMEOUT");
+        }
+        return ret;
+    }
+
+    pthread_once(&timeout_handler_once, install_timeout_handler);
+
+    timeout_context_t context;
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = TIMEOUT_SIGNAL;
+    sev.sigev_value.sival_ptr = &context;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    clockid_t clock = l->timeout_cpu ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC;
+    if(timer_create(clock, &sev, &context.timer) < 0) {
+        language_error(l, "Couldn't create timer: %s", strerror(errno));
+        return NULL;
+    }
+
+    context.language = l;
+    context.interrupted = 0;
+    context.prev = current_timeout;
+    bool was_interruptible = l->interruptible;
+    if(sigsetjmp(context.jmp, 1)) {
+        l->interruptible = was_interruptible;
+        timer_delete(context.timer);
         if(timeout) {
             *timeout = true;
         }
         language_error(l, "TIMEOUT");
-        signal(SIGPROF, old_signal);
         return NULL;
     }
-    old_signal = signal(SIGPROF, sigalarm);
+    current_timeout = &context;
 
-    if(script) {
-        int ret = l->compile_script(l, script);
-        if(!ret) {
-            alarm(0);
-            language_error(l, "Couldn't compile");
-            return NULL;
-        }
+    if(max_ms > 0) {
+        set_timer(context.timer, max_ms);
     }
 
-    if(function) {
-        if(l->is_function(l, function)) {
-            // TODO: check for errors, allow void function calls
-            ret = l->call_function(l, function, args);
-        } else {
-            if(!script) {
-                alarm(0);
-                /* Only report an error if we're not also compiling a script;
-                   startup functions are usually optional */
-                language_error(l, "No such function: %s\n", function);
-            }
-            ret = value_new_void();
+    l->interruptible = true;
+    ret = compile_and_call(l, script, function, args, 0);
+    l->interruptible = was_interruptible;
+
+    /* unlink first, so that a signal arriving now is ignored */
+    current_timeout = context.prev;
+    timer_delete(context.timer);
+
+    if(!ret && context.interrupted) {
+        if(timeout) {
+            *timeout = true;
         }
+        language_error(l, "TIMEOUT");
     }
-    alarm(0);
-
-    signal(SIGPROF, old_signal);
     return ret;
 }
 
 value_t* call_function_with_timeout(language_t*l, const char*function, value_t*args, int max_seconds, bool*timeout)
 {
-    return with_timeout(l, NULL, function, args, max_seconds, timeout);
+    return with_timeout(l, NULL, function, args, max_seconds * 1000, timeout);
 }
 
 value_t* compile_and_run_function_with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout)
 {
-    return with_timeout(l, script, function, args, max_seconds, timeout);
+    return with_timeout(l, script, function, args, max_seconds * 1000, timeout);
+}
+
+value_t* call_function_with_timeout_ms(language_t*l, const char*function, value_t*args, int max_ms, bool*timeout)
+{
+    return with_timeout(l, NULL, function, args, max_ms, timeout);
+}
+
+value_t* compile_and_run_function_with_timeout_ms(language_t*l, const char*script, const char*function, value_t*args, int max_ms, bool*timeout)
+{
+    return with_timeout(l, script, function, args, max_ms, timeout);
 }
 
 language_t* proxy_new(language_t*language);
 
 language_t* wrap_sandbox(language_t*language)
 {
+    if(!language) {
+        return NULL;
+    }
     if(language->internal) {
         fprintf(stderr, "Can't wrap sandbox, language already initialized\n");
         return NULL;
@@ -103,20 +259,73 @@ language_t* wrap_sandbox(language_t*language)
     return proxy_new(language);
 }
 
+#ifdef LANGUAGE_PLUGINS
+/* Load cagekeeper_<name>.so from config_plugin_dir (or the library search
+   path), and call its constructor. dlopen() hands out the same handle for
+   repeated loads, and plugins are never unloaded. */
+static language_t* plugin_interpreter_new(const char*name, const char*constructor)
+{
+    char path[PATH_MAX];
+    if(config_plugin_dir) {
+        snprintf(path, sizeof(path), "%s/cagekeeper_%s.so", config_plugin_dir, name);
+    } else {
+        snprintf(path, sizeof(path), "cagekeeper_%s.so", name);
+    }
+    void*handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!handle) {
+        fprintf(stderr, "Couldn't load %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    language_t* (*new_interpreter)() = dlsym(handle, constructor);
+    if(!new_interpreter) {
+        fprintf(stderr, "%s doesn't export %s\n", path, constructor);
+        return NULL;
+    }
+    return new_interpreter();
+}
+#define NEW_INTERPRETER(name, constructor) plugin_interpreter_new(name, #constructor)
+#else
+#define NEW_INTERPRETER(name, constructor) constructor()
+#endif
+
+/* LuaJIT and Lua 5.1 export the same API, so only plugin builds can have
+   both. Static LUAJIT builds run lua on LuaJIT. (QuickJS's symbols are
+   hidden in static builds, see the Makefile, so js is always
+   spidermonkey.) */
+#if defined(LUAJIT) && !defined(LANGUAGE_PLUGINS)
+#define lua_interpreter_new luajit_interpreter_new
+#endif
+
+language_t* raw_interpreter_by_name(const char*name)
+{
+    if(!strcmp(name, "lua"))
+        return NEW_INTERPRETER("lua", lua_interpreter_new);
+#if defined(LUAJIT) || defined(LANGUAGE_PLUGINS)
+    else if(!strcmp(name, "luajit"))
+        return NEW_INTERPRETER("luajit", luajit_interpreter_new);
+#endif
+    else if(!strcmp(name, "py"))
+        return NEW_INTERPRETER("py", python_interpreter_new);
+    else if(!strcmp(name, "rb"))
+        return NEW_INTERPRETER("rb", ruby_interpreter_new);
+    else if(!strcmp(name, "js"))
+        return NEW_INTERPRETER("js", javascript_interpreter_new);
+#if defined(QUICKJS) || defined(LANGUAGE_PLUGINS)
+    else if(!strcmp(name, "qjs"))
+        return NEW_INTERPRETER("qjs", quickjs_interpreter_new);
+#endif
+    return NULL;
+}
+
 static language_t* raw_interpreter_by_extension(const char*filename)
 {
     const char*dot = strrchr(filename, '.');
     const char*extension = dot ? dot+1 : filename;
 
-    language_t*core = NULL;
-    if(!strcmp(extension, "lua"))
-        return lua_interpreter_new();
-    else if(!strcmp(extension, "py"))
-        return python_interpreter_new();
-    else if(!strcmp(extension, "rb"))
-        return ruby_interpreter_new();
+    if(!strcmp(extension, "lua") || !strcmp(extension, "py") || !strcmp(extension, "rb"))
+        return raw_interpreter_by_name(extension);
     else
-        return javascript_interpreter_new();
+        return raw_interpreter_by_name("js");
 }
 
 language_t* interpreter_by_extension(const char*filename)
@@ -127,6 +336,9 @@ language_t* interpreter_by_extension(const char*filename)
 language_t* unsafe_interpreter_by_extension(const char*filename)
 {
     language_t*li = raw_interpreter_by_extension(filename);
+    if(!li) {
+        return NULL;
+    }
 
     bool ret = li->initialize(li, config_maxmem);
     if(!ret) {
@@ -156,6 +368,139 @@ void define_function(language_t*li, const char*name, void*call, void*context, co
     li->define_function(li, name, v);
 }
 
+bool declare_guest_function(language_t*li, const char*name, const char*params, const char*ret)
+{
+    if(!signature_is_valid(params) || !signature_is_valid(ret) || strlen(ret) > 1) {
+        language_error(li, "%s: invalid signature (%s):%s", name, params, ret);
+        return false;
+    }
+    /* interpreters running in-process convert values directly, so only
+       the sandbox proxy makes use of declared signatures */
+    if(li->declare_function) {
+        li->declare_function(li, name, params, ret);
+    }
+    return true;
+}
+
+bool get_call_stats(language_t*li, call_stats_t*stats)
+{
+    memset(stats, 0, sizeof(call_stats_t));
+    if(!li->get_stats)
+        return false;
+    return li->get_stats(li, stats);
+}
+
+char* get_guest_profile(language_t*li)
+{
+    if(!li->get_profile)
+        return NULL;
+    return li->get_profile(li);
+}
+
+char* get_guest_backtrace(language_t*li)
+{
+    if(!li->get_backtrace)
+        return NULL;
+    return li->get_backtrace(li);
+}
+
+bool reset_interpreter(language_t*li)
+{
+    if(!li->reset)
+        return false;
+    return li->reset(li);
+}
+
+bool collect_guest_garbage(language_t*li)
+{
+    if(!li->collect_garbage)
+        return false;
+    return li->collect_garbage(li);
+}
+
+static const char*jit_modes[] = {"default", "none", "trace", "method", "all", NULL};
+
+static bool parse_uint32(const char*value, uint32_t*result)
+{
+    char*end;
+    errno = 0;
+    unsigned long v = strtoul(value, &end, 0);
+    if(errno || end == value || *end || v > UINT32_MAX)
+        return false;
+    *result = v;
+    return true;
+}
+
+static bool parse_tuning_setting(language_tuning_t*tuning, const char*key, const char*value)
+{
+    if(!strcmp(key, "jit")) {
+        int i;
+        for(i=0;jit_modes[i];i++) {
+            if(!strcmp(value, jit_modes[i])) {
+                tuning->jit = i;
+                return true;
+            }
+        }
+        return false;
+    } else if(!strcmp(key, "stack_chunk_size")) {
+        return parse_uint32(value, &tuning->stack_chunk_size);
+    } else if(!strcmp(key, "gc_malloc_bytes")) {
+        return parse_uint32(value, &tuning->gc_malloc_bytes);
+    } else if(!strcmp(key, "gc_growth")) {
+        return parse_uint32(value, &tuning->gc_growth);
+    } else if(!strcmp(key, "gc_stepmul")) {
+        return parse_uint32(value, &tuning->gc_stepmul);
+    } else if(!strcmp(key, "cdata_arrays")) {
+        return parse_uint32(value, &tuning->cdata_arrays);
+    }
+    return false;
+}
+
+bool language_tuning_parse(language_tuning_t*tuning, const char*s)
+{
+    char*copy = strdup(s);
+    char*save = NULL;
+    char*setting;
+    bool ret = true;
+    for(setting=strtok_r(copy, ",", &save);setting;setting=strtok_r(NULL, ",", &save)) {
+        char*value = strchr(setting, '=');
+        if(!value) {
+            ret = false;
+            break;
+        }
+        *value++ = 0;
+        if(!parse_tuning_setting(tuning, setting, value)) {
+            ret = false;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+char* language_tuning_to_string(const language_tuning_t*tuning)
+{
+    char buffer[256];
+    int pos = 0;
+    buffer[0] = 0;
+#define APPEND(format, value) \
+    pos += snprintf(buffer + pos, sizeof(buffer) - pos, "%s" format, pos ? "," : "", value)
+    if(tuning->jit)
+        APPEND("jit=%s", jit_modes[tuning->jit]);
+    if(tuning->stack_chunk_size)
+        APPEND("stack_chunk_size=%u", tuning->stack_chunk_size);
+    if(tuning->gc_malloc_bytes)
+        APPEND("gc_malloc_bytes=%u", tuning->gc_malloc_bytes);
+    if(tuning->gc_growth)
+        APPEND("gc_growth=%u", tuning->gc_growth);
+    if(tuning->gc_stepmul)
+        APPEND("gc_stepmul=%u", tuning->gc_stepmul);
+    if(tuning->cdata_arrays)
+        APPEND("cdata_arrays=%u", tuning->cdata_arrays);
+#undef APPEND
+    return strdup(buffer);
+}
+
 int call_int_function(language_t*li, const char*name)
 {
     value_t*args = array_new();
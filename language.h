@@ -2,46 +2,253 @@
 #define  __language_interpreter_h__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include "util.h"
 #include "function.h"
 
+typedef struct _call_stats {
+    /* CPU time used by the guest, in seconds */
+    double cpu_user;
+    double cpu_sys;
+    /* peak resident set size of the guest, in kilobytes */
+    long max_rss;
+    /* bytes sent to and received from the guest */
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    /* calls from the guest into the host, and the time spent in them, in seconds */
+    int callbacks;
+    double callback_time;
+    /* memory allocated by the guest, and the largest size of its heap, in
+       bytes. How exact these are depends on the language: lua counts
+       every allocation, js measures its GC heap, python and ruby only see
+       the malloc() heap before and after the call (and no allocation count). */
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t peak_heap;
+    /* garbage collections that interrupted the guest, and the time they
+       took, in seconds. Only javascript and ruby report these. */
+    int gc_collections;
+    double gc_time;
+    /* time a sandbox spent collecting garbage after the previous call
+       (with GC_BETWEEN_CALLS), in seconds */
+    double idle_gc_time;
+} call_stats_t;
+
+/* when guest garbage is collected */
+typedef enum {
+    /* whenever the runtime decides to */
+    GC_AUTOMATIC = 0,
+    /* not during compile_script() and call_function(), as far as the
+       runtime allows it, but in between. Sandboxes collect on their own
+       after sending a result; for unsandboxed interpreters, call
+       collect_guest_garbage(). Javascript still collects if its heap is
+       more than half full. For lua and ruby, a call that produces a lot
+       of garbage can run out of memory. */
+    GC_BETWEEN_CALLS = 1,
+} gc_policy_t;
+
+/* how much of its standard environment an interpreter sets up in
+   initialize(). MINIMAL trades convenience for startup time and memory:
+   python skips site.py and doesn't copy __main__, javascript resolves
+   standard classes on first use, lua doesn't open its math library. */
+typedef enum {
+    INIT_PROFILE_FULL = 0,
+    INIT_PROFILE_MINIMAL = 1,
+} init_profile_t;
+
+/* which of spidermonkey's JITs compile guest code. For luajit, JIT_NONE
+   turns the compiler off and everything else leaves it on, except for
+   operations that count operations or are interruptible. */
+typedef enum {
+    JIT_DEFAULT = 0,
+    JIT_NONE = 1,
+    /* the tracing JIT, which is also the default */
+    JIT_TRACE = 2,
+    JIT_METHOD = 3,
+    /* both, with spidermonkey profiling loops to pick one */
+    JIT_ALL = 4,
+} jit_mode_t;
+
+/* runtime parameters, read by initialize(). Zero keeps the built-in
+   default (in parentheses), and interpreters ignore the fields that don't
+   apply to them. Use bench/tuning to find values for a workload. */
+typedef struct _language_tuning {
+    /* javascript */
+    jit_mode_t jit;
+    /* size of the chunks the context's stack pool grows by (8192) */
+    uint32_t stack_chunk_size;
+    /* malloc()ed bytes, e.g. for string contents, that trigger a
+       collection (the runtime's memory limit). For qjs, the initial
+       threshold of its cycle collector (256k). */
+    uint32_t gc_malloc_bytes;
+
+    /* javascript and lua: the next collection starts once the heap has
+       grown to this many percent of what survived the last one (js: 300,
+       lua: 200) */
+    uint32_t gc_growth;
+
+    /* lua: speed of the incremental collector, relative to allocation, in
+       percent (200). With gc_growth=400, this speeds up allocation-heavy
+       guests at the cost of a bigger heap. Numeric and string code doesn't
+       gain from either. */
+    uint32_t gc_stepmul;
+
+    /* luajit: pass arrays of at least this many int32s (or floats) in FFI
+       int32_t[n] (float[n]) instead of tables. Guest code indexes them
+       the same way, and indices outside of 0..n-1 raise an error, but they
+       have no length and can't be iterated with pairs(). Off by default. */
+    uint32_t cdata_arrays;
+} language_tuning_t;
+
+/* "jit=method,gc_growth=150" etc., with the field names above and jit
+   being one of none, trace, method or all. Unknown or invalid settings
+   make language_tuning_parse() fail. */
+bool language_tuning_parse(language_tuning_t*tuning, const char*s);
+char* language_tuning_to_string(const language_tuning_t*tuning);
+
 typedef struct _language {
     void*internal;
     const char*name;
 
+    /* set by initialize(): which build of the runtime this is (see
+       runtime_version()), so that cached bytecode compiled by a different
+       one isn't loaded. NULL if unknown. */
+    char*version;
+
     bool timeout;
 
+    /* guest operations used by the last compile_script() or call_function(),
+       if ops_budget or profile_interval is set. What counts as an operation
+       depends on the language. */
+    uint64_t ops;
+
+    /* set while an unsandboxed compile_script() or call_function() runs
+       inside *_with_timeout(), where only interrupt() can stop it.
+       Interpreters whose compiled code can't be interrupted (luajit) don't
+       compile guest code then. Sandboxes don't need this: a child that
+       doesn't react to an interrupt is killed and replaced. */
+    bool interruptible;
+
+    /* set by interpreters whose JIT changes memory protection after
+       initialize(), so sandboxes allow mprotect() */
+    bool jit_mprotect;
+
     bool (*initialize)(struct _language*li, size_t maxmem);
 
     void (*define_constant)(struct _language*li, const char*name, value_t*value);
     void (*define_function)(struct _language*li, const char*name, function_t*f);
 
     bool (*compile_script) (struct _language*li, const char*script);
+
+    /* optional: compile a script without running it, and run previously
+       compiled bytecode. Together, these are equivalent to compile_script(). */
+    bool (*compile_to_bytecode) (struct _language*li, const char*script, void**data, int*len);
+    bool (*load_bytecode) (struct _language*li, const void*data, int len);
     bool (*is_function) (struct _language*li, const char*name);
 
     value_t* (*call_function) (struct _language*li, const char*name, value_t*args);
 
+    /* optional: declare the signature of a guest function (see signature_is_valid()) */
+    void (*declare_function)(struct _language*li, const char*name, const char*params, const char*ret);
+
+    /* optional: call_function() for a function with a flat signature (see
+       signature_is_flat()), which reads the arguments from args and writes
+       the return value to ret in the typed encoding, without building
+       value_t trees. Fails, like a declared function, if the return value
+       doesn't match ret_type. Sandboxes use this for declared functions. */
+    bool (*call_typed)(struct _language*li, const char*name, const char*params, const char*ret_type,
+                       typed_reader_t*args, typed_writer_t*ret);
+
+    /* optional: make the currently running compile_script() or call_function()
+       fail as soon as possible. Called from a signal handler. */
+    void (*interrupt)(struct _language*li);
+
+    /* optional: limit the following compile_script() and call_function()
+       calls to max_ms milliseconds of wall clock time, or go back to the
+       default limit if max_ms is 0. For interpreters that enforce time
+       limits on their own (sandboxes); the *_with_timeout() functions use
+       this instead of a signal. */
+    void (*set_timeout)(struct _language*li, int max_ms);
+
+    /* optional: resource usage of the last compile_script() or call_function() */
+    bool (*get_stats)(struct _language*li, call_stats_t*stats);
+
+    /* optional: the call stacks sampled since the last call, in folded
+       stack format (see profile.h). Free with free(). */
+    char* (*get_profile)(struct _language*li);
+
+    /* optional: where the guest was when the last compile_script() or
+       call_function() failed, timed out or crashed. One frame per line,
+       innermost first. Free with free(). */
+    char* (*get_backtrace)(struct _language*li);
+
+    /* optional: forget everything defined since initialize(), by guest
+       code as well as with define_function() and define_constant(), so the
+       interpreter can run unrelated code. This resets the global namespace
+       only: changes guest code made to builtin objects, classes or
+       modules survive, so it's not a security boundary. */
+    bool (*reset)(struct _language*li);
+
+    /* optional: run a full garbage collection now */
+    bool (*collect_garbage)(struct _language*li);
+
     void (*destroy)(struct _language*li);
 
     /* user modifiable fields: */
     void *user;
     void (*log)(void*user, const char*line);
+
+    /* measure *_with_timeout() limits in CPU time of the calling thread,
+       instead of wall clock time. Sandboxes always use wall clock time. */
+    bool timeout_cpu;
+
+    /* if nonzero, compile_script() and call_function() fail (and set timeout)
+       after this many guest operations. Set to UINT64_MAX to count
+       operations without a limit. */
+    uint64_t ops_budget;
+
+    /* if nonzero, sample the guest's call stack every this many
+       operations. Retrieve the samples with get_guest_profile(). */
+    uint64_t profile_interval;
+
+    /* read by initialize(). A sandbox initializes its interpreter as soon
+       as it's created, so for sandboxes, set this on the raw interpreter
+       before passing it to wrap_sandbox(). */
+    init_profile_t init_profile;
+
+    /* read by initialize(), like init_profile */
+    language_tuning_t tuning;
+
+    /* applied at the start of every compile_script() and call_function() */
+    gc_policy_t gc_policy;
 } language_t;
 
 int call_int_function(language_t* li, const char*name);
 void define_int_constant(language_t* li, const char*name, int value);
 void define_string_constant(language_t* li, const char*name, const char* value);
 void define_function(language_t*li, const char*name, void*call, void*context, const char*params, const char*ret);
+bool declare_guest_function(language_t*li, const char*name, const char*params, const char*ret);
+bool get_call_stats(language_t*li, call_stats_t*stats);
+char* get_guest_profile(language_t*li);
+char* get_guest_backtrace(language_t*li);
+bool reset_interpreter(language_t*li);
+bool collect_guest_garbage(language_t*li);
 
 language_t* javascript_interpreter_new();
+language_t* quickjs_interpreter_new();
 language_t* lua_interpreter_new();
+language_t* luajit_interpreter_new();
 language_t* python_interpreter_new();
 language_t* ruby_interpreter_new();
 
 language_t* wrap_sandbox(language_t*language);
 
+/* "lua", "luajit", "py", "rb", "js" or "qjs", neither sandboxed nor initialized. NULL for
+   unknown languages, or if the plugin for the language can't be loaded. */
+language_t* raw_interpreter_by_name(const char*name);
+
 language_t* interpreter_by_extension(const char*filename);
 language_t* unsafe_interpreter_by_extension(const char*filename);
 
@@ -50,5 +257,7 @@ void language_error(language_t*l, const char*error, ...);
 
 value_t* call_function_with_timeout(language_t*l, const char*function, value_t*args, int max_seconds, bool*timeout);
 value_t* compile_and_run_function_with_timeout(language_t*l, const char*script, const char*function, value_t*args, int max_seconds, bool*timeout);
+value_t* call_function_with_timeout_ms(language_t*l, const char*function, value_t*args, int max_ms, bool*timeout);
+value_t* compile_and_run_function_with_timeout_ms(language_t*l, const char*script, const char*function, value_t*args, int max_ms, bool*timeout);
 
 #endif //__language_interpreter_h__
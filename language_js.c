@@ -1,14 +1,20 @@
 #include <stdbool.h>
 #include <string.h>
+#include <signal.h>
 #ifdef _MSC_VER
 # define XP_WIN
 #else
 # define XP_UNIX
 #endif
 #include <jsapi.h>
+#include <jsxdrapi.h>
+#include <jsdbgapi.h>
 #include <ffi.h>
 
 #include "language.h"
+#include "probes.h"
+#include "profile.h"
+#include "stats.h"
 #include "util.h"
 #include "dict.h"
 #include "function.h"
@@ -20,6 +26,22 @@ typedef struct _js_internal {
     JSObject *global;
     char*buffer;
     char noerrors;
+    volatile sig_atomic_t interrupted;
+    profile_t*profile;
+    char*backtrace;
+
+    /* GC heap accounting for the current operation */
+    size_t heap_start;
+    size_t heap_before_gc;
+    size_t peak_heap;
+    uint64_t collected;
+
+    /* collections during the current operation, except explicit ones */
+    bool suppress_gc;
+    bool collecting;
+    int gc_collections;
+    uint64_t gc_start;
+    uint64_t gc_time;
 
     dict_t* jsfunction_to_function;
 } js_internal_t;
@@ -31,14 +53,218 @@ static JSClass global_class = {
     JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, JS_FinalizeStub,
     JSCLASS_NO_OPTIONAL_MEMBERS };
 
+/* global object for INIT_PROFILE_MINIMAL: standard classes are created
+   when a script first refers to them */
+static JSBool lazy_global_enumerate(JSContext *cx, JSObject *obj)
+{
+    return JS_EnumerateStandardClasses(cx, obj);
+}
+
+static JSBool lazy_global_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp)
+{
+    JSBool resolved;
+    if(!JS_ResolveStandardClass(cx, obj, id, &resolved))
+        return JS_FALSE;
+    *objp = resolved ? obj : NULL;
+    return JS_TRUE;
+}
+
+static JSClass lazy_global_class = {
+    "global",
+    JSCLASS_GLOBAL_FLAGS | JSCLASS_NEW_RESOLVE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    lazy_global_enumerate, (JSResolveOp)lazy_global_resolve, JS_ConvertStub, JS_FinalizeStub,
+    JSCLASS_NO_OPTIONAL_MEMBERS };
+
 static void error_callback(JSContext *cx, const char *message, JSErrorReport *report) {
 
     js_internal_t*js = JS_GetContextPrivate(cx);
     if(js->noerrors)
         return;
+    /* uncaught exceptions are reported after the stack is unwound, so all
+       we know is where they were thrown */
+    if(!js->backtrace && report->filename) {
+        js->backtrace = backtrace_add_frame(NULL, "(exception)", report->filename, report->lineno);
+    }
     language_error(js->li, "line %u: %s\n", (unsigned int) report->lineno, message);
 }
 
+typedef void (*frame_visitor_t)(void*data, const char*function, const char*file, int line);
+
+static void walk_stack(JSContext*cx, frame_visitor_t visit, void*data)
+{
+    JSStackFrame*iterator = NULL;
+    JSStackFrame*fp;
+    while((fp = JS_FrameIterator(cx, &iterator))) {
+        JSScript*script = JS_GetFrameScript(cx, fp);
+        if(!script)
+            continue; // native function
+        JSFunction*fun = JS_GetFrameFunction(cx, fp);
+        JSString*id = fun ? JS_GetFunctionId(fun) : NULL;
+        char*name = id ? JS_EncodeString(cx, id) : NULL;
+        visit(data, name ? name : (fun ? "(anonymous)" : "(main)"),
+                    JS_GetScriptFilename(cx, script),
+                    JS_PCToLineNumber(cx, script, JS_GetFramePC(cx, fp)));
+        if(name)
+            JS_free(cx, name);
+    }
+}
+
+static void sample_frame(void*data, const char*function, const char*file, int line)
+{
+    profile_sample_frame((profile_t*)data, function, file, line);
+}
+
+static void sample_stack(JSContext*cx, profile_t*profile)
+{
+    profile_sample_begin(profile);
+    walk_stack(cx, sample_frame, profile);
+    profile_sample_end(profile);
+}
+
+static void backtrace_frame(void*data, const char*function, const char*file, int line)
+{
+    js_internal_t*js = (js_internal_t*)data;
+    js->backtrace = backtrace_add_frame(js->backtrace, function, file, line);
+}
+
+static void capture_backtrace(JSContext*cx, js_internal_t*js)
+{
+    free(js->backtrace);
+    js->backtrace = NULL;
+    walk_stack(cx, backtrace_frame, js);
+}
+
+static JSBool operation_callback(JSContext *cx)
+{
+    js_internal_t*js = JS_GetContextPrivate(cx);
+    if(js->interrupted) {
+        /* returning false without an exception aborts the script, and can't
+           be caught by the script itself */
+        js->interrupted = 0;
+        capture_backtrace(cx, js);
+        language_error(js->li, "interrupted");
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+/* counts every executed bytecode. Only the interpreter calls this, which
+   is why begin_operation() turns the JITs off while it's installed. */
+static JSTrapStatus count_ops(JSContext*cx, JSScript*script, jsbytecode*pc, jsval*rval, void*closure)
+{
+    js_internal_t*js = (js_internal_t*)closure;
+    language_t*li = js->li;
+    ++li->ops;
+    if(profile_due(js->profile, li->ops)) {
+        sample_stack(cx, js->profile);
+    }
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        li->timeout = true;
+        capture_backtrace(cx, js);
+        language_error(li, "operation budget exceeded");
+        return JSTRAP_ERROR;
+    }
+    return JSTRAP_CONTINUE;
+}
+
+/* the heap is largest right before a collection, so that's where we
+   measure the peak. What the collection frees has been allocated, too.
+   With GC_BETWEEN_CALLS, this also vetoes collections as long as the heap
+   is less than half full. */
+static JSBool gc_callback(JSContext*cx, JSGCStatus status)
+{
+    js_internal_t*js = JS_GetContextPrivate(cx);
+    size_t heap = JS_GetGCParameter(js->rt, JSGC_BYTES);
+    if(status == JSGC_BEGIN) {
+        if(heap > js->peak_heap)
+            js->peak_heap = heap;
+        if(js->suppress_gc && !js->collecting &&
+           heap < JS_GetGCParameter(js->rt, JSGC_MAX_BYTES) / 2) {
+            return JS_FALSE;
+        }
+        js->heap_before_gc = heap;
+        js->gc_start = stats_now();
+    } else if(status == JSGC_END) {
+        if(js->heap_before_gc > heap)
+            js->collected += js->heap_before_gc - heap;
+        if(!js->collecting) {
+            js->gc_collections++;
+            js->gc_time += stats_now() - js->gc_start;
+        }
+    }
+    return JS_TRUE;
+}
+
+static uint32 jit_options(jit_mode_t jit)
+{
+    switch(jit) {
+        case JIT_NONE:
+            return 0;
+        case JIT_METHOD:
+            return JSOPTION_METHODJIT;
+        case JIT_ALL:
+            return JSOPTION_JIT | JSOPTION_METHODJIT | JSOPTION_PROFILING;
+        default:
+            return JSOPTION_JIT;
+    }
+}
+
+/* called before running any guest code */
+static void begin_operation(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    js->interrupted = 0;
+    li->timeout = false;
+    li->ops = 0;
+    free(js->backtrace);
+    js->backtrace = NULL;
+    js->heap_start = js->peak_heap = JS_GetGCParameter(js->rt, JSGC_BYTES);
+    js->collected = 0;
+    js->suppress_gc = li->gc_policy == GC_BETWEEN_CALLS;
+    js->gc_collections = 0;
+    js->gc_time = 0;
+    profile_start(js->profile, li->profile_interval);
+    /* compiled code never calls the interrupt hook, so counting ops needs
+       both JITs switched off */
+    if(li->ops_budget || li->profile_interval) {
+        JS_SetOptions(js->cx, JSOPTION_VAROBJFIX);
+        JS_SetInterrupt(js->rt, count_ops, js);
+    } else {
+        JS_SetOptions(js->cx, JSOPTION_VAROBJFIX | jit_options(li->tuning.jit));
+        JS_ClearInterrupt(js->rt, NULL, NULL);
+    }
+}
+
+static void interrupt_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    js->interrupted = 1;
+    JS_TriggerOperationCallback(js->cx);
+}
+
+static bool new_global(js_internal_t*js, init_profile_t profile)
+{
+    JSObject*global;
+    if(profile == INIT_PROFILE_MINIMAL) {
+        global = JS_NewCompartmentAndGlobalObject(js->cx, &lazy_global_class, NULL);
+    } else {
+        global = JS_NewCompartmentAndGlobalObject(js->cx, &global_class, NULL);
+    }
+    if (global == NULL)
+        return false;
+    JS_SetGlobalObject(js->cx, global);
+
+    /* Populate the global object with the standard globals, like Object and Array. */
+    if (profile != INIT_PROFILE_MINIMAL && !JS_InitStandardClasses(js->cx, global)) {
+        if(js->global)
+            JS_SetGlobalObject(js->cx, js->global);
+        return false;
+    }
+    js->global = global;
+    return true;
+}
+
 static bool initialize_js(language_t*li, size_t mem_size)
 {
     if(li->internal)
@@ -47,28 +273,32 @@ static bool initialize_js(language_t*li, size_t mem_size)
     li->internal = calloc(1, sizeof(js_internal_t));
     js_internal_t*js = (js_internal_t*)li->internal;
     js->li = li;
+    js->profile = profile_new();
 
     log_dbg("[js] initializing: allocating runtime with %dMB of memory", mem_size / 1048576);
 
+    language_tuning_t*tuning = &li->tuning;
     js->rt = JS_NewRuntime(mem_size);
     if (js->rt == NULL)
         return false;
-    js->cx = JS_NewContext(js->rt, 8192);
+    li->version = runtime_version(JS_GetImplementationVersion(), (void*)JS_NewRuntime);
+    if(tuning->gc_growth)
+        JS_SetGCParameter(js->rt, JSGC_TRIGGER_FACTOR, tuning->gc_growth);
+    if(tuning->gc_malloc_bytes)
+        JS_SetGCParameter(js->rt, JSGC_MAX_MALLOC_BYTES, tuning->gc_malloc_bytes);
+    js->cx = JS_NewContext(js->rt, tuning->stack_chunk_size ? tuning->stack_chunk_size : 8192);
     if (js->cx == NULL)
         return false;
 
     JS_SetContextPrivate(js->cx, js);
 
-    JS_SetOptions(js->cx, JSOPTION_VAROBJFIX | JSOPTION_JIT);
+    JS_SetOptions(js->cx, JSOPTION_VAROBJFIX | jit_options(tuning->jit));
     JS_SetVersion(js->cx, JSVERSION_LATEST);
     JS_SetErrorReporter(js->cx, error_callback);
+    JS_SetOperationCallback(js->cx, operation_callback);
+    JS_SetGCCallback(js->cx, gc_callback);
 
-    js->global = JS_NewCompartmentAndGlobalObject(js->cx, &global_class, NULL);
-    if (js->global == NULL)
-        return false;
-
-    /* Populate the global object with the standard globals, like Object and Array. */
-    if (!JS_InitStandardClasses(js->cx, js->global))
+    if(!new_global(js, li->init_profile))
         return false;
 
     js->buffer = malloc(65536);
@@ -76,49 +306,105 @@ static bool initialize_js(language_t*li, size_t mem_size)
     return true;
 }
 
+/* Start over with a new global object, in a new compartment. The old one
+   (and everything only it referenced) goes away with the next GC. */
+static bool reset_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    if(!new_global(js, li->init_profile))
+        return false;
+    dict_destroy_shallow(js->jsfunction_to_function);
+    js->jsfunction_to_function = dict_new(&ptr_type);
+    free(js->backtrace);
+    js->backtrace = NULL;
+    js->collecting = true;
+    JS_GC(js->cx);
+    js->collecting = false;
+    return true;
+}
+
+typedef struct _js_frame {
+    JSObject*obj;
+    jsuint pos;
+    jsuint length;
+    value_t*array;
+} js_frame_t;
+
 static value_t* jsval_to_value(const js_internal_t*js, jsval v)
 {
     // Also see JS_ConvertArguments()
-    int32 d;
-    if(JSVAL_IS_NULL(v)) {
-        return value_new_void();
-    } else if(JSVAL_IS_VOID(v)) {
-        return value_new_void();
-    } else if(JSVAL_IS_INT(v)) {
-        return value_new_int32(JSVAL_TO_INT(v));
-    } else if(JSVAL_IS_NUMBER(v)) {
-        return value_new_float32(JSVAL_TO_DOUBLE(v));
-    } else if(JSVAL_IS_STRING(v)) {
-        JSString*s = JSVAL_TO_STRING(v);
-        char*cstr = JS_EncodeString(js->cx, s);
-        return value_new_string(cstr);
-    } else if(JSVAL_IS_BOOLEAN(v)) {
-        return value_new_boolean(JSVAL_TO_BOOLEAN(v));
-    } else if(JSVAL_IS_OBJECT(v)) {
-        JSObject * obj = JSVAL_TO_OBJECT(v);
-        jsuint length;
-        bool ret = JS_GetArrayLength(js->cx, obj, &length);
-        if(!ret) {
-            language_error(js->li, "Can't determine array length\n");
-            return NULL;
-        }
-        value_t*a = array_new();
-        int i;
-        for(i=0;i<length;i++) {
-            jsval entry;
-            ret = JS_GetElement(js->cx, obj, i, &entry);
-            if(!ret) {
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(js_frame_t));
+    value_t*root = NULL;
+
+    while(1) {
+        value_t*value;
+        JSObject*obj = NULL;
+        jsuint length = 0;
+        if(JSVAL_IS_NULL(v)) {
+            value = value_new_void();
+        } else if(JSVAL_IS_VOID(v)) {
+            value = value_new_void();
+        } else if(JSVAL_IS_INT(v)) {
+            value = value_new_int32(JSVAL_TO_INT(v));
+        } else if(JSVAL_IS_NUMBER(v)) {
+            value = value_new_float32(JSVAL_TO_DOUBLE(v));
+        } else if(JSVAL_IS_STRING(v)) {
+            JSString*s = JSVAL_TO_STRING(v);
+            char*cstr = JS_EncodeString(js->cx, s);
+            value = value_new_string(cstr);
+            JS_free(js->cx, cstr);
+        } else if(JSVAL_IS_BOOLEAN(v)) {
+            value = value_new_boolean(JSVAL_TO_BOOLEAN(v));
+        } else if(JSVAL_IS_OBJECT(v)) {
+            obj = JSVAL_TO_OBJECT(v);
+            if(!JS_GetArrayLength(js->cx, obj, &length)) {
                 language_error(js->li, "Can't determine array length\n");
-                return NULL;
+                goto error;
             }
-            array_append(a, jsval_to_value(js, entry));
+            value = array_new();
+        } else {
+            language_error(js->li, "Can't convert javascript type to a value.\n");
+            goto error;
+        }
+
+        js_frame_t*parent = walk_stack_top(&stack);
+        if(parent) {
+            array_append(parent->array, value);
+        } else {
+            root = value;
+        }
+        if(obj) {
+            js_frame_t*frame = walk_stack_push(&stack);
+            frame->obj = obj;
+            frame->pos = 0;
+            frame->length = length;
+            frame->array = value;
+        }
+
+        /* fetch the next array element */
+        js_frame_t*frame;
+        while((frame = walk_stack_top(&stack))) {
+            if(frame->pos < frame->length) {
+                if(!JS_GetElement(js->cx, frame->obj, frame->pos++, &v)) {
+                    language_error(js->li, "Can't retrieve array element\n");
+                    goto error;
+                }
+                break;
+            }
+            walk_stack_pop(&stack);
+        }
+        if(!frame) {
+            walk_stack_destroy(&stack);
+            return root;
         }
-        return a;
-    } else {
-        /* TODO: arrays */
-        language_error(js->li, "Can't convert javascript type to a value.\n");
-        return NULL;
     }
+
+error:
+    walk_stack_destroy(&stack);
+    if(root)
+        value_destroy(root);
+    return NULL;
 }
 
 static value_t* js_argv_to_args(language_t*li, JSContext *cx, uintN argc, jsval *argv)
@@ -133,42 +419,80 @@ static value_t* js_argv_to_args(language_t*li, JSContext *cx, uintN argc, jsval
     return args;
 }
 
-static jsval value_to_jsval(JSContext*cx, value_t*value)
+typedef struct _to_jsval_context {
+    JSContext*cx;
+    walk_stack_t stack;
+    jsval root;
+} to_jsval_context_t;
+
+static bool to_jsval_visit(void*_context, value_t*value, int index)
 {
+    to_jsval_context_t*context = _context;
+    JSContext*cx = context->cx;
+    jsval v;
     switch(value->type) {
         case TYPE_VOID:
-            return OBJECT_TO_JSVAL(NULL);
+            v = OBJECT_TO_JSVAL(NULL);
         break;
         case TYPE_FLOAT32:
-            return DOUBLE_TO_JSVAL(value->f32);
+            v = DOUBLE_TO_JSVAL(value->f32);
         break;
         case TYPE_INT32:
-            return INT_TO_JSVAL(value->i32);
+            v = INT_TO_JSVAL(value->i32);
         break;
         case TYPE_BOOLEAN:
-            return BOOLEAN_TO_JSVAL(value->b);
+            v = BOOLEAN_TO_JSVAL(value->b);
         break;
         case TYPE_STRING: {
             JSString *s = JS_InternString(cx, value->str);
-            return STRING_TO_JSVAL(s);
+            v = STRING_TO_JSVAL(s);
         }
         break;
         case TYPE_ARRAY: {
             JSObject *array = JS_NewArrayObject(cx, 0, NULL);
             if (array == NULL)
-                return OBJECT_TO_JSVAL(NULL);
-            int i;
-            for(i=0;i<value->length;i++) {
-                jsval entry = value_to_jsval(cx, value->data[i]);
-                JS_SetElement(cx, array, i, &entry);
-            }
-            return OBJECT_TO_JSVAL(array);
+                return false;
+            v = OBJECT_TO_JSVAL(array);
         }
         break;
         default: {
-            return OBJECT_TO_JSVAL(NULL);
+            v = OBJECT_TO_JSVAL(NULL);
         }
     }
+
+    /* new objects are stored in their parent right away, so that
+       they're reachable (from the root) for the garbage collector */
+    JSObject**parent = walk_stack_top(&context->stack);
+    if(parent) {
+        JS_SetElement(cx, *parent, index, &v);
+    } else {
+        context->root = v;
+    }
+    if(value->type == TYPE_ARRAY) {
+        *(JSObject**)walk_stack_push(&context->stack) = JSVAL_TO_OBJECT(v);
+    }
+    return true;
+}
+
+static bool to_jsval_leave(void*_context, value_t*array)
+{
+    to_jsval_context_t*context = _context;
+    walk_stack_pop(&context->stack);
+    return true;
+}
+
+static jsval value_to_jsval(JSContext*cx, value_t*value)
+{
+    static const value_visitor_t to_jsval_visitor = {to_jsval_visit, to_jsval_leave};
+    to_jsval_context_t context;
+    context.cx = cx;
+    context.root = OBJECT_TO_JSVAL(NULL);
+    walk_stack_init(&context.stack, sizeof(JSObject*));
+    if(!value_walk(value, &to_jsval_visitor, &context)) {
+        context.root = OBJECT_TO_JSVAL(NULL);
+    }
+    walk_stack_destroy(&context.stack);
+    return context.root;
 }
 
 static JSBool js_function_proxy(JSContext *cx, uintN argc, jsval *vp)
@@ -232,17 +556,75 @@ void define_constant_js(language_t*li, const char*name, value_t* value)
 static bool compile_script_js(language_t*li, const char*script)
 {
     js_internal_t*js = (js_internal_t*)li->internal;
+    begin_operation(li);
     jsval rval;
     JSBool ok;
     
     log_dbg("[js] compiling script %p %p", script, js);
+    PROBE2(guest__compile__start, li->name, strlen(script));
     ok = JS_EvaluateScript(js->cx, js->global, script, strlen(script), "__main__", 1, &rval);
+    PROBE2(guest__compile__done, li->name, ok);
     if(!ok) {
         language_error(li, "Couldn't compile javascript program\n");
     }
     return ok;
 }
 
+static bool compile_to_bytecode_js(language_t*li, const char*script, void**data, int*len)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+
+    log_dbg("[js] compiling script to bytecode");
+    JSObject*code = JS_CompileScript(js->cx, js->global, script, strlen(script), "__main__", 1);
+    if(!code) {
+        language_error(li, "Couldn't compile javascript program\n");
+        return false;
+    }
+
+    JSXDRState*xdr = JS_XDRNewMem(js->cx, JSXDR_ENCODE);
+    if(!xdr)
+        return false;
+    bool ok = JS_XDRScriptObject(xdr, &code);
+    if(ok) {
+        uint32 size = 0;
+        void*buffer = JS_XDRMemGetData(xdr, &size);
+        *data = memdup(buffer, size);
+        *len = size;
+    }
+    JS_XDRDestroy(xdr);
+    return ok;
+}
+
+static bool load_bytecode_js(language_t*li, const void*data, int len)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    log_dbg("[js] loading %d bytes of bytecode", len);
+    begin_operation(li);
+
+    JSXDRState*xdr = JS_XDRNewMem(js->cx, JSXDR_DECODE);
+    if(!xdr)
+        return false;
+    JSObject*code = NULL;
+    JS_XDRMemSetData(xdr, (void*)data, len);
+    JSBool ok = JS_XDRScriptObject(xdr, &code);
+    /* the buffer belongs to the caller- don't let JS_XDRDestroy free it */
+    JS_XDRMemSetData(xdr, NULL, 0);
+    JS_XDRDestroy(xdr);
+    if(!ok) {
+        language_error(li, "invalid bytecode\n");
+        return false;
+    }
+
+    jsval rval;
+    PROBE2(guest__compile__start, li->name, len);
+    ok = JS_ExecuteScript(js->cx, js->global, code, &rval);
+    PROBE2(guest__compile__done, li->name, ok);
+    if(!ok) {
+        language_error(li, "Couldn't run javascript program\n");
+    }
+    return ok;
+}
+
 static bool is_function_js(language_t*li, const char*name)
 {
     js_internal_t*js = (js_internal_t*)li->internal;
@@ -264,6 +646,7 @@ static value_t* call_function_js(language_t*li, const char*name, value_t* _args)
 {
     js_internal_t*js = (js_internal_t*)li->internal;
     log_dbg("[js] calling function %s", name);
+    begin_operation(li);
     assert(_args->type == TYPE_ARRAY);
 
     JSBool ok;
@@ -274,7 +657,9 @@ static value_t* call_function_js(language_t*li, const char*name, value_t* _args)
     }
     jsval rval;
 
+    PROBE2(guest__call__start, li->name, name);
     ok = JS_CallFunctionName(js->cx, js->global, name, _args->length, args, &rval);
+    PROBE3(guest__call__done, li->name, name, ok);
     if(!ok) {
         language_error(js->li, "execution of function %s failed\n", name);
         return NULL;
@@ -290,6 +675,39 @@ static value_t* call_function_js(language_t*li, const char*name, value_t* _args)
     return val;
 }
 
+static bool collect_garbage_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    js->collecting = true;
+    JS_GC(js->cx);
+    js->collecting = false;
+    return true;
+}
+
+static bool get_stats_js(language_t*li, call_stats_t*stats)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    size_t heap = JS_GetGCParameter(js->rt, JSGC_BYTES);
+    uint64_t total = heap + js->collected;
+    stats->allocated_bytes = total > js->heap_start ? total - js->heap_start : 0;
+    stats->peak_heap = heap > js->peak_heap ? heap : js->peak_heap;
+    stats->gc_collections = js->gc_collections;
+    stats->gc_time = js->gc_time / 1e9;
+    return true;
+}
+
+static char* get_backtrace_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    return js->backtrace ? strdup(js->backtrace) : NULL;
+}
+
+static char* get_profile_js(language_t*li)
+{
+    js_internal_t*js = (js_internal_t*)li->internal;
+    return profile_folded(js->profile);
+}
+
 void destroy_js(language_t* li)
 {
     if(li->internal) {
@@ -298,8 +716,11 @@ void destroy_js(language_t* li)
         JS_DestroyRuntime(js->rt);
         JS_ShutDown();
         free(js->buffer);
+        profile_destroy(js->profile);
+        free(js->backtrace);
         free(js);
     }
+    free(li->version);
     free(li);
 }
 
@@ -309,6 +730,14 @@ language_t* javascript_interpreter_new()
     li->name = "js";
     li->initialize = initialize_js;
     li->compile_script = compile_script_js;
+    li->compile_to_bytecode = compile_to_bytecode_js;
+    li->load_bytecode = load_bytecode_js;
+    li->interrupt = interrupt_js;
+    li->get_profile = get_profile_js;
+    li->get_stats = get_stats_js;
+    li->get_backtrace = get_backtrace_js;
+    li->reset = reset_js;
+    li->collect_garbage = collect_garbage_js;
     li->is_function = is_function_js;
     li->call_function = call_function_js;
     li->define_function = define_function_js;
@@ -5,13 +5,44 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#ifdef LUAJIT
+#include <luajit.h>
+#endif
 #include <errno.h>
 #include "language.h"
+#include "probes.h"
+#include "profile.h"
 
 typedef struct _lua_internal {
     language_t*li;
     lua_State* state;
     int method_count;
+    profile_t*profile;
+    char*backtrace;
+
+    /* registry reference to a copy of the globals table right after
+       initialization, for reset_lua() */
+    int pristine_globals;
+
+    /* whether we stopped the collector for GC_BETWEEN_CALLS */
+    bool gc_stopped;
+
+#ifdef LUAJIT
+    /* registry references to ffi.new, to the constructor of our checked
+       arrays, to a weak table that maps them to their cdata, and to one
+       that maps them to length * 2 + (1 for float, 0 for int32) */
+    int ffi_new;
+    int cdata_new;
+    int cdata_data;
+    int cdata_arrays;
+    bool jit_on;
+#endif
+
+    /* allocator accounting */
+    size_t heap;
+    size_t peak_heap;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
 } lua_internal_t;
 
 static const luaL_reg lualibs[] =
@@ -20,19 +51,207 @@ static const luaL_reg lualibs[] =
     {"table", luaopen_table},
     {"math", luaopen_math},
     {"string", luaopen_string},
+#ifdef LUAJIT
+    {"bit", luaopen_bit},
+#endif
     {NULL,   NULL}
 };
 
-static void openlualibs(lua_State *l)
+static void openlualibs(lua_State *l, init_profile_t profile)
 {
     const luaL_reg *lib;
     for(lib = lualibs; lib->func != NULL; lib++)
     {
-        lib->func(l);
-        lua_settop(l, 0);
+        if(profile == INIT_PROFILE_MINIMAL && lib->func == luaopen_math)
+            continue;
+        /* LuaJIT's libraries have to be opened through lua_call() */
+        lua_pushcfunction(l, lib->func);
+        lua_pushstring(l, lib->name);
+        lua_call(l, 1, 0);
+    }
+}
+
+#ifdef LUAJIT
+/* The JIT only starts once the jit library is opened; the ffi library
+   gives us typed arrays. Guests get neither, since both can switch the
+   compiler off or reach outside of the interpreter. */
+static void open_luajit(lua_internal_t*lua)
+{
+    lua_State*l = lua->state;
+    lua_pushcfunction(l, luaopen_jit);
+    lua_pushstring(l, LUA_JITLIBNAME);
+    lua_call(l, 1, 0);
+    lua_pushnil(l);
+    lua_setglobal(l, LUA_JITLIBNAME);
+
+    lua_pushcfunction(l, luaopen_ffi);
+    lua_pushstring(l, LUA_FFILIBNAME);
+    lua_call(l, 1, 1);
+    lua_getfield(l, -1, "new");
+    lua->ffi_new = luaL_ref(l, LUA_REGISTRYINDEX);
+    lua_pop(l, 1);
+
+    lua_newtable(l);
+    lua_newtable(l);
+    lua_pushstring(l, "k");
+    lua_setfield(l, -2, "__mode");
+    lua_setmetatable(l, -2);
+    lua->cdata_arrays = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    lua->jit_on = lua->li->tuning.jit != JIT_NONE;
+    luaJIT_setmode(l, 0, LUAJIT_MODE_ENGINE | (lua->jit_on ? LUAJIT_MODE_ON : LUAJIT_MODE_OFF));
+}
+
+/* Guests never see the cdata itself, since indexing it isn't bounds
+   checked. They get an empty table whose metamethods check the index
+   and then access the cdata, which the JIT compiles to a few
+   instructions. The builtins are captured now, so that guests can't
+   replace them. */
+static const char cdata_array_source[] =
+    "local new, lengths = ...\n"
+    "local type, error, setmetatable = type, error, setmetatable\n"
+    "local data = setmetatable({}, {__mode = 'k'})\n"
+    "local function check(t, i)\n"
+    "    if type(i) ~= 'number' or i < 0 or i >= lengths[t] or i % 1 ~= 0 then\n"
+    "        error('array index out of range', 3)\n"
+    "    end\n"
+    "end\n"
+    "local meta = {\n"
+    "    __index = function(t, i) check(t, i); return data[t][i] end,\n"
+    "    __newindex = function(t, i, v) check(t, i); data[t][i] = v end,\n"
+    "    __metatable = false,\n"
+    "}\n"
+    "return function(ctype, n)\n"
+    "    local t = setmetatable({}, meta)\n"
+    "    local d = new(ctype, n)\n"
+    "    data[t] = d\n"
+    "    lengths[t] = n\n"
+    "    return t, d\n"
+    "end, data\n";
+
+/* needs the base library */
+static void open_cdata_arrays(lua_internal_t*lua)
+{
+    lua_State*l = lua->state;
+    if(luaL_loadbuffer(l, cdata_array_source, strlen(cdata_array_source), "=cdata_arrays")) {
+        log_err("[luajit] %s", lua_tostring(l, -1));
+        lua_pop(l, 1);
+        return;
+    }
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->ffi_new);
+    lua_newtable(l);
+    lua_newtable(l);
+    lua_pushstring(l, "k");
+    lua_setfield(l, -2, "__mode");
+    lua_setmetatable(l, -2);
+    lua_call(l, 2, 2);
+    lua->cdata_data = luaL_ref(l, LUA_REGISTRYINDEX);
+    lua->cdata_new = luaL_ref(l, LUA_REGISTRYINDEX);
+}
+
+/* pushes an int32_t[length] or float[length] array, and returns its data.
+   NULL if arrays this short are passed as tables. */
+static void* push_new_cdata_array(lua_internal_t*lua, bool floats, int length)
+{
+    lua_State*l = lua->state;
+    uint32_t min_length = lua->li->tuning.cdata_arrays;
+    if(!min_length || length < min_length || !lua->cdata_new)
+        return NULL;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->cdata_new);
+    lua_pushstring(l, floats ? "float[?]" : "int32_t[?]");
+    lua_pushinteger(l, length);
+    if(lua_pcall(l, 2, 2, 0)) {
+        lua_pop(l, 1);
+        return NULL;
+    }
+    void*data = (void*)lua_topointer(l, -1);
+    lua_pop(l, 1);
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->cdata_arrays);
+    lua_pushvalue(l, -2);
+    lua_pushinteger(l, length * 2 + floats);
+    lua_rawset(l, -3);
+    lua_pop(l, 1);
+    return data;
+}
+
+/* Passes an array of at least tuning.cdata_arrays int32s or floats as an
+   int32_t[n] or float[n]. Indices start at 0, just like for tables. */
+static bool push_cdata_array(lua_internal_t*lua, value_t*array)
+{
+    uint32_t min_length = lua->li->tuning.cdata_arrays;
+    if(!min_length || array->length < min_length)
+        return false;
+    type_t type = array->data[0]->type;
+    if(type != TYPE_INT32 && type != TYPE_FLOAT32)
+        return false;
+    int i;
+    for(i=1;i<array->length;i++) {
+        if(array->data[i]->type != type)
+            return false;
     }
+
+    void*data = push_new_cdata_array(lua, type == TYPE_FLOAT32, array->length);
+    if(!data)
+        return false;
+    if(type == TYPE_INT32) {
+        for(i=0;i<array->length;i++)
+            ((int32_t*)data)[i] = array->data[i]->i32;
+    } else {
+        for(i=0;i<array->length;i++)
+            ((float*)data)[i] = array->data[i]->f32;
+    }
+    return true;
 }
 
+/* the data of one of our arrays, or NULL for other tables */
+static const void* cdata_array_data(lua_internal_t*lua, int idx, int*length, bool*floats)
+{
+    lua_State*l = lua->state;
+    if(!lua->cdata_new)
+        return NULL;
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->cdata_arrays);
+    lua_pushvalue(l, idx);
+    lua_rawget(l, -2);
+    int info = lua_tointeger(l, -1);
+    lua_pop(l, 2);
+    if(!info)
+        return NULL;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->cdata_data);
+    lua_pushvalue(l, idx);
+    lua_rawget(l, -2);
+    const void*data = lua_topointer(l, -1);
+    lua_pop(l, 2);
+
+    *length = info / 2;
+    *floats = info & 1;
+    return data;
+}
+
+/* NULL for tables that aren't one of our arrays */
+static value_t* cdata_array_to_value(lua_internal_t*lua, int idx)
+{
+    int length;
+    bool floats;
+    const void*data = cdata_array_data(lua, idx, &length, &floats);
+    if(!data)
+        return NULL;
+
+    value_t*array = array_new_sized(length);
+    int i;
+    if(floats) {
+        for(i=0;i<length;i++)
+            array_append_float32(array, ((const float*)data)[i]);
+    } else {
+        for(i=0;i<length;i++)
+            array_append_int32(array, ((const int32_t*)data)[i]);
+    }
+    return array;
+}
+#endif
+
 static void dump_stack(lua_State *l) {
     int i;
     int len = lua_gettop(l);
@@ -85,6 +304,59 @@ static void show_error(language_t*li, lua_State *l)
     language_error(li, s);
 }
 
+static void* lua_alloc(void*ud, void*ptr, size_t osize, size_t nsize)
+{
+    lua_internal_t*lua = (lua_internal_t*)ud;
+    if(!ptr)
+        osize = 0;
+    if(nsize == 0) {
+        free(ptr);
+        lua->heap -= osize;
+        return NULL;
+    }
+    void*data = realloc(ptr, nsize);
+    if(!data)
+        return NULL;
+    if(!ptr)
+        lua->allocations++;
+    if(nsize > osize)
+        lua->allocated_bytes += nsize - osize;
+    lua->heap += nsize - osize;
+    if(lua->heap > lua->peak_heap)
+        lua->peak_heap = lua->heap;
+    return data;
+}
+
+static int lua_panic(lua_State*l)
+{
+    log_err("[lua] unprotected error in call to Lua API (%s)", lua_tostring(l, -1));
+    return 0;
+}
+
+/* the allocator's userdata doubles as a way to find our state from hooks */
+static lua_internal_t* lua_internal(lua_State*l)
+{
+    void*ud = NULL;
+    lua_getallocf(l, &ud);
+    return (lua_internal_t*)ud;
+}
+
+/* shallow copy of all entries of the table at index from into the table at
+   index to. Both indices are relative to the stack as it was on entry. */
+static void copy_table(lua_State*l, int from, int to)
+{
+    if(from < 0 && from > LUA_REGISTRYINDEX)
+        from = lua_gettop(l) + from + 1;
+    if(to < 0 && to > LUA_REGISTRYINDEX)
+        to = lua_gettop(l) + to + 1;
+    lua_pushnil(l);
+    while(lua_next(l, from)) {
+        lua_pushvalue(l, -2);
+        lua_insert(l, -2);
+        lua_rawset(l, to);
+    }
+}
+
 static bool initialize_lua(language_t*li, size_t mem_size)
 {
     if(li->internal)
@@ -94,21 +366,171 @@ static bool initialize_lua(language_t*li, size_t mem_size)
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua->li = li;
 
-    lua_State*l = lua->state = lua_open();
-    openlualibs(l);
+    lua_State*l = lua->state = lua_newstate(lua_alloc, lua);
+    if(!l) {
+#ifdef LUAJIT
+        log_err("[luajit] can't create a state with our allocator (64 bit LuaJIT needs LJ_GC64)");
+#endif
+        return false;
+    }
+    lua_atpanic(l, lua_panic);
+#ifdef LUAJIT
+    li->version = runtime_version(LUAJIT_VERSION, (void*)lua_newstate);
+    open_luajit(lua);
+#else
+    li->version = runtime_version(LUA_RELEASE, (void*)lua_newstate);
+#endif
+    if(li->tuning.gc_growth)
+        lua_gc(l, LUA_GCSETPAUSE, li->tuning.gc_growth);
+    if(li->tuning.gc_stepmul)
+        lua_gc(l, LUA_GCSETSTEPMUL, li->tuning.gc_stepmul);
+    openlualibs(l, li->init_profile);
+#ifdef LUAJIT
+    open_cdata_arrays(lua);
+#endif
+    lua->profile = profile_new();
 
+    lua_newtable(l);
+    copy_table(l, LUA_GLOBALSINDEX, -1);
+    /* would keep the original globals table alive */
+    lua_pushnil(l);
+    lua_setfield(l, -2, "_G");
+    lua->pristine_globals = luaL_ref(l, LUA_REGISTRYINDEX);
     return true;
 }
 
+/* replace the globals table with a fresh copy of the one we had after
+   initialization. Library tables (string, table, ...) are shared between
+   the two. */
+static bool reset_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_State*l = lua->state;
+
+    lua_newtable(l);
+    lua_rawgeti(l, LUA_REGISTRYINDEX, lua->pristine_globals);
+    copy_table(l, -1, -2);
+    lua_pop(l, 1);
+    lua_pushvalue(l, -1);
+    lua_setfield(l, -2, "_G");
+    lua_replace(l, LUA_GLOBALSINDEX);
+
+    free(lua->backtrace);
+    lua->backtrace = NULL;
+    lua_gc(l, LUA_GCCOLLECT, 0);
+    return true;
+}
+
+/* operations are counted in steps of this many VM instructions */
+#define OPS_PER_HOOK 1000
+
+static void sample_stack(lua_State*l, profile_t*profile)
+{
+    lua_Debug ar;
+    int level;
+    profile_sample_begin(profile);
+    for(level=0;lua_getstack(l, level, &ar);level++) {
+        lua_getinfo(l, "Snl", &ar);
+        profile_sample_frame(profile, ar.name ? ar.name : ar.what, ar.short_src, ar.currentline);
+    }
+    profile_sample_end(profile);
+}
+
+static void count_hook(lua_State*l, lua_Debug*ar)
+{
+    lua_internal_t*lua = lua_internal(l);
+    language_t*li = lua->li;
+    li->ops += OPS_PER_HOOK;
+    if(profile_due(lua->profile, li->ops)) {
+        sample_stack(l, lua->profile);
+    }
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        /* the hook stays active, so the guest can't pcall() its way
+           around this */
+        li->timeout = true;
+        luaL_error(l, "operation budget exceeded");
+    }
+}
+
+/* called before running any guest code; also clears any pending interrupt */
+static void begin_operation(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    li->timeout = false;
+    li->ops = 0;
+    free(lua->backtrace);
+    lua->backtrace = NULL;
+    lua->allocations = 0;
+    lua->allocated_bytes = 0;
+    lua->peak_heap = lua->heap;
+    profile_start(lua->profile, li->profile_interval);
+    if(li->ops_budget || li->profile_interval) {
+        lua_sethook(lua->state, count_hook, LUA_MASKCOUNT, OPS_PER_HOOK);
+    } else {
+        lua_sethook(lua->state, NULL, 0, 0);
+    }
+#ifdef LUAJIT
+    /* compiled traces don't call hooks, so counting operations, and
+       interrupting an unsandboxed guest, only work in the interpreter */
+    bool jit_on = li->tuning.jit != JIT_NONE && !li->ops_budget && !li->profile_interval &&
+                  !li->interruptible;
+    if(jit_on != lua->jit_on) {
+        luaJIT_setmode(lua->state, 0, LUAJIT_MODE_ENGINE | (jit_on ? LUAJIT_MODE_ON : LUAJIT_MODE_OFF));
+        lua->jit_on = jit_on;
+    }
+#endif
+    bool stop_gc = li->gc_policy == GC_BETWEEN_CALLS;
+    if(stop_gc != lua->gc_stopped) {
+        lua_gc(lua->state, stop_gc ? LUA_GCSTOP : LUA_GCRESTART, 0);
+        lua->gc_stopped = stop_gc;
+    }
+}
+
+/* message handler for lua_pcall(). Runs where the error happened, before
+   the stack is unwound. */
+static int capture_backtrace(lua_State*l)
+{
+    lua_internal_t*lua = lua_internal(l);
+    lua_Debug ar;
+    int level;
+    free(lua->backtrace);
+    lua->backtrace = NULL;
+    for(level=1;lua_getstack(l, level, &ar);level++) {
+        lua_getinfo(l, "Snl", &ar);
+        lua->backtrace = backtrace_add_frame(lua->backtrace, ar.name ? ar.name : ar.what, ar.short_src, ar.currentline);
+    }
+    return 1; // the error message
+}
+
+static void interrupt_hook(lua_State*l, lua_Debug*ar)
+{
+    /* stays installed until the next operation, in case the guest
+       catches the error */
+    luaL_error(l, "interrupted");
+}
+
+static void interrupt_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    /* this is what lua.c does on SIGINT- lua_sethook() is signal safe */
+    lua_sethook(lua->state, interrupt_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+}
+
 static bool compile_script_lua(language_t*li, const char*script)
 {
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua_State*l = lua->state;
+    begin_operation(li);
 
+    lua_pushcfunction(l, capture_backtrace);
+    int handler = lua_gettop(l);
+    PROBE2(guest__compile__start, li->name, strlen(script));
     int error = luaL_loadbuffer(l, script, strlen(script), "@file.lua");
     if(!error) {
-        error = lua_pcall(l, 0, LUA_MULTRET, 0);
+        error = lua_pcall(l, 0, LUA_MULTRET, handler);
     }
+    PROBE2(guest__compile__done, li->name, !error);
+    lua_remove(l, handler);
     if(error) {
         show_error(li, l);
         language_error(li, "Couldn't compile: %d\n", error);
@@ -117,9 +539,81 @@ static bool compile_script_lua(language_t*li, const char*script)
     return true;
 }
 
-static void push_value(lua_State*l, value_t*value)
+typedef struct _dump_buffer {
+    char*data;
+    int len;
+    int size;
+} dump_buffer_t;
+
+static int dump_writer(lua_State*l, const void*p, size_t size, void*ud)
 {
-    int i;
+    dump_buffer_t*b = ud;
+    if(b->len + size > b->size) {
+        b->size = (b->len + size) * 2 + 64;
+        b->data = realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, p, size);
+    b->len += size;
+    return 0;
+}
+
+static bool compile_to_bytecode_lua(language_t*li, const char*script, void**data, int*len)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_State*l = lua->state;
+
+    int error = luaL_loadbuffer(l, script, strlen(script), "@file.lua");
+    if(error) {
+        show_error(li, l);
+        language_error(li, "Couldn't compile: %d\n", error);
+        return false;
+    }
+    dump_buffer_t b = {NULL, 0, 0};
+    lua_dump(l, dump_writer, &b);
+    lua_pop(l, 1);
+    *data = b.data;
+    *len = b.len;
+    return true;
+}
+
+static bool load_bytecode_lua(language_t*li, const void*data, int len)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_State*l = lua->state;
+    begin_operation(li);
+
+    lua_pushcfunction(l, capture_backtrace);
+    int handler = lua_gettop(l);
+    PROBE2(guest__compile__start, li->name, len);
+    int error = luaL_loadbuffer(l, data, len, "@file.lua");
+    if(!error) {
+        error = lua_pcall(l, 0, LUA_MULTRET, handler);
+    }
+    PROBE2(guest__compile__done, li->name, !error);
+    lua_remove(l, handler);
+    if(error) {
+        show_error(li, l);
+        language_error(li, "Couldn't run bytecode: %d\n", error);
+        return false;
+    }
+    return true;
+}
+
+typedef struct _push_context {
+    lua_State*l;
+    int base;
+} push_context_t;
+
+/* Nested tables are built on the Lua stack: each open table sits on top
+   of its key, and is stored into its parent when it's complete. */
+static bool push_visit(void*_context, value_t*value, int index)
+{
+    push_context_t*context = _context;
+    lua_State*l = context->l;
+
+    if(!lua_checkstack(l, 3))
+        return false;
+
     switch(value->type) {
         case TYPE_VOID:
             lua_pushnil(l);
@@ -138,20 +632,59 @@ static void push_value(lua_State*l, value_t*value)
         }
         break;
         case TYPE_ARRAY: {
-            lua_newtable(l);
-            for(i=0;i<value->length;i++) {
-                lua_pushinteger(l, i);
-                push_value(l, value->data[i]);
-                lua_settable(l, -3);
+            if(index >= 0)
+                lua_pushinteger(l, index);
+            /* arrays start at index 0, which lives in the hash part */
+            if(value->length) {
+                lua_createtable(l, value->length - 1, 1);
+            } else {
+                lua_newtable(l);
             }
+            return true;
         }
         break;
         default: {
             lua_pushnil(l);
         }
     }
+    if(index >= 0)
+        lua_rawseti(l, -2, index);
+    return true;
 }
 
+static bool push_leave(void*_context, value_t*array)
+{
+    push_context_t*context = _context;
+    lua_State*l = context->l;
+    if(lua_gettop(l) > context->base + 1)
+        lua_rawset(l, -3);
+    return true;
+}
+
+/* pushes value, or nothing if it's nested too deeply for the Lua stack */
+static bool push_value(lua_State*l, value_t*value)
+{
+    static const value_visitor_t push_visitor = {push_visit, push_leave};
+#ifdef LUAJIT
+    if(value->type == TYPE_ARRAY && push_cdata_array(lua_internal(l), value))
+        return true;
+#endif
+    push_context_t context;
+    context.l = l;
+    context.base = lua_gettop(l);
+    if(!value_walk(value, &push_visitor, &context)) {
+        lua_settop(l, context.base);
+        return false;
+    }
+    return true;
+}
+
+typedef struct _lua_frame {
+    int index;
+    int pos;
+    value_t*array;
+} lua_frame_t;
+
 static value_t* lua_to_value(language_t*li, int idx)
 {
     lua_internal_t*lua = (lua_internal_t*)li->internal;
@@ -160,33 +693,86 @@ static value_t* lua_to_value(language_t*li, int idx)
     if(lua_gettop(l)+idx < 0) {
         language_error(li, "[lua] Stack overflow: idx=%d, top=%d\n", idx, lua_gettop(l));
         return NULL;
-    } else if(lua_isnoneornil(l, idx)) {
-        return value_new_void();
-    } else if(lua_isboolean(l, idx)) {
-        return value_new_boolean(lua_toboolean(l, idx));
-    } else if(lua_isnumber(l, idx)) {
-        return value_new_float32(lua_tonumber(l, idx));
-    } else if(lua_isnumber(l, idx)) {
-        return value_new_int32(lua_tointeger(l, idx));
-    } else if(lua_isstring(l, idx)) {
-        value_t*v = value_new_string(lua_tostring(l, idx));
-        return v;
-    } else if(lua_istable(l, idx)) {
-        value_t*array = array_new();
-        int i;
-        for(i=0;;i++) {
-            lua_pushinteger(l, i);
-            lua_gettable(l, idx<0?idx-1:idx);
-            if(lua_isnil(l, -1)) {
-                lua_pop(l, 1);
+    }
+
+    int top = lua_gettop(l);
+    int start = idx < 0 ? top + idx + 1 : idx;
+    int current = start;
+
+    /* tables which are being converted stay on the Lua stack */
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(lua_frame_t));
+    value_t*root = NULL;
+
+    while(1) {
+        value_t*v;
+        bool is_table = false;
+        if(lua_isnoneornil(l, current)) {
+            v = value_new_void();
+        } else if(lua_isboolean(l, current)) {
+            v = value_new_boolean(lua_toboolean(l, current));
+        } else if(lua_type(l, current) == LUA_TNUMBER) {
+            /* not lua_isnumber(), which is true for strings like "1" */
+            v = value_new_float32(lua_tonumber(l, current));
+        } else if(lua_isstring(l, current)) {
+            v = value_new_string(lua_tostring(l, current));
+#ifdef LUAJIT
+        } else if(lua_istable(l, current) && (v = cdata_array_to_value(lua, current))) {
+#endif
+        } else if(lua_istable(l, current)) {
+            /* lua_objlen() counts entries 1..n, we also have entry 0 */
+            v = array_new_sized(lua_objlen(l, current) + 1);
+            is_table = true;
+        } else {
+            language_error(li, "Don't know how to process lua type: %d\n", lua_type(l, current));
+            goto error;
+        }
+
+        lua_frame_t*parent = walk_stack_top(&stack);
+        if(parent) {
+            array_append(parent->array, v);
+        } else {
+            root = v;
+        }
+
+        if(is_table) {
+            lua_frame_t*frame = walk_stack_push(&stack);
+            frame->index = current;
+            frame->pos = 0;
+            frame->array = v;
+        } else if(current != start) {
+            lua_pop(l, 1);
+        }
+
+        /* fetch the next table entry */
+        lua_frame_t*frame;
+        while((frame = walk_stack_top(&stack))) {
+            if(!lua_checkstack(l, 2)) {
+                language_error(li, "[lua] table nested too deeply\n");
+                goto error;
+            }
+            lua_rawgeti(l, frame->index, frame->pos);
+            if(!lua_isnil(l, -1)) {
+                frame->pos++;
+                current = lua_gettop(l);
                 break;
             }
-            array_append(array, lua_to_value(li, -1));
             lua_pop(l, 1);
+            if(frame->index != start)
+                lua_pop(l, 1);
+            walk_stack_pop(&stack);
+        }
+        if(!frame) {
+            walk_stack_destroy(&stack);
+            return root;
         }
-        return array;
     }
-    language_error(li, "Don't know how to process lua type: %d\n");
+
+error:
+    lua_settop(l, top);
+    walk_stack_destroy(&stack);
+    if(root)
+        value_destroy(root);
     return NULL;
 }
 
@@ -195,9 +781,11 @@ static void define_constant_lua(struct _language*li, const char*name, value_t*va
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua_State*l = lua->state;
 
-    push_value(l, value);
+    if(!push_value(l, value)) {
+        language_error(li, "[lua] %s: value nested too deeply\n", name);
+        return;
+    }
     lua_setglobal(l, name);
-
 }
 
 typedef struct {
@@ -226,8 +814,10 @@ static int lua_function_proxy(lua_State*l)
     value_t*ret = f->call(f, args);
     value_destroy(args);
 
-    push_value(l, ret);
+    bool pushed = push_value(l, ret);
     value_destroy(ret);
+    if(!pushed)
+        return luaL_error(l, "%s: return value nested too deeply", data->name);
     return 1;
 }
 
@@ -265,20 +855,31 @@ static value_t* call_function_lua(language_t*li, const char*name, value_t*args)
 {
     lua_internal_t*lua = (lua_internal_t*)li->internal;
     lua_State*l = lua->state;
+    begin_operation(li);
 
+    lua_pushcfunction(l, capture_backtrace);
+    int handler = lua_gettop(l);
     lua_getfield(l, LUA_GLOBALSINDEX, name);
 
     if(!lua_isfunction(l, -1)) {
         language_error(li, "%s is not a function", name);
+        lua_settop(l, handler - 1);
         return NULL;
     }
 
     int i;
     for(i=0;i<args->length;i++) {
-        push_value(l, args->data[i]);
+        if(!push_value(l, args->data[i])) {
+            language_error(li, "[lua] %s: argument %d nested too deeply\n", name, i+1);
+            lua_settop(l, handler - 1);
+            return NULL;
+        }
     }
 
-    int error = lua_pcall(l, /*nargs*/args->length, /*nresults*/1, 0);
+    PROBE2(guest__call__start, li->name, name);
+    int error = lua_pcall(l, /*nargs*/args->length, /*nresults*/1, handler);
+    PROBE3(guest__call__done, li->name, name, !error);
+    lua_remove(l, handler);
     if(error) {
         show_error(li, l);
         language_error(li, "Error calling function %s: %d\n", name, error);
@@ -291,24 +892,292 @@ static value_t* call_function_lua(language_t*li, const char*name, value_t*args)
     return ret;
 }
 
+/* pushes an argument of a declared type, straight from the typed encoding */
+static bool push_typed(lua_internal_t*lua, typed_reader_t*r, char type)
+{
+    lua_State*l = lua->state;
+    bool b;
+    int32_t i32;
+    float f32;
+    const char*s;
+    int length, i;
+    switch(type) {
+        case 'b':
+            if(!typed_read_boolean(r, &b))
+                return false;
+            lua_pushboolean(l, b);
+            return true;
+        case 'i':
+            if(!typed_read_int32(r, &i32))
+                return false;
+            lua_pushinteger(l, i32);
+            return true;
+        case 'f':
+            if(!typed_read_float32(r, &f32))
+                return false;
+            lua_pushnumber(l, f32);
+            return true;
+        case 's':
+            if(!typed_read_string(r, &s, &length))
+                return false;
+            lua_pushlstring(l, s, length);
+            return true;
+    }
+
+    if(!typed_read_length(r, &length))
+        return false;
+#ifdef LUAJIT
+    if(type == 'I' || type == 'F') {
+        void*data = push_new_cdata_array(lua, type == 'F', length);
+        if(data) {
+            for(i=0;i<length;i++) {
+                bool ok = type == 'I' ? typed_read_int32(r, (int32_t*)data + i) :
+                                        typed_read_float32(r, (float*)data + i);
+                if(!ok) {
+                    lua_pop(l, 1);
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+#endif
+    /* arrays start at index 0, which lives in the hash part */
+    if(length) {
+        lua_createtable(l, length - 1, 1);
+    } else {
+        lua_newtable(l);
+    }
+    for(i=0;i<length;i++) {
+        if(!push_typed(lua, r, type - 'A' + 'a')) {
+            lua_pop(l, 1);
+            return false;
+        }
+        lua_rawseti(l, -2, i);
+    }
+    return true;
+}
+
+/* whole numbers in the int32 range, like value_matches_type() */
+static bool number_to_int32(lua_Number n, int32_t*i32)
+{
+    if(!(n >= -2147483648.0 && n < 2147483648.0) || n != (lua_Number)(int32_t)n)
+        return false;
+    *i32 = (int32_t)n;
+    return true;
+}
+
+/* false if the value doesn't have the declared type */
+static bool write_typed_scalar(lua_State*l, int idx, char type, typed_writer_t*w)
+{
+    int32_t i32;
+    switch(type) {
+        case 'b':
+            if(lua_type(l, idx) != LUA_TBOOLEAN)
+                return false;
+            typed_write_boolean(w, lua_toboolean(l, idx));
+            return true;
+        case 'i':
+            if(lua_type(l, idx) != LUA_TNUMBER || !number_to_int32(lua_tonumber(l, idx), &i32))
+                return false;
+            typed_write_int32(w, i32);
+            return true;
+        case 'f':
+            if(lua_type(l, idx) != LUA_TNUMBER)
+                return false;
+            typed_write_float32(w, lua_tonumber(l, idx));
+            return true;
+        case 's': {
+            if(lua_type(l, idx) != LUA_TSTRING)
+                return false;
+            size_t len;
+            const char*s = lua_tolstring(l, idx, &len);
+            typed_write_string(w, s, len);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* writes the return value at the top of the stack, straight into the
+   typed encoding */
+static bool write_typed(lua_internal_t*lua, char type, typed_writer_t*w)
+{
+    lua_State*l = lua->state;
+    if(type != 'B' && type != 'I' && type != 'F' && type != 'S')
+        return write_typed_scalar(l, -1, type, w);
+    if(!lua_istable(l, -1))
+        return false;
+    int idx = lua_gettop(l);
+    int length = 0, i;
+#ifdef LUAJIT
+    bool floats;
+    const void*data = cdata_array_data(lua, idx, &length, &floats);
+    if(data) {
+        if(type != 'I' && type != 'F')
+            return false;
+        typed_write_length(w, length);
+        for(i=0;i<length;i++) {
+            if(!floats) {
+                int32_t i32 = ((const int32_t*)data)[i];
+                if(type == 'I') {
+                    typed_write_int32(w, i32);
+                } else {
+                    typed_write_float32(w, i32);
+                }
+            } else if(type == 'F') {
+                typed_write_float32(w, ((const float*)data)[i]);
+            } else {
+                int32_t i32;
+                if(!number_to_int32(((const float*)data)[i], &i32))
+                    return false;
+                typed_write_int32(w, i32);
+            }
+        }
+        return true;
+    }
+#endif
+    /* entries 0..n-1, like lua_to_value() */
+    while(1) {
+        lua_rawgeti(l, idx, length);
+        bool end = lua_isnil(l, -1);
+        lua_pop(l, 1);
+        if(end)
+            break;
+        length++;
+    }
+    typed_write_length(w, length);
+    for(i=0;i<length;i++) {
+        lua_rawgeti(l, idx, i);
+        bool ok = write_typed_scalar(l, -1, type - 'A' + 'a', w);
+        lua_pop(l, 1);
+        if(!ok)
+            return false;
+    }
+    return true;
+}
+
+static bool call_typed_lua(language_t*li, const char*name, const char*params, const char*ret_type,
+                           typed_reader_t*args, typed_writer_t*ret)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_State*l = lua->state;
+    begin_operation(li);
+
+    /* the arguments, plus the handler, the function and an array entry */
+    int num_params = strlen(params);
+    if(!lua_checkstack(l, num_params + 3)) {
+        language_error(li, "[lua] %s: too many arguments\n", name);
+        return false;
+    }
+    lua_pushcfunction(l, capture_backtrace);
+    int handler = lua_gettop(l);
+    lua_getfield(l, LUA_GLOBALSINDEX, name);
+
+    if(!lua_isfunction(l, -1)) {
+        language_error(li, "%s is not a function", name);
+        lua_settop(l, handler - 1);
+        return false;
+    }
+
+    int i;
+    for(i=0;i<num_params;i++) {
+        if(!push_typed(lua, args, params[i])) {
+            language_error(li, "[lua] %s: argument %d is truncated\n", name, i+1);
+            lua_settop(l, handler - 1);
+            return false;
+        }
+    }
+
+    PROBE2(guest__call__start, li->name, name);
+    int error = lua_pcall(l, num_params, /*nresults*/1, handler);
+    PROBE3(guest__call__done, li->name, name, !error);
+    lua_remove(l, handler);
+    if(error) {
+        show_error(li, l);
+        language_error(li, "Error calling function %s: %d\n", name, error);
+        return false;
+    }
+
+    bool ok = !ret_type[0] || write_typed(lua, ret_type[0], ret);
+    if(!ok) {
+        language_error(li, "%s: return value should be %s, not %s", name,
+                type_code_to_string(ret_type[0]), lua_typename(l, lua_type(l, -1)));
+    }
+    lua_pop(l, 1);
+    return ok;
+}
+
+static bool collect_garbage_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    lua_gc(lua->state, LUA_GCCOLLECT, 0);
+    /* a full collection resets the threshold, which restarts a stopped
+       collector */
+    lua->gc_stopped = false;
+    return true;
+}
+
+static bool get_stats_lua(language_t*li, call_stats_t*stats)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    stats->allocations = lua->allocations;
+    stats->allocated_bytes = lua->allocated_bytes;
+    stats->peak_heap = lua->peak_heap;
+    return true;
+}
+
+static char* get_backtrace_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    return lua->backtrace ? strdup(lua->backtrace) : NULL;
+}
+
+static char* get_profile_lua(language_t*li)
+{
+    lua_internal_t*lua = (lua_internal_t*)li->internal;
+    return profile_folded(lua->profile);
+}
+
 static void destroy_lua(language_t* li)
 {
     if(li->internal) {
         lua_internal_t*lua = (lua_internal_t*)li->internal;
         lua_close(lua->state);
+        profile_destroy(lua->profile);
+        free(lua->backtrace);
         free(lua);
     }
+    free(li->version);
     free(li);
 }
 
+#ifdef LUAJIT
+language_t* luajit_interpreter_new()
+{
+    language_t * li = calloc(1, sizeof(language_t));
+    li->name = "luajit";
+    /* machine code is only made executable after it's written */
+    li->jit_mprotect = true;
+#else
 language_t* lua_interpreter_new()
 {
     language_t * li = calloc(1, sizeof(language_t));
     li->name = "lua";
+#endif
     li->initialize = initialize_lua;
     li->compile_script = compile_script_lua;
+    li->compile_to_bytecode = compile_to_bytecode_lua;
+    li->load_bytecode = load_bytecode_lua;
+    li->interrupt = interrupt_lua;
+    li->get_profile = get_profile_lua;
+    li->get_stats = get_stats_lua;
+    li->get_backtrace = get_backtrace_lua;
+    li->reset = reset_lua;
+    li->collect_garbage = collect_garbage_lua;
     li->is_function = is_function_lua;
     li->call_function = call_function_lua;
+    li->call_typed = call_typed_lua;
     li->define_function = define_function_lua;
     li->define_constant = define_constant_lua;
     li->destroy = destroy_lua;
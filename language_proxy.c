@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,10 +6,26 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <spawn.h>
 #include "language.h"
 #include "dict.h"
 #include "seccomp.h"
 #include "settings.h"
+#include "cache.h"
+#include "stats.h"
+#include "probes.h"
+#include "journal.h"
+#include "profile.h"
+
+typedef struct _setup_step setup_step_t;
 
 typedef struct _proxy_internal {
     language_t*li;
@@ -16,17 +33,65 @@ typedef struct _proxy_internal {
     pid_t child_pid;
     int fd_w;
     int fd_r;
+    /* seconds */
     int timeout;
+    /* milliseconds, for compile and call, if set with set_timeout() */
+    int call_timeout_ms;
     dict_t*callback_functions;
+    dict_t*signatures;
     bool in_call;
+
+    /* set as soon as the child has run any guest code. Bytecode produced by
+       a tainted child can't be trusted, so it never goes into the cache. */
+    bool tainted;
+    const char*caching_script;
+    /* the child interpreter's version, part of the cache key */
+    char*version;
+
+    /* set if the child didn't react to an interrupt, and had to be killed,
+       or if it crashed */
+    bool dead;
+    /* set if we killed the child. It's replaced on the next operation. */
+    bool respawn;
+    /* what was defined and compiled since the child started (or the last
+       reset()), to set up a replacement the same way */
+    setup_step_t*setup;
+    setup_step_t*setup_last;
+
+    /* guest stack of the last failed operation */
+    char*backtrace;
+
+    uint64_t ops_budget;
+    uint64_t profile_interval;
+    gc_policy_t gc_policy;
+
+    call_stats_t stats;
+    bool in_operation;
+    uint64_t bytes_written_base;
+    uint64_t bytes_read_base;
 } proxy_internal_t;
 
+typedef struct _signature {
+    char*params;
+    char*ret;
+} signature_t;
+
 enum {
     DEFINE_CONSTANT = 1,
     DEFINE_FUNCTION = 2,
     COMPILE_SCRIPT = 3,
     IS_FUNCTION = 4,
     CALL_FUNCTION =  5,
+    DECLARE_FUNCTION = 6,
+    CALL_TYPED = 7,
+    COMPILE_TO_BYTECODE = 8,
+    LOAD_BYTECODE = 9,
+    SET_OPS_BUDGET = 10,
+    SET_PROFILE_INTERVAL = 11,
+    GET_PROFILE = 12,
+    RESET = 13,
+    SET_GC_POLICY = 14,
+    COLLECT_GARBAGE = 15,
 };
 
 enum {
@@ -34,96 +99,449 @@ enum {
     RESP_RETURN = 11,
     RESP_ERROR = 12,
     RESP_LOG = 13,
+    RESP_BYTECODE = 14,
+    RESP_STATS = 16,
+    RESP_READY = 17,
+};
+
+/* what kind of failure a RESP_ERROR reports */
+enum {
+    ERROR_EXCEPTION = 1,
+    ERROR_TIMEOUT = 2,
+    ERROR_CRASH = 3,
 };
 
+/* where the child spent its time before it could accept commands, sent
+   with RESP_READY, followed by the interpreter's version. forked is a stats_now() timestamp (CLOCK_MONOTONIC is
+   the same in both processes), the rest are durations. */
+typedef struct _spawn_timings {
+    uint64_t forked;
+    uint64_t close_fds;
+    uint64_t initialize;
+    uint64_t lockdown;
+} spawn_timings_t;
+
+/* what the child knows about the cost of an operation */
+typedef struct _child_stats {
+    uint64_t ops;
+    int64_t utime_usec;
+    int64_t stime_usec;
+    int64_t max_rss;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t peak_heap;
+    uint64_t gc_collections;
+    int64_t gc_time_usec;
+    int64_t idle_gc_usec;
+} child_stats_t;
+
+/* where cagekeeper-sandbox finds its end of the pipes */
+#define SANDBOX_FD_R 3
+#define SANDBOX_FD_W 4
+
 #define MAX_ARRAY_SIZE 1024
 #define MAX_STRING_SIZE 4096
+#define MAX_BYTECODE_SIZE (16 * 1048576)
+#define MAX_PROFILE_SIZE (1048576)
+#define MAX_BACKTRACE_SIZE (BACKTRACE_MAX_SIZE + 256)
+
+/* bytes moved over the pipes by this thread, for call_stats_t */
+static __thread uint64_t bytes_written = 0;
+static __thread uint64_t bytes_read = 0;
+
+/* write all of data. Pipes take large writes in pieces, and a signal
+   (like interrupt_child()'s SIGUSR1) can cut a write short even with
+   SA_RESTART. */
+static bool write_counted(int fd, const void*data, int len)
+{
+    int pos = 0;
+    while(pos < len) {
+        int ret = write(fd, (const char*)data+pos, len-pos);
+        if(ret<0) {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+        pos += ret;
+        bytes_written += ret;
+    }
+    return true;
+}
+
+static bool read_counted(int fd, void*data, int len, struct timeval* timeout)
+{
+    if(!read_with_timeout(fd, data, len, timeout))
+        return false;
+    bytes_read += len;
+    return true;
+}
 
 static void write_byte(int fd, uint8_t b)
 {
-    write(fd, &b, 1);
+    write_counted(fd, &b, 1);
 }
 
 static void write_string(int fd, const char*name)
 {
     int l = strlen(name);
-    write(fd, &l, sizeof(l));
-    write(fd, name, l);
+    write_counted(fd, &l, sizeof(l));
+    write_counted(fd, name, l);
 }
 
 static char* read_string(int fd, int max_size, struct timeval* timeout)
 {
     int l = 0;
-    if(!read_with_timeout(fd, &l, sizeof(l), timeout))
+    if(!read_counted(fd, &l, sizeof(l), timeout))
         return NULL;
     if(l<0 || (max_size && l>=max_size))
         return NULL;
     char* s = malloc(l+1);
     if(!s)
         return NULL;
-    if(!read_with_timeout(fd, s, l, timeout))
+    if(!read_counted(fd, s, l, timeout)) {
+        free(s);
         return NULL;
+    }
     s[l]=0;
     return s;
 }
 
-static const char* write_value(int fd, value_t*v)
-{ 
-    char b = v->type;
-    write(fd, &b, 1);
+static void write_blob(int fd, const void*data, int len)
+{
+    write_counted(fd, &len, sizeof(len));
+    write_counted(fd, data, len);
+}
+
+static void* read_blob(int fd, int max_size, int*len, struct timeval* timeout)
+{
+    int l = 0;
+    if(!read_counted(fd, &l, sizeof(l), timeout))
+        return NULL;
+    if(l<0 || (max_size && l>max_size))
+        return NULL;
+    void*data = malloc(l+1);
+    if(!data)
+        return NULL;
+    if(!read_counted(fd, data, l, timeout)) {
+        free(data);
+        return NULL;
+    }
+    *len = l;
+    return data;
+}
+
+typedef struct _buffer {
+    char*data;
+    int len;
+    int size;
+} buffer_t;
+
+/* room for len more bytes at the end of the buffer */
+static char* buffer_extend(buffer_t*b, int len)
+{
+    if(b->len + len > b->size) {
+        b->size = (b->len + len) * 2 + 64;
+        b->data = realloc(b->data, b->size);
+    }
+    char*data = b->data + b->len;
+    b->len += len;
+    return data;
+}
+
+static void buffer_append(buffer_t*b, const void*data, int len)
+{
+    memcpy(buffer_extend(b, len), data, len);
+}
+
+static void buffer_append_byte(buffer_t*b, uint8_t byte)
+{
+    buffer_append(b, &byte, 1);
+}
+
+static void buffer_append_string(buffer_t*b, const char*str)
+{
+    int l = strlen(str);
+    buffer_append(b, &l, sizeof(l));
+    buffer_append(b, str, l);
+}
+
+/* write out (and reset) the buffer with as few system calls as possible */
+static void buffer_write(int fd, buffer_t*b)
+{
+    write_counted(fd, b->data, b->len);
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* commands the child doesn't answer (definitions and declarations),
+   followed by an optional script to compile */
+struct _setup_step {
+    buffer_t commands;
+    char*script;
+    setup_step_t*next;
+};
+
+static setup_step_t* add_setup_step(proxy_internal_t*proxy)
+{
+    setup_step_t*step = calloc(1, sizeof(setup_step_t));
+    if(proxy->setup_last) {
+        proxy->setup_last->next = step;
+    } else {
+        proxy->setup = step;
+    }
+    proxy->setup_last = step;
+    return step;
+}
+
+/* write out (and reset) a definition, and remember it for a replacement
+   child */
+static void send_setup(proxy_internal_t*proxy, buffer_t*b)
+{
+    setup_step_t*step = proxy->setup_last;
+    if(!step || step->script) {
+        step = add_setup_step(proxy);
+    }
+    buffer_append(&step->commands, b->data, b->len);
+    buffer_write(proxy->fd_w, b);
+}
+
+static void clear_setup(proxy_internal_t*proxy)
+{
+    setup_step_t*step = proxy->setup;
+    while(step) {
+        setup_step_t*next = step->next;
+        free(step->commands.data);
+        free(step->script);
+        free(step);
+        step = next;
+    }
+    proxy->setup = proxy->setup_last = NULL;
+}
+
+static bool encode_visit(void*context, value_t*v, int index)
+{
+    buffer_t*b = context;
+    /* functions can't be called across the process boundary */
+    buffer_append_byte(b, v->type == TYPE_FUNCTION ? TYPE_VOID : v->type);
 
     switch(v->type) {
         case TYPE_VOID:
-            return;
+        case TYPE_FUNCTION:
+        break;
         case TYPE_FLOAT32:
-            write(fd, &v->f32, sizeof(v->f32));
-            return;
+            buffer_append(b, &v->f32, sizeof(v->f32));
+        break;
         case TYPE_INT32:
-            write(fd, &v->i32, sizeof(v->i32));
-            return;
+            buffer_append(b, &v->i32, sizeof(v->i32));
+        break;
         case TYPE_BOOLEAN:
-            write(fd, &v->b, sizeof(v->b));
-            return;
+            buffer_append(b, &v->b, sizeof(v->b));
+        break;
         case TYPE_STRING:
-            write_string(fd, v->str);
-            return;
+            buffer_append_string(b, v->str);
+        break;
         case TYPE_ARRAY:
-            write(fd, &v->length, sizeof(v->length));
-            int i;
+            buffer_append(b, &v->length, sizeof(v->length));
+        break;
+    }
+    return true;
+}
+
+static void encode_value(buffer_t*b, value_t*v)
+{
+    static const value_visitor_t encode_visitor = {encode_visit, NULL};
+    value_walk(v, &encode_visitor, b);
+}
+
+static void write_value(int fd, value_t*v)
+{
+    buffer_t b = {0};
+    encode_value(&b, v);
+    buffer_write(fd, &b);
+}
+
+/* Encode a value with a declared type. No type tags are written; the
+   receiver knows the layout from the signature. The value must have been
+   checked with value_matches_type() before. */
+static void encode_typed_value(buffer_t*b, value_t*v, char type)
+{
+    int i;
+    switch(type) {
+        case 'b': {
+            buffer_append_byte(b, v->b);
+        }
+        break;
+        case 'i': {
+            int32_t i32 = v->type == TYPE_FLOAT32 ? (int32_t)v->f32 : v->i32;
+            buffer_append(b, &i32, sizeof(i32));
+        }
+        break;
+        case 'f': {
+            float f32 = v->type == TYPE_INT32 ? (float)v->i32 : v->f32;
+            buffer_append(b, &f32, sizeof(f32));
+        }
+        break;
+        case 's': {
+            buffer_append_string(b, v->str);
+        }
+        break;
+        case '[': {
+            encode_value(b, v);
+        }
+        break;
+        case 'B':
+        case 'I':
+        case 'F':
+        case 'S': {
+            buffer_append(b, &v->length, sizeof(v->length));
             for(i=0;i<v->length;i++) {
-                write_value(fd, v->data[i]);
+                encode_typed_value(b, v->data[i], type - 'A' + 'a');
             }
-            return;
+        }
+        break;
     }
 }
 
+typedef struct _read_frame {
+    value_t*array;
+    int remaining;
+} read_frame_t;
+
 static value_t* _read_value(int fd, int*count, int max_string_size, int max_array_size, struct timeval* timeout)
-{ 
-    char b = 0;
-    if(!read_with_timeout(fd, &b, 1, timeout)) {
-        return NULL;
+{
+    /* arrays which are still being filled live on an explicit stack, so
+       deeply nested data doesn't exhaust the C stack */
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(read_frame_t));
+    value_t*v = NULL;
+
+    while(1) {
+        char b = 0;
+        if(!read_counted(fd, &b, 1, timeout)) {
+            goto error;
+        }
+        value_t dummy;
+
+        switch(b) {
+            case TYPE_VOID:
+                v = value_new_void();
+            break;
+            case TYPE_FLOAT32:
+                if(!read_counted(fd, &dummy.f32, sizeof(dummy.f32), timeout)) {
+                    goto error;
+                }
+                v = value_new_float32(dummy.f32);
+            break;
+            case TYPE_INT32:
+                if(!read_counted(fd, &dummy.i32, sizeof(dummy.i32), timeout)) {
+                    goto error;
+                }
+                v = value_new_int32(dummy.i32);
+            break;
+            case TYPE_BOOLEAN:
+                if(!read_counted(fd, &dummy.b, sizeof(dummy.b), timeout)) {
+                    goto error;
+                }
+                v = value_new_boolean(!!dummy.b);
+            break;
+            case TYPE_STRING: {
+                char*s = read_string(fd, max_string_size, timeout);
+                if(!s)
+                    goto error;
+                v = value_new_string(s);
+                free(s);
+            }
+            break;
+            case TYPE_ARRAY: {
+                if(!read_counted(fd, &dummy.length, sizeof(dummy.length), timeout)) {
+                    goto error;
+                }
+
+                /* protect against int overflows */
+                if(dummy.length < 0)
+                    goto error;
+                if(max_array_size && dummy.length >= max_array_size)
+                    goto error;
+                if(dummy.length >= INT_MAX - *count)
+                    goto error;
+
+                if(max_array_size && dummy.length + *count >= max_array_size)
+                    goto error;
+
+                *count += dummy.length;
+                if(dummy.length) {
+                    read_frame_t*frame = walk_stack_push(&stack);
+                    frame->array = array_new_sized(dummy.length);
+                    frame->remaining = dummy.length;
+                    continue;
+                }
+                v = array_new();
+            }
+            break;
+            default:
+                goto error;
+        }
+
+        /* store the value in its parent, and close all arrays that are full */
+        read_frame_t*frame;
+        while((frame = walk_stack_top(&stack))) {
+            array_append(frame->array, v);
+            v = NULL;
+            if(--frame->remaining)
+                break;
+            v = frame->array;
+            walk_stack_pop(&stack);
+        }
+        if(!frame) {
+            walk_stack_destroy(&stack);
+            return v;
+        }
     }
-    value_t dummy;
 
-    switch(b) {
-        case TYPE_VOID:
-            return value_new_void();
-        case TYPE_FLOAT32:
-            if(!read_with_timeout(fd, &dummy.f32, sizeof(dummy.f32), timeout)) {
+error:
+    if(v)
+        value_destroy(v);
+    read_frame_t*frame;
+    while((frame = walk_stack_top(&stack))) {
+        value_destroy(frame->array);
+        walk_stack_pop(&stack);
+    }
+    walk_stack_destroy(&stack);
+    return NULL;
+}
+
+static value_t* read_value(int fd, struct timeval* timeout)
+{
+    int count = 0;
+    return _read_value(fd, &count, MAX_STRING_SIZE, MAX_ARRAY_SIZE, timeout);
+}
+
+static value_t* read_value_nolimit(int fd)
+{
+    int count = 0;
+    return _read_value(fd, &count, 0, 0, NULL);
+}
+
+static value_t* _read_scalar(int fd, char type, int max_string_size, struct timeval* timeout)
+{
+    value_t dummy;
+    switch(type) {
+        case 'b': {
+            uint8_t b = 0;
+            if(!read_counted(fd, &b, 1, timeout))
                 return NULL;
-            }
-            return value_new_float32(dummy.f32);
-        case TYPE_INT32:
-            if(!read_with_timeout(fd, &dummy.i32, sizeof(dummy.i32), timeout)) {
+            return value_new_boolean(!!b);
+        }
+        case 'i':
+            if(!read_counted(fd, &dummy.i32, sizeof(dummy.i32), timeout))
                 return NULL;
-            }
             return value_new_int32(dummy.i32);
-        case TYPE_BOOLEAN:
-            if(!read_with_timeout(fd, &dummy.b, sizeof(dummy.b), timeout)) {
+        case 'f':
+            if(!read_counted(fd, &dummy.f32, sizeof(dummy.f32), timeout))
                 return NULL;
-            }
-            return value_new_boolean(!!dummy.b);
-        case TYPE_STRING: {
+            return value_new_float32(dummy.f32);
+        case 's': {
             char*s = read_string(fd, max_string_size, timeout);
             if(!s)
                 return NULL;
@@ -131,71 +549,423 @@ static value_t* _read_value(int fd, int*count, int max_string_size, int max_arra
             free(s);
             return v;
         }
-        case TYPE_ARRAY: {
-            if(!read_with_timeout(fd, &dummy.length, sizeof(dummy.length), timeout)) {
-                return NULL;
-            }
-
-            /* protect against int overflows */
-            if(max_array_size && dummy.length >= max_array_size)
-                return NULL;
-            if(dummy.length >= INT_MAX - *count)
-                return NULL;
+        default:
+            return NULL;
+    }
+}
 
-            if(max_array_size && dummy.length + *count >= max_array_size)
-                return NULL;
+static value_t* _read_typed_value(int fd, char type, int*count, int max_string_size, int max_array_size, struct timeval* timeout)
+{
+    if(type == '[') {
+        return _read_value(fd, count, max_string_size, max_array_size, timeout);
+    }
+    if(type != 'B' && type != 'I' && type != 'F' && type != 'S') {
+        return _read_scalar(fd, type, max_string_size, timeout);
+    }
 
-            value_t*array = array_new();
-            int i;
-            for(i=0;i<dummy.length;i++) {
-                value_t*entry = _read_value(fd, count, max_string_size, max_array_size, timeout);
-                if(entry == NULL) {
-                    value_destroy(array);
-                    return NULL;
-                }
-                array_append(array, entry);
+    int length = 0;
+    if(!read_counted(fd, &length, sizeof(length), timeout))
+        return NULL;
+    if(length < 0 || length >= INT_MAX - *count)
+        return NULL;
+    if(max_array_size && length + *count >= max_array_size)
+        return NULL;
+    *count += length;
+
+    value_t*array = array_new_sized(length);
+    int i;
+    if(type == 'I' || type == 'F') {
+        /* fixed size entries: read them in one go */
+        int32_t*raw = malloc(length * sizeof(int32_t) + 1);
+        if(!raw || !read_counted(fd, raw, length * sizeof(int32_t), timeout)) {
+            free(raw);
+            value_destroy(array);
+            return NULL;
+        }
+        for(i=0;i<length;i++) {
+            if(type == 'I') {
+                array_append(array, value_new_int32(raw[i]));
+            } else {
+                array_append(array, value_new_float32(((float*)raw)[i]));
             }
-            *count += dummy.length;
-            return array;
         }
-        default:
+        free(raw);
+        return array;
+    }
+    for(i=0;i<length;i++) {
+        value_t*entry = _read_scalar(fd, type - 'A' + 'a', max_string_size, timeout);
+        if(!entry) {
+            value_destroy(array);
             return NULL;
+        }
+        array_append(array, entry);
     }
+    return array;
 }
 
-static value_t* read_value(int fd, struct timeval* timeout)
+static value_t* read_typed_value(int fd, char type, struct timeval* timeout)
 {
     int count = 0;
-    return _read_value(fd, &count, MAX_STRING_SIZE, MAX_ARRAY_SIZE, timeout);
+    if(!type)
+        return value_new_void();
+    return _read_typed_value(fd, type, &count, MAX_STRING_SIZE, MAX_ARRAY_SIZE, timeout);
 }
 
-static value_t* read_value_nolimit(int fd)
+static value_t* read_typed_args_nolimit(int fd, const char*params)
 {
+    value_t*args = array_new();
     int count = 0;
-    return _read_value(fd, &count, 0, 0, NULL);
+    const char*p;
+    for(p=params; *p; p++) {
+        value_t*arg = _read_typed_value(fd, *p, &count, 0, 0, NULL);
+        if(!arg) {
+            value_destroy(args);
+            return NULL;
+        }
+        array_append(args, arg);
+    }
+    return args;
+}
+
+/* Reads the arguments of a function with a flat signature without
+   decoding them, for call_typed(). Like read_typed_args_nolimit(), this
+   trusts the parent. */
+static bool read_flat_args(int fd, const char*params, buffer_t*b)
+{
+    const char*p;
+    for(p=params; *p; p++) {
+        char type = *p;
+        int length = 1;
+        if(type >= 'A' && type <= 'Z') {
+            if(!read_counted(fd, &length, sizeof(length), NULL) || length < 0)
+                return false;
+            buffer_append(b, &length, sizeof(length));
+            type = type - 'A' + 'a';
+        }
+        if(type == 's') {
+            int i;
+            for(i=0;i<length;i++) {
+                int l = 0;
+                if(!read_counted(fd, &l, sizeof(l), NULL) || l < 0 || l > INT_MAX - b->len - 4)
+                    return false;
+                buffer_append(b, &l, sizeof(l));
+                if(!read_counted(fd, buffer_extend(b, l), l, NULL))
+                    return false;
+            }
+        } else {
+            /* booleans are one byte, ints and floats four */
+            int size = type == 'b' ? 1 : 4;
+            if(length > (INT_MAX - b->len) / size)
+                return false;
+            if(!read_counted(fd, buffer_extend(b, length * size), length * size, NULL))
+                return false;
+        }
+    }
+    return true;
+}
+
+static signature_t* signature_new(const char*params, const char*ret)
+{
+    signature_t*sig = calloc(sizeof(signature_t), 1);
+    sig->params = strdup(params);
+    sig->ret = strdup(ret);
+    return sig;
+}
+
+static void signature_destroy(void*data)
+{
+    signature_t*sig = (signature_t*)data;
+    free(sig->params);
+    free(sig->ret);
+    free(sig);
+}
+
+static void clear_signatures(proxy_internal_t*proxy)
+{
+    dict_free_all(proxy->signatures, 1, signature_destroy);
+    free(proxy->signatures);
+    proxy->signatures = dict_new(&charptr_type);
+}
+
+
+static void set_timeout_proxy(language_t*li, int max_ms)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    proxy->call_timeout_ms = max_ms;
+}
+
+/* time limit for compile_script() and call_function() */
+static struct timeval operation_timeout(proxy_internal_t*proxy)
+{
+    struct timeval timeout;
+    if(proxy->call_timeout_ms > 0) {
+        timeout.tv_sec = proxy->call_timeout_ms / 1000;
+        timeout.tv_usec = (proxy->call_timeout_ms % 1000) * 1000;
+    } else {
+        timeout.tv_sec = proxy->timeout;
+        timeout.tv_usec = 0;
+    }
+    return timeout;
+}
+
+static bool respawn_child(language_t*li);
+
+static bool check_alive(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    if(proxy->dead && proxy->respawn) {
+        respawn_child(li);
+    }
+    if(proxy->dead) {
+        language_error(li, "Sandbox process is gone (it crashed, or was killed after a timeout)");
+        return false;
+    }
+    return true;
 }
 
+/* Start accounting for a compile or call, and pass the (possibly changed)
+   operation budget on to the child */
+static void begin_operation(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    li->ops = 0;
+    memset(&proxy->stats, 0, sizeof(proxy->stats));
+    free(proxy->backtrace);
+    proxy->backtrace = NULL;
+    proxy->in_operation = true;
+    proxy->bytes_written_base = bytes_written;
+    proxy->bytes_read_base = bytes_read;
+
+    if(li->ops_budget != proxy->ops_budget) {
+        write_byte(proxy->fd_w, SET_OPS_BUDGET);
+        write_counted(proxy->fd_w, &li->ops_budget, sizeof(li->ops_budget));
+        proxy->ops_budget = li->ops_budget;
+    }
+    if(li->profile_interval != proxy->profile_interval) {
+        write_byte(proxy->fd_w, SET_PROFILE_INTERVAL);
+        write_counted(proxy->fd_w, &li->profile_interval, sizeof(li->profile_interval));
+        proxy->profile_interval = li->profile_interval;
+    }
+    if(li->gc_policy != proxy->gc_policy) {
+        write_byte(proxy->fd_w, SET_GC_POLICY);
+        write_byte(proxy->fd_w, li->gc_policy);
+        proxy->gc_policy = li->gc_policy;
+    }
+}
+
+static void end_operation(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    if(!proxy->in_operation)
+        return;
+    proxy->in_operation = false;
+    proxy->stats.bytes_sent = bytes_written - proxy->bytes_written_base;
+    proxy->stats.bytes_received = bytes_read - proxy->bytes_read_base;
+}
+
+static bool read_stats(language_t*li, struct timeval* timeout)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    child_stats_t child;
+    if(!read_counted(proxy->fd_r, &child, sizeof(child), timeout))
+        return false;
+    li->ops = child.ops;
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        li->timeout = true;
+    }
+    proxy->stats.cpu_user = child.utime_usec / 1000000.0;
+    proxy->stats.cpu_sys = child.stime_usec / 1000000.0;
+    proxy->stats.max_rss = child.max_rss;
+    proxy->stats.allocations = child.allocations;
+    proxy->stats.allocated_bytes = child.allocated_bytes;
+    proxy->stats.peak_heap = child.peak_heap;
+    proxy->stats.gc_collections = child.gc_collections;
+    proxy->stats.gc_time = child.gc_time_usec / 1000000.0;
+    proxy->stats.idle_gc_time = child.idle_gc_usec / 1000000.0;
+    if(child.idle_gc_usec) {
+        stats_record(proxy->old->name, HISTOGRAM_GC, child.idle_gc_usec * 1000);
+    }
+    return true;
+}
+
+static bool get_stats_proxy(language_t*li, call_stats_t*stats)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    *stats = proxy->stats;
+    return true;
+}
+
+/* RESP_ERROR is followed by the kind of failure, the last message the
+   guest logged, and the guest's stack at the time */
+static bool read_error(language_t*li, struct timeval* timeout)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    char kind = 0;
+    if(!read_counted(proxy->fd_r, &kind, 1, timeout))
+        return false;
+    char*message = read_string(proxy->fd_r, MAX_STRING_SIZE, timeout);
+    if(!message)
+        return false;
+    char*backtrace = read_string(proxy->fd_r, MAX_BACKTRACE_SIZE, timeout);
+    if(!backtrace) {
+        free(message);
+        return false;
+    }
+
+    free(proxy->backtrace);
+    proxy->backtrace = NULL;
+    if(backtrace[0]) {
+        proxy->backtrace = backtrace;
+    } else {
+        free(backtrace);
+    }
+
+    if(kind == ERROR_TIMEOUT) {
+        li->timeout = true;
+    } else if(kind == ERROR_CRASH) {
+        language_error(li, "Sandbox process crashed (%s)", message);
+        proxy->dead = true;
+        proxy->in_call = false;
+    }
+    free(message);
+    return true;
+}
+
+static char* get_backtrace_proxy(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    return proxy->backtrace ? strdup(proxy->backtrace) : NULL;
+}
+
+static char* get_profile_proxy(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!check_alive(li)) {
+        return NULL;
+    }
+    log_dbg("[proxy] get_profile()");
+    write_byte(proxy->fd_w, GET_PROFILE);
+
+    struct timeval timeout;
+    timeout.tv_sec = proxy->timeout;
+    timeout.tv_usec = 0;
+    return read_string(proxy->fd_r, MAX_PROFILE_SIZE, &timeout);
+}
+
+
+static void kill_child(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    stats_count(proxy->old->name, COUNTER_KILLS);
+    journal_record(JOURNAL_KILL, proxy->old->name, proxy->child_pid, JOURNAL_OK, 0, 0, 0, li->ops);
+    log_dbg("[proxy] killing sandbox process %d", proxy->child_pid);
+    kill(proxy->child_pid, SIGKILL);
+    proxy->dead = true;
+    proxy->respawn = true;
+    proxy->in_call = false;
+}
+
+/* The guest didn't finish in time. Ask the child to abort the current
+   operation, and give it a moment to confirm. Whatever else the child
+   sends in the meantime is discarded; in particular, callbacks are no
+   longer passed to the host. If the child doesn't confirm (e.g. because
+   it's running luajit machine code, which doesn't check for interrupts),
+   it's killed, and replaced with a new one on the next operation. */
+static void interrupt_child(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    li->timeout = true;
+    log_dbg("[proxy] interrupting sandbox process %d", proxy->child_pid);
+    uint64_t start = stats_now();
+    kill(proxy->child_pid, SIGUSR1);
+
+    struct timeval timeout;
+    timeout.tv_sec = config_interrupt_grace_ms / 1000;
+    timeout.tv_usec = (config_interrupt_grace_ms % 1000) * 1000;
+
+    while(1) {
+        char resp = 0;
+        if(!read_counted(proxy->fd_r, &resp, 1, &timeout)) {
+            break;
+        }
+        if(resp == RESP_ERROR) {
+            /* either the confirmation, or the operation failed on its
+               own. Either way, the child is idle again. */
+            if(!read_error(li, &timeout))
+                break;
+            log_dbg("[proxy] sandbox process %d interrupted", proxy->child_pid);
+            journal_record(JOURNAL_INTERRUPT, proxy->old->name, proxy->child_pid, JOURNAL_OK,
+                           stats_now() - start, 0, 0, li->ops);
+            proxy->in_call = false;
+            return;
+        } else if(resp == RESP_LOG) {
+            char*message = read_string(proxy->fd_r, MAX_STRING_SIZE, &timeout);
+            if(!message)
+                break;
+            language_log(li, message);
+            free(message);
+        } else if(resp == RESP_STATS) {
+            if(!read_stats(li, &timeout))
+                break;
+        } else if(resp == RESP_BYTECODE) {
+            int len = 0;
+            void*data = read_blob(proxy->fd_r, MAX_BYTECODE_SIZE, &len, &timeout);
+            if(!data)
+                break;
+            free(data);
+        } else if(resp == RESP_CALLBACK) {
+            char*name = read_string(proxy->fd_r, MAX_STRING_SIZE, &timeout);
+            value_t*args = name ? read_value(proxy->fd_r, &timeout) : NULL;
+            free(name);
+            if(!args)
+                break;
+            value_destroy(args);
+            value_t*ret = value_new_void();
+            write_value(proxy->fd_w, ret);
+            value_destroy(ret);
+        } else {
+            /* the operation completed after all. We don't know how much
+               payload follows, so we can't resynchronize. */
+            break;
+        }
+    }
+    journal_record(JOURNAL_INTERRUPT, proxy->old->name, proxy->child_pid, JOURNAL_FAILED,
+                   stats_now() - start, 0, 0, li->ops);
+    kill_child(li);
+}
 
 static void define_constant_proxy(language_t*li, const char*name, value_t*value)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
+    if(!check_alive(li)) {
+        return;
+    }
     log_dbg("[proxy] define_constant(%s)", name);
-    write_byte(proxy->fd_w, DEFINE_CONSTANT);
-    write_string(proxy->fd_w, name);
-    write_value(proxy->fd_w, value);
+    buffer_t b = {0};
+    buffer_append_byte(&b, DEFINE_CONSTANT);
+    buffer_append_string(&b, name);
+    encode_value(&b, value);
+    send_setup(proxy, &b);
 }
 
 static void define_function_proxy(language_t*li, const char*name, function_t*f)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
+    if(!check_alive(li)) {
+        return;
+    }
     log_dbg("[proxy] define_function(%s)", name);
     
     /* let the child know that we're accepting callbacks for this function name */
-    write_byte(proxy->fd_w, DEFINE_FUNCTION);
-    write_string(proxy->fd_w, name);
-    write_byte(proxy->fd_w, f->num_params);
+    buffer_t b = {0};
+    buffer_append_byte(&b, DEFINE_FUNCTION);
+    buffer_append_string(&b, name);
+    buffer_append_byte(&b, f->num_params);
+    send_setup(proxy, &b);
 
     if(dict_contains(proxy->callback_functions, name)) {
         language_error(li, "function %s already defined", name);
@@ -205,18 +975,99 @@ static void define_function_proxy(language_t*li, const char*name, function_t*f)
     dict_put(proxy->callback_functions, name, f);
 }
 
+static void declare_function_proxy(language_t*li, const char*name, const char*params, const char*ret)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!check_alive(li)) {
+        return;
+    }
+    log_dbg("[proxy] declare_function(%s): (%s):%s", name, params, ret);
+
+    if(dict_contains(proxy->signatures, name)) {
+        language_error(li, "signature of %s already declared", name);
+        return;
+    }
+    dict_put(proxy->signatures, name, signature_new(params, ret));
+
+    buffer_t b = {0};
+    buffer_append_byte(&b, DECLARE_FUNCTION);
+    buffer_append_string(&b, name);
+    buffer_append_string(&b, params);
+    buffer_append_string(&b, ret);
+    send_setup(proxy, &b);
+}
+
+static bool reset_proxy(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!check_alive(li)) {
+        return false;
+    }
+    log_dbg("[proxy] reset");
+    write_byte(proxy->fd_w, RESET);
+
+    dict_destroy(proxy->callback_functions);
+    proxy->callback_functions = dict_new(&charptr_type);
+    clear_signatures(proxy);
+    clear_setup(proxy);
+
+    struct timeval timeout;
+    timeout.tv_sec = proxy->timeout;
+    timeout.tv_usec = 0;
+
+    bool ret = false;
+    if(!read_counted(proxy->fd_r, &ret, 1, &timeout)) {
+        language_error(li, "Sandbox didn't respond to reset");
+        kill_child(li);
+        return false;
+    }
+    return !!ret;
+}
+
+static bool collect_garbage_proxy(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    if(!check_alive(li)) {
+        return false;
+    }
+    log_dbg("[proxy] collect garbage");
+    write_byte(proxy->fd_w, COLLECT_GARBAGE);
+
+    struct timeval timeout;
+    timeout.tv_sec = proxy->timeout;
+    timeout.tv_usec = 0;
+
+    bool ret = false;
+    uint64_t duration = 0;
+    if(!read_counted(proxy->fd_r, &ret, 1, &timeout) ||
+       !read_counted(proxy->fd_r, &duration, sizeof(duration), &timeout)) {
+        language_error(li, "Timeout while collecting garbage");
+        kill_child(li);
+        return false;
+    }
+    if(ret) {
+        stats_record(proxy->old->name, HISTOGRAM_GC, duration);
+    }
+    return !!ret;
+}
+
 static bool process_callbacks(language_t*li, struct timeval* timeout)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
     while(1) {
         char resp = 0;
-        if(!read_with_timeout(proxy->fd_r, &resp, 1, timeout)) {
+        if(!read_counted(proxy->fd_r, &resp, 1, timeout)) {
             return false;
         }
 
+        PROBE3(response, proxy->child_pid, proxy->old->name, resp);
         switch(resp) {
             case RESP_CALLBACK: {
+                uint64_t callback_start = stats_now();
                 char*name = read_string(proxy->fd_r, MAX_STRING_SIZE, timeout);
                 if(!name) {
                     return false;
@@ -233,13 +1084,22 @@ static bool process_callbacks(language_t*li, struct timeval* timeout)
                     free(name);
                     return false;
                 }
+                uint64_t start = stats_now();
+                PROBE2(callback__start, proxy->child_pid, name);
                 value_t*ret = function->call(function, args);
+                PROBE3(callback__done, proxy->child_pid, name, ret != NULL);
+                uint64_t duration = stats_now() - start;
+                proxy->stats.callbacks++;
+                proxy->stats.callback_time += duration / 1e9;
+                journal_record(JOURNAL_CALLBACK, proxy->old->name, proxy->child_pid,
+                               ret ? JOURNAL_OK : JOURNAL_FAILED, duration, 0, 0, 0);
                 if(!ret) {
                     value_destroy(args);
                     free(name);
                     return false;
                 }
                 write_value(proxy->fd_w, ret);
+                stats_record(proxy->old->name, HISTOGRAM_CALLBACK, stats_now() - callback_start);
                 value_destroy(ret);
                 value_destroy(args);
                 free(name);
@@ -247,10 +1107,32 @@ static bool process_callbacks(language_t*li, struct timeval* timeout)
             break;
             case RESP_LOG: {
                 char*message = read_string(proxy->fd_r, MAX_STRING_SIZE, timeout);
+                journal_record(JOURNAL_LOG, proxy->old->name, proxy->child_pid, JOURNAL_OK,
+                               0, 0, message ? strlen(message) : 0, 0);
                 language_log(li, message);                
             }
             break;
+            case RESP_STATS: {
+                if(!read_stats(li, timeout)) {
+                    return false;
+                }
+            }
+            break;
+            case RESP_BYTECODE: {
+                int len = 0;
+                void*data = read_blob(proxy->fd_r, MAX_BYTECODE_SIZE, &len, timeout);
+                if(!data) {
+                    return false;
+                }
+                if(proxy->caching_script) {
+                    log_dbg("[proxy] caching %d bytes of bytecode", len);
+                    compile_cache_store(compile_cache_global(), proxy->old->name, proxy->version, proxy->caching_script, data, len);
+                }
+                free(data);
+            }
+            break;
             case RESP_ERROR:
+            read_error(li, timeout);
             return false;
             case RESP_RETURN:
             return true;
@@ -258,51 +1140,110 @@ static bool process_callbacks(language_t*li, struct timeval* timeout)
     }
 }
 
-static bool compile_script_proxy(language_t*li, const char*script)
+static bool do_compile_script(language_t*li, const char*script)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
-    log_dbg("[proxy] compile_script()");
-    write_byte(proxy->fd_w, COMPILE_SCRIPT);
-    write_string(proxy->fd_w, script);
-
-    struct timeval timeout;
-    timeout.tv_sec = proxy->timeout;
-    timeout.tv_usec = 0;
-
+    if(!check_alive(li)) {
+        return false;
+    }
     if(proxy->in_call) {
         language_error(li, "You called (or compiled) the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
-        return NULL;
+        return false;
+    }
+
+    begin_operation(li);
+
+    void*bytecode = NULL;
+    int bytecode_len = 0;
+    if(!config_compile_cache) {
+        log_dbg("[proxy] compile_script()");
+        write_byte(proxy->fd_w, COMPILE_SCRIPT);
+        write_string(proxy->fd_w, script);
+    } else if(compile_cache_lookup(compile_cache_global(), proxy->old->name, proxy->version, script, &bytecode, &bytecode_len)) {
+        log_dbg("[proxy] compile_script(): using %d bytes of cached bytecode", bytecode_len);
+        write_byte(proxy->fd_w, LOAD_BYTECODE);
+        write_blob(proxy->fd_w, bytecode, bytecode_len);
+        free(bytecode);
+    } else {
+        log_dbg("[proxy] compile_script(): not cached");
+        write_byte(proxy->fd_w, COMPILE_TO_BYTECODE);
+        write_string(proxy->fd_w, script);
+        if(!proxy->tainted) {
+            proxy->caching_script = script;
+        }
     }
+    proxy->tainted = true;
+
+    struct timeval timeout = operation_timeout(proxy);
 
     bool ret = false;
 
     proxy->in_call = true;
     ret = process_callbacks(li, &timeout);
+    proxy->caching_script = NULL;
     if(!ret) {
         if(!timeout.tv_sec && !timeout.tv_usec) {
-            li->timeout = true;
             language_error(li, "Timeout while compiling\n");
+            interrupt_child(li);
         }
+        proxy->in_call = false;
         return false;
     }
     proxy->in_call = false;
 
-    if(!read_with_timeout(proxy->fd_r, &ret, 1, &timeout)) {
+    if(!read_counted(proxy->fd_r, &ret, 1, &timeout)) {
         if(!timeout.tv_sec && !timeout.tv_usec) {
             // TODO: verify that select does indeed set these values to 0 on timeout
             li->timeout = true;
             language_error(li, "Timeout while compiling.\n");
+            kill_child(li);
         }
         return false;
     }
     return !!ret;
 }
 
+static void record_result(language_t*li, journal_type_t type, bool ok, uint64_t duration)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    journal_status_t status = JOURNAL_OK;
+    if(li->timeout) {
+        stats_count(proxy->old->name, COUNTER_TIMEOUTS);
+        status = JOURNAL_TIMEOUT;
+    } else if(!ok) {
+        stats_count(proxy->old->name, COUNTER_ERRORS);
+        status = JOURNAL_FAILED;
+    }
+    journal_record(type, proxy->old->name, proxy->child_pid, status, duration,
+                   proxy->stats.bytes_sent, proxy->stats.bytes_received, li->ops);
+}
+
+static bool compile_script_proxy(language_t*li, const char*script)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    uint64_t start = stats_now();
+    li->timeout = false;
+    PROBE3(compile__start, proxy->child_pid, proxy->old->name, strlen(script));
+    bool ret = do_compile_script(li, script);
+    if(ret) {
+        add_setup_step(proxy)->script = strdup(script);
+    }
+    end_operation(li);
+    PROBE4(compile__done, proxy->child_pid, ret, proxy->stats.bytes_sent, proxy->stats.bytes_received);
+    uint64_t duration = stats_now() - start;
+    stats_record(proxy->old->name, HISTOGRAM_COMPILE, duration);
+    record_result(li, JOURNAL_COMPILE, ret, duration);
+    return ret;
+}
+
 static bool is_function_proxy(language_t*li, const char*name)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
+    if(!check_alive(li)) {
+        return false;
+    }
     log_dbg("[proxy] is_function(%s)", name);
     write_byte(proxy->fd_w, IS_FUNCTION);
     write_string(proxy->fd_w, name);
@@ -312,54 +1253,119 @@ static bool is_function_proxy(language_t*li, const char*name)
     timeout.tv_usec = 0;
 
     bool ret = false;
-    if(!read_with_timeout(proxy->fd_r, &ret, 1, &timeout)) {
+    if(!read_counted(proxy->fd_r, &ret, 1, &timeout)) {
         return false;
     }
     return !!ret;
 }
 
-static value_t* call_function_proxy(language_t*li, const char*name, value_t*args)
+static bool check_typed_args(language_t*li, const char*name, signature_t*sig, value_t*args)
 {
-    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
-
-    log_dbg("[proxy] call_function(%s)", name);
-    write_byte(proxy->fd_w, CALL_FUNCTION);
-    write_string(proxy->fd_w, name);
-    write_value(proxy->fd_w, args);
+    int num_params = strlen(sig->params);
+    if(args->length != num_params) {
+        language_error(li, "%s: wrong number of arguments: expected %d, got %d\n", name, num_params, args->length);
+        return false;
+    }
+    int i;
+    for(i=0;i<num_params;i++) {
+        if(!value_matches_type(args->data[i], sig->params[i])) {
+            language_error(li, "%s: parameter %d should be %s, not %s\n", name, i+1,
+                    type_code_to_string(sig->params[i]),
+                    type_to_string(args->data[i]->type));
+            return false;
+        }
+    }
+    return true;
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = proxy->timeout;
-    timeout.tv_usec = 0;
+static value_t* do_call_function(language_t*li, const char*name, value_t*args)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
+    if(!check_alive(li)) {
+        return NULL;
+    }
     if(proxy->in_call) {
         language_error(li, "You called the guest program, and the guest program called back. You can't invoke the guest again from your callback function.");
         return NULL;
     }
 
+    signature_t*sig = dict_lookup(proxy->signatures, name);
+    if(sig && !check_typed_args(li, name, sig, args)) {
+        return NULL;
+    }
+
+    begin_operation(li);
+
+    log_dbg("[proxy] call_function(%s)", name);
+    uint64_t encode_start = stats_now();
+    buffer_t b = {0};
+    if(sig) {
+        buffer_append_byte(&b, CALL_TYPED);
+        buffer_append_string(&b, name);
+        int i;
+        for(i=0;i<args->length;i++) {
+            encode_typed_value(&b, args->data[i], sig->params[i]);
+        }
+    } else {
+        buffer_append_byte(&b, CALL_FUNCTION);
+        buffer_append_string(&b, name);
+        encode_value(&b, args);
+    }
+    uint64_t serialize_time = stats_now() - encode_start;
+    buffer_write(proxy->fd_w, &b);
+
+    struct timeval timeout = operation_timeout(proxy);
+
     bool ret;
 
     proxy->in_call = true;
     ret = process_callbacks(li, &timeout);
     if(!ret) {
         if(!timeout.tv_sec && !timeout.tv_usec) {
-            li->timeout = true;
             language_error(li, "Timeout while calling function %s\n", name);
+            interrupt_child(li);
         }
+        proxy->in_call = false;
         return NULL;
     }
     proxy->in_call = false;
 
-    value_t*value = read_value(proxy->fd_r, &timeout);
+    value_t*value;
+    uint64_t decode_start = stats_now();
+    if(sig) {
+        value = read_typed_value(proxy->fd_r, sig->ret[0], &timeout);
+    } else {
+        value = read_value(proxy->fd_r, &timeout);
+    }
+    serialize_time += stats_now() - decode_start;
+    stats_record(proxy->old->name, HISTOGRAM_SERIALIZE, serialize_time);
     if(!value) {
         if(!timeout.tv_sec && !timeout.tv_usec) {
             li->timeout = true;
             language_error(li, "Timeout while calling function %s.\n", name);
+            kill_child(li);
         }
         return NULL;
     }
     return value;
 }
 
+static value_t* call_function_proxy(language_t*li, const char*name, value_t*args)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    uint64_t start = stats_now();
+    li->timeout = false;
+    PROBE3(call__start, proxy->child_pid, proxy->old->name, name);
+    value_t*ret = do_call_function(li, name, args);
+    end_operation(li);
+    PROBE5(call__done, proxy->child_pid, name, ret != NULL, proxy->stats.bytes_sent, proxy->stats.bytes_received);
+    uint64_t duration = stats_now() - start;
+    stats_record(proxy->old->name, HISTOGRAM_CALL, duration);
+    record_result(li, JOURNAL_CALL, ret != NULL, duration);
+    return ret;
+}
+
 typedef struct _proxy_function {
     language_t*li;
     char*name;
@@ -386,6 +1392,170 @@ static value_t* proxy_function_call(value_t*v, value_t*args)
     return read_value_nolimit(proxy->fd_r);
 }
 
+static language_t*interrupt_target = NULL;
+static volatile sig_atomic_t interrupted = 0;
+
+/* the last message the guest logged during the current operation */
+static char last_error[MAX_STRING_SIZE];
+static int error_fd = -1;
+
+/* runs in the child, when the parent gave up waiting on the current operation */
+static void sandbox_interrupt(int signal)
+{
+    interrupted = 1;
+    if(interrupt_target && interrupt_target->interrupt) {
+        interrupt_target->interrupt(interrupt_target);
+    }
+}
+
+/* the backtrace of the operation's last error, kept for sandbox_crash(),
+   which can't ask the interpreter for one */
+static char crash_backtrace[MAX_STRING_SIZE];
+
+static void write_error(language_t*old, int w, char kind)
+{
+    if(kind == ERROR_EXCEPTION && old->timeout) {
+        kind = ERROR_TIMEOUT; // operation budget exceeded
+    }
+    char*backtrace = old->get_backtrace ? old->get_backtrace(old) : NULL;
+    snprintf(crash_backtrace, sizeof(crash_backtrace), "%s", backtrace ? backtrace : "");
+    write_byte(w, RESP_ERROR);
+    write_byte(w, kind);
+    write_string(w, last_error);
+    write_string(w, backtrace ? backtrace : "");
+    free(backtrace);
+}
+
+static int append_counted(char*p, const char*data, int len)
+{
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), data, len);
+    return sizeof(len) + len;
+}
+
+/* runs in the child on a fatal signal, which then exits. This is a
+   signal handler, so it can't allocate or format: the RESP_ERROR is
+   assembled by hand and sent with a single write(). */
+static void sandbox_crash(int signal)
+{
+    static char packet[2 + 2 * sizeof(int) + 16 + MAX_STRING_SIZE];
+    char message[16] = "signal ";
+    int len = strlen(message);
+    char digits[4];
+    int n = 0;
+    do {
+        digits[n++] = '0' + signal % 10;
+        signal /= 10;
+    } while(signal && n < sizeof(digits));
+    while(n)
+        message[len++] = digits[--n];
+
+    int pos = 0;
+    packet[pos++] = RESP_ERROR;
+    packet[pos++] = ERROR_CRASH;
+    pos += append_counted(packet + pos, message, len);
+    pos += append_counted(packet + pos, crash_backtrace, strlen(crash_backtrace));
+    write_counted(error_fd, packet, pos);
+}
+
+static struct rusage usage_before;
+
+/* with GC_BETWEEN_CALLS: set once a result is sent, so that we collect
+   garbage before waiting for the next command. The time this took is
+   reported along with the next operation. */
+static bool collect_pending = false;
+static int64_t idle_gc_usec = 0;
+
+static void begin_child_operation(language_t*old)
+{
+    interrupted = 0;
+    old->timeout = false;
+    last_error[0] = 0;
+    crash_backtrace[0] = 0;
+    getrusage(RUSAGE_SELF, &usage_before);
+}
+
+static int64_t usec_diff(struct timeval*after, struct timeval*before)
+{
+    return (after->tv_sec - before->tv_sec) * 1000000ll + (after->tv_usec - before->tv_usec);
+}
+
+/* Report the cost of a compile or call to the parent. Also, if the
+   operation was interrupted, tell the parent so (instead of sending the
+   result, which the parent is no longer waiting for) */
+static bool finish_operation(language_t*old, int w)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    child_stats_t stats;
+    stats.ops = old->ops;
+    stats.utime_usec = usec_diff(&usage.ru_utime, &usage_before.ru_utime);
+    stats.stime_usec = usec_diff(&usage.ru_stime, &usage_before.ru_stime);
+    stats.max_rss = usage.ru_maxrss;
+
+    call_stats_t guest;
+    memset(&guest, 0, sizeof(guest));
+    if(old->get_stats) {
+        old->get_stats(old, &guest);
+    }
+    stats.allocations = guest.allocations;
+    stats.allocated_bytes = guest.allocated_bytes;
+    stats.peak_heap = guest.peak_heap;
+    stats.gc_collections = guest.gc_collections;
+    stats.gc_time_usec = guest.gc_time * 1000000;
+    stats.idle_gc_usec = idle_gc_usec;
+    idle_gc_usec = 0;
+    write_byte(w, RESP_STATS);
+    write_counted(w, &stats, sizeof(stats));
+    collect_pending = old->gc_policy == GC_BETWEEN_CALLS && old->collect_garbage;
+
+    if(!interrupted)
+        return false;
+    interrupted = 0;
+    write_error(old, w, ERROR_TIMEOUT);
+    return true;
+}
+
+/* a declared call that converts straight between the pipe's encoding and
+   the guest's objects */
+static void call_typed_child(language_t*old, int r, int w, const char*name, signature_t*sig)
+{
+    buffer_t args = {0};
+    if(!read_flat_args(r, sig->params, &args)) {
+        _exit(1);
+    }
+    typed_reader_t reader = {args.data, args.len, 0};
+    typed_writer_t ret = {0};
+    uint8_t resp = RESP_RETURN;
+    typed_write(&ret, &resp, 1);
+
+    begin_child_operation(old);
+    bool ok = old->call_typed(old, name, sig->params, sig->ret, &reader, &ret);
+    if(finish_operation(old, w)) {
+        /* the parent stopped waiting for the result */
+    } else if(ok) {
+        write_counted(w, ret.data, ret.len);
+    } else {
+        write_error(old, w, ERROR_EXCEPTION);
+    }
+    free(ret.data);
+    free(args.data);
+}
+
+static void finish_compile(language_t*old, int w, bool ret)
+{
+    if(finish_operation(old, w)) {
+        return;
+    }
+    if(ret) {
+        write_byte(w, RESP_RETURN);
+        write_byte(w, ret);
+    } else {
+        write_error(old, w, ERROR_EXCEPTION);
+    }
+}
+
 static void child_loop(language_t*li)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
@@ -395,6 +1565,13 @@ static void child_loop(language_t*li)
     int w = proxy->fd_w;
 
     while(1) {
+        if(collect_pending) {
+            uint64_t start = stats_now();
+            old->collect_garbage(old);
+            idle_gc_usec += (stats_now() - start) / 1000;
+            collect_pending = false;
+        }
+
         char command;
         if(!read_with_retry(r, &command, 1)) {
             log_dbg("[sandbox] Couldn't read command- parent terminated?");
@@ -402,6 +1579,7 @@ static void child_loop(language_t*li)
         }
 
         log_dbg("[sandbox] command=%d", command);
+        PROBE2(sandbox__command, old->name, command);
         switch(command) {
             case DEFINE_CONSTANT: {
                 char*s = read_string(r, 0, NULL);
@@ -434,12 +1612,50 @@ static void child_loop(language_t*li)
             case COMPILE_SCRIPT: {
                 char*script = read_string(r, 0, NULL);
                 log_dbg("[sandbox] compile script");
+                begin_child_operation(old);
                 bool ret = old->compile_script(old, script);
-                write_byte(w, RESP_RETURN);
-                write_byte(w, ret);
+                finish_compile(old, w, ret);
+                free(script);
+            }
+            break;
+            case COMPILE_TO_BYTECODE: {
+                char*script = read_string(r, 0, NULL);
+                log_dbg("[sandbox] compile script to bytecode");
+                begin_child_operation(old);
+                bool ret = false;
+                if(old->compile_to_bytecode && old->load_bytecode) {
+                    void*data = NULL;
+                    int len = 0;
+                    if(old->compile_to_bytecode(old, script, &data, &len)) {
+                        write_byte(w, RESP_BYTECODE);
+                        write_blob(w, data, len);
+                        ret = old->load_bytecode(old, data, len);
+                        free(data);
+                    }
+                } else {
+                    ret = old->compile_script(old, script);
+                }
+                finish_compile(old, w, ret);
                 free(script);
             }
             break;
+            case LOAD_BYTECODE: {
+                int len = 0;
+                void*data = read_blob(r, 0, &len, NULL);
+                log_dbg("[sandbox] load %d bytes of bytecode", len);
+                begin_child_operation(old);
+                bool ret = data && old->load_bytecode && old->load_bytecode(old, data, len);
+                finish_compile(old, w, ret);
+                free(data);
+            }
+            break;
+            case RESET: {
+                log_dbg("[sandbox] reset");
+                bool ret = old->reset && old->reset(old);
+                clear_signatures(proxy);
+                write_byte(w, ret);
+            }
+            break;
             case IS_FUNCTION: {
                 char*function_name = read_string(r, 0, NULL);
                 log_dbg("[sandbox] is_function(%s)", function_name);
@@ -452,15 +1668,107 @@ static void child_loop(language_t*li)
                 char*function_name = read_string(r, 0, NULL);
                 log_dbg("[sandbox] call_function(%s)", function_name, old->name);
                 value_t*args = read_value_nolimit(r);
+                begin_child_operation(old);
                 value_t*ret = old->call_function(old, function_name, args);
-                if(ret) {
+                if(finish_operation(old, w)) {
+                    if(ret)
+                        value_destroy(ret);
+                } else if(ret) {
                     log_dbg("[sandbox] returning function value (type:%s)", type_to_string(ret->type));
                     write_byte(w, RESP_RETURN);
                     write_value(w, ret);
                     value_destroy(ret);
                 } else {
                     log_dbg("[sandbox] error calling function %s", function_name);
-                    write_byte(w, RESP_ERROR);
+                    write_error(old, w, ERROR_EXCEPTION);
+                }
+                free(function_name);
+                value_destroy(args);
+            }
+            break;
+            case SET_OPS_BUDGET: {
+                read_with_retry(r, &old->ops_budget, sizeof(old->ops_budget));
+                log_dbg("[sandbox] set operation budget to %llu", (unsigned long long)old->ops_budget);
+            }
+            break;
+            case SET_PROFILE_INTERVAL: {
+                read_with_retry(r, &old->profile_interval, sizeof(old->profile_interval));
+                log_dbg("[sandbox] set profile interval to %llu", (unsigned long long)old->profile_interval);
+            }
+            break;
+            case SET_GC_POLICY: {
+                uint8_t policy = 0;
+                read_with_retry(r, &policy, 1);
+                old->gc_policy = policy;
+                log_dbg("[sandbox] set gc policy to %d", policy);
+            }
+            break;
+            case COLLECT_GARBAGE: {
+                log_dbg("[sandbox] collect garbage");
+                uint64_t start = stats_now();
+                bool ret = old->collect_garbage && old->collect_garbage(old);
+                uint64_t duration = stats_now() - start;
+                write_byte(w, ret);
+                write_counted(w, &duration, sizeof(duration));
+            }
+            break;
+            case GET_PROFILE: {
+                log_dbg("[sandbox] get_profile()");
+                char*profile = old->get_profile ? old->get_profile(old) : NULL;
+                write_string(w, profile ? profile : "");
+                free(profile);
+            }
+            break;
+            case DECLARE_FUNCTION: {
+                char*name = read_string(r, 0, NULL);
+                char*params = read_string(r, 0, NULL);
+                char*ret = read_string(r, 0, NULL);
+                log_dbg("[sandbox] declare function(%s): (%s):%s", name, params, ret);
+                dict_put(proxy->signatures, name, signature_new(params, ret));
+                free(name);
+                free(params);
+                free(ret);
+            }
+            break;
+            case CALL_TYPED: {
+                char*function_name = read_string(r, 0, NULL);
+                signature_t*sig = dict_lookup(proxy->signatures, function_name);
+                if(!sig) {
+                    log_dbg("[sandbox] no signature for %s", function_name);
+                    _exit(1);
+                }
+                log_dbg("[sandbox] call_typed(%s)", function_name);
+                if(old->call_typed && signature_is_flat(sig->params) && signature_is_flat(sig->ret)) {
+                    call_typed_child(old, r, w, function_name, sig);
+                    free(function_name);
+                    break;
+                }
+                value_t*args = read_typed_args_nolimit(r, sig->params);
+                if(!args) {
+                    _exit(1);
+                }
+                begin_child_operation(old);
+                value_t*ret = old->call_function(old, function_name, args);
+                if(ret && sig->ret[0] && !value_matches_type(ret, sig->ret[0])) {
+                    language_error(old, "%s: return value should be %s, not %s", function_name,
+                            type_code_to_string(sig->ret[0]),
+                            type_to_string(ret->type));
+                    value_destroy(ret);
+                    ret = NULL;
+                }
+                if(finish_operation(old, w)) {
+                    if(ret)
+                        value_destroy(ret);
+                } else if(ret) {
+                    buffer_t b = {0};
+                    buffer_append_byte(&b, RESP_RETURN);
+                    if(sig->ret[0]) {
+                        encode_typed_value(&b, ret, sig->ret[0]);
+                    }
+                    buffer_write(w, &b);
+                    value_destroy(ret);
+                } else {
+                    write_error(old, w, ERROR_EXCEPTION);
                 }
                 free(function_name);
                 value_destroy(args);
@@ -473,17 +1781,69 @@ static void child_loop(language_t*li)
     }
 }
 
+static bool keep_fd(int fd, int*keep, int keep_num)
+{
+    int j;
+    for(j=0;j<keep_num;j++) {
+        if(keep[j] == fd)
+            return true;
+    }
+    return false;
+}
+
+/* close the descriptors listed in /proc/self/fd, instead of trying every
+   possible number up to _SC_OPEN_MAX (which can be in the millions) */
+static bool close_listed_fds(int*keep, int keep_num)
+{
+    DIR*dir = opendir("/proc/self/fd");
+    if(!dir)
+        return false;
+    struct dirent*entry;
+    while((entry = readdir(dir))) {
+        if(entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+        int fd = atoi(entry->d_name);
+        if(fd != dirfd(dir) && !keep_fd(fd, keep, keep_num)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+/* Close everything the child inherited from the host process except the
+   descriptors in keep (which is sorted in place). */
 static void close_all_fds(int*keep, int keep_num)
 {
+    int i, j;
+    for(i=1;i<keep_num;i++) {
+        for(j=i;j>0 && keep[j-1] > keep[j];j--) {
+            int tmp = keep[j];
+            keep[j] = keep[j-1];
+            keep[j-1] = tmp;
+        }
+    }
+
+#ifdef SYS_close_range
+    /* one syscall per gap between the descriptors we keep */
+    unsigned int from = 0;
+    bool ok = true;
+    for(j=0;j<keep_num && ok;j++) {
+        if(keep[j] > from)
+            ok = !syscall(SYS_close_range, from, keep[j] - 1, 0);
+        if(keep[j] >= from)
+            from = keep[j] + 1;
+    }
+    if(ok && !syscall(SYS_close_range, from, ~0u, 0))
+        return;
+#endif
+    if(close_listed_fds(keep, keep_num))
+        return;
+
     int max=sysconf(_SC_OPEN_MAX);
     int fd;
     for(fd=0; fd<max; fd++) {
-        int j;
-        bool do_keep = false;
-        for(j=0;j<keep_num;j++) {
-            do_keep |= keep[j] == fd;
-        }
-        if(!do_keep) {
+        if(!keep_fd(fd, keep, keep_num)) {
             close(fd);
         }
     }
@@ -493,51 +1853,200 @@ static void sandbox_log(void*user, const char*str)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)user;
 
+    snprintf(last_error, sizeof(last_error), "%s", str);
     write_byte(proxy->fd_w, RESP_LOG);
     write_string(proxy->fd_w, str);
 }
 
+/* The child reports RESP_READY once it's locked down. Anything it logs
+   while initializing is passed on. */
+static bool wait_ready(language_t*li, uint64_t fork_start)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    const char*name = proxy->old->name;
+    struct timeval timeout;
+    timeout.tv_sec = proxy->timeout;
+    timeout.tv_usec = 0;
+
+    while(1) {
+        uint8_t resp = 0;
+        if(!read_with_timeout(proxy->fd_r, &resp, 1, &timeout)) {
+            return false;
+        }
+        if(resp == RESP_LOG) {
+            char*message = read_string(proxy->fd_r, MAX_STRING_SIZE, &timeout);
+            if(!message)
+                return false;
+            language_log(li, message);
+            free(message);
+        } else if(resp == RESP_READY) {
+            spawn_timings_t timings;
+            if(!read_with_timeout(proxy->fd_r, &timings, sizeof(timings), &timeout))
+                return false;
+            stats_record(name, HISTOGRAM_SPAWN_FORK, timings.forked - fork_start);
+            stats_record(name, HISTOGRAM_SPAWN_CLOSE_FDS, timings.close_fds);
+            stats_record(name, HISTOGRAM_SPAWN_INITIALIZE, timings.initialize);
+            stats_record(name, HISTOGRAM_SPAWN_LOCKDOWN, timings.lockdown);
+            char*version = read_string(proxy->fd_r, MAX_STRING_SIZE, &timeout);
+            if(!version)
+                return false;
+            free(proxy->version);
+            proxy->version = version;
+            return true;
+        } else {
+            fprintf(stderr, "Unexpected response %d from starting sandbox\n", resp);
+            return false;
+        }
+    }
+}
+
+/* Runs in the sandbox process, with fd_r and fd_w already set: set up the
+   interpreter, lock down, and serve commands until the parent goes away. */
+static void child_main(language_t*li, uint64_t started)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    spawn_timings_t timings;
+    timings.forked = started;
+
+    int keep[] = {1, 2, proxy->fd_r, proxy->fd_w};
+    close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
+    uint64_t t = stats_now();
+    timings.close_fds = t - started;
+
+    /* We haven't loaded any 3rd party code yet. 
+       Give the language interpreter a chance to do some initializations 
+       (with all syscalls still available) before we switch into secure mode.
+     */
+    bool ret = proxy->old->initialize(proxy->old, config_maxmem);
+    if(!ret) {
+        _exit(44);
+    }
+    timings.initialize = stats_now() - t;
+
+    /* log messages are passed back to the parent */
+    proxy->old->log = sandbox_log;
+    proxy->old->user = proxy;
+
+    interrupt_target = proxy->old;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sandbox_interrupt;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    error_fd = proxy->fd_w;
+    seccomp_set_crash_handler(sandbox_crash);
+    if(proxy->old->jit_mprotect) {
+        seccomp_allow_mprotect();
+    }
+
+    t = stats_now();
+    seccomp_lockdown();
+    timings.lockdown = stats_now() - t;
+    fflush(stdout);
+
+    write_byte(proxy->fd_w, RESP_READY);
+    write_counted(proxy->fd_w, &timings, sizeof(timings));
+    write_string(proxy->fd_w, proxy->old->version ? proxy->old->version : "");
+
+    child_loop(li);
+    _exit(0);
+}
+
+/* Start config_sandbox_helper, with the child's ends of the pipes on
+   SANDBOX_FD_R and SANDBOX_FD_W. posix_spawn() doesn't copy our page
+   tables, so this stays cheap no matter how big the host process is. */
+static bool spawn_helper(language_t*li, int fd_r, int fd_w)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+
+    /* move them out of the way first, so that the dup2()s below can't
+       overwrite each other */
+    int r = fcntl(fd_r, F_DUPFD_CLOEXEC, SANDBOX_FD_W + 1);
+    int w = fcntl(fd_w, F_DUPFD_CLOEXEC, SANDBOX_FD_W + 1);
+
+    char maxmem[32];
+    snprintf(maxmem, sizeof(maxmem), "%d", config_maxmem);
+    char*tuning = language_tuning_to_string(&proxy->old->tuning);
+    char*argv[12];
+    int argn = 0;
+    argv[argn++] = (char*)config_sandbox_helper;
+    argv[argn++] = "-m";
+    argv[argn++] = maxmem;
+    if(proxy->old->init_profile == INIT_PROFILE_MINIMAL) {
+        argv[argn++] = "-i";
+        argv[argn++] = "minimal";
+    }
+    if(*tuning) {
+        argv[argn++] = "-t";
+        argv[argn++] = tuning;
+    }
+    if(config_plugin_dir) {
+        argv[argn++] = "-p";
+        argv[argn++] = (char*)config_plugin_dir;
+    }
+    argv[argn++] = (char*)proxy->old->name;
+    argv[argn] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, r, SANDBOX_FD_R);
+    posix_spawn_file_actions_adddup2(&actions, w, SANDBOX_FD_W);
+
+    int ret = -1;
+    if(r >= 0 && w >= 0) {
+        ret = posix_spawn(&proxy->child_pid, config_sandbox_helper, &actions, NULL, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    free(tuning);
+    if(r >= 0)
+        close(r);
+    if(w >= 0)
+        close(w);
+
+    if(ret) {
+        fprintf(stderr, "Couldn't start %s: %s\n", config_sandbox_helper, strerror(ret < 0 ? errno : ret));
+        proxy->child_pid = -1;
+        return false;
+    }
+    return true;
+}
+
 static bool spawn_child(language_t*li)
 {
     proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
 
     int p_to_c[2];
     int c_to_p[2];
-    int stdout_pipe[2];
-    int stderr_pipe[2];
 
-    if(pipe(p_to_c) || pipe(c_to_p) || pipe(stdout_pipe) || pipe(stderr_pipe)) {
+    /* close-on-exec, so that processes the host starts while the sandbox
+       runs don't inherit (and keep open) our end of the pipes */
+    if(pipe2(p_to_c, O_CLOEXEC)) {
         perror("create pipe");
         return false;
     }
+    if(pipe2(c_to_p, O_CLOEXEC)) {
+        perror("create pipe");
+        close(p_to_c[0]);
+        close(p_to_c[1]);
+        return false;
+    }
 
-    proxy->child_pid = fork();
-    if(!proxy->child_pid) {
-        //child
-        proxy->fd_r = p_to_c[0];
-        proxy->fd_w = c_to_p[1];
-
-        int keep[] = {1, 2, proxy->fd_r, proxy->fd_w};
-        close_all_fds(keep, sizeof(keep)/sizeof(keep[0]));
-
-        /* We haven't loaded any 3rd party code yet. 
-           Give the language interpreter a chance to do some initializations 
-           (with all syscalls still available) before we switch into secure mode.
-         */
-        bool ret = proxy->old->initialize(proxy->old, config_maxmem);
-        if(!ret) {
-            _exit(44);
+    uint64_t fork_start = stats_now();
+    if(config_sandbox_helper) {
+        spawn_helper(li, p_to_c[0], c_to_p[1]);
+    } else {
+        proxy->child_pid = fork();
+        if(proxy->child_pid < 0) {
+            perror("fork");
+        }
+        if(!proxy->child_pid) {
+            //child
+            proxy->fd_r = p_to_c[0];
+            proxy->fd_w = c_to_p[1];
+            child_main(li, stats_now());
         }
-
-        /* log messages are passed back to the parent */
-        proxy->old->log = sandbox_log;
-        proxy->old->user = proxy;
-
-        seccomp_lockdown();
-        fflush(stdout);
-
-        child_loop(li);
-        _exit(0);
     }
 
     //parent
@@ -545,6 +2054,65 @@ static bool spawn_child(language_t*li)
     close(p_to_c[0]); // close read
     proxy->fd_r = c_to_p[0];
     proxy->fd_w = p_to_c[1];
+    if(proxy->child_pid < 0) {
+        close(proxy->fd_r);
+        close(proxy->fd_w);
+        return false;
+    }
+
+    if(!wait_ready(li, fork_start)) {
+        fprintf(stderr, "Sandbox process %d failed to start\n", proxy->child_pid);
+        kill(proxy->child_pid, SIGKILL);
+        waitpid(proxy->child_pid, NULL, 0);
+        close(proxy->fd_r);
+        close(proxy->fd_w);
+        return false;
+    }
+    return true;
+}
+
+/* Replace a child we killed with a new one, and set that up like the old
+   one: with the same constants, callbacks and signatures, and the same
+   scripts compiled again. Whatever guest code changed after that is lost. */
+static bool respawn_child(language_t*li)
+{
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    proxy->respawn = false;
+    waitpid(proxy->child_pid, NULL, 0);
+    close(proxy->fd_r);
+    close(proxy->fd_w);
+
+    uint64_t start = stats_now();
+    if(!spawn_child(li)) {
+        language_error(li, "Couldn't replace the sandbox process");
+        return false;
+    }
+    uint64_t duration = stats_now() - start;
+    stats_record(proxy->old->name, HISTOGRAM_SPAWN, duration);
+    stats_count(proxy->old->name, COUNTER_SPAWNS);
+    journal_record(JOURNAL_SPAWN, proxy->old->name, proxy->child_pid, JOURNAL_OK, duration, 0, 0, 0);
+
+    proxy->dead = false;
+    proxy->tainted = false;
+    /* the new child starts out with the defaults */
+    proxy->ops_budget = 0;
+    proxy->profile_interval = 0;
+    proxy->gc_policy = GC_AUTOMATIC;
+
+    setup_step_t*step;
+    for(step = proxy->setup; step; step = step->next) {
+        write_counted(proxy->fd_w, step->commands.data, step->commands.len);
+        if(step->script && !do_compile_script(li, step->script)) {
+            language_error(li, "Couldn't set up the replacement sandbox process");
+            if(!proxy->dead) {
+                kill(proxy->child_pid, SIGKILL);
+                proxy->dead = true;
+            }
+            /* don't try again */
+            proxy->respawn = false;
+            return false;
+        }
+    }
     return true;
 }
 
@@ -574,6 +2142,11 @@ static void destroy_proxy(language_t* li)
     } else {
         log_dbg("%08x %08x unknown exit reason. status=%d\n", ret, status, status);
     }
+    journal_record(JOURNAL_DESTROY, old->name, proxy->child_pid,
+                   WIFEXITED(status) && !WEXITSTATUS(status) ? JOURNAL_OK : JOURNAL_FAILED, 0, 0, 0, 0);
+    clear_setup(proxy);
+    free(proxy->backtrace);
+    free(proxy->version);
     free(proxy);
     free(li);
 
@@ -595,6 +2168,13 @@ language_t* proxy_new(language_t*old)
     li->call_function = call_function_proxy;
     li->define_function = define_function_proxy;
     li->define_constant = define_constant_proxy;
+    li->declare_function = declare_function_proxy;
+    li->get_stats = get_stats_proxy;
+    li->get_profile = get_profile_proxy;
+    li->get_backtrace = get_backtrace_proxy;
+    li->reset = reset_proxy;
+    li->collect_garbage = collect_garbage_proxy;
+    li->set_timeout = set_timeout_proxy;
     li->destroy = destroy_proxy;
     li->internal = calloc(1, sizeof(proxy_internal_t));
 
@@ -602,15 +2182,44 @@ language_t* proxy_new(language_t*old)
     proxy->li = li;
     proxy->old = old;
     proxy->timeout = config_maxtime;
+    proxy->signatures = dict_new(&charptr_type);
 
+    uint64_t start = stats_now();
+    PROBE1(spawn__start, old->name);
     if(!spawn_child(li)) {
         fprintf(stderr, "Couldn't spawn child process\n");
+        dict_destroy(proxy->signatures);
         free(proxy);
         free(li);
         return NULL;
     }
+    uint64_t duration = stats_now() - start;
+    stats_record(old->name, HISTOGRAM_SPAWN, duration);
+    stats_count(old->name, COUNTER_SPAWNS);
+    journal_record(JOURNAL_SPAWN, old->name, proxy->child_pid, JOURNAL_OK, duration, 0, 0, 0);
+    PROBE2(spawn__done, proxy->child_pid, old->name);
 
     proxy->callback_functions = dict_new(&charptr_type);
 
     return li;
 }
+
+/* Entry point of the cagekeeper-sandbox helper: serve commands for the
+   (not yet initialized) interpreter old, on the pipes the parent passed
+   as SANDBOX_FD_R and SANDBOX_FD_W. Doesn't return. */
+void proxy_serve(language_t*old)
+{
+    uint64_t started = stats_now();
+    language_t * li = calloc(1, sizeof(language_t));
+    li->name = "proxy";
+    li->internal = calloc(1, sizeof(proxy_internal_t));
+
+    proxy_internal_t*proxy = (proxy_internal_t*)li->internal;
+    proxy->li = li;
+    proxy->old = old;
+    proxy->child_pid = getpid();
+    proxy->fd_r = SANDBOX_FD_R;
+    proxy->fd_w = SANDBOX_FD_W;
+    proxy->signatures = dict_new(&charptr_type);
+    child_main(li, started);
+}
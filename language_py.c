@@ -4,17 +4,31 @@
 #include <signal.h>
 #include "util.h"
 #include "language.h"
+#include "probes.h"
+#include "profile.h"
 
 #include <frameobject.h>
+#include <marshal.h>
 
 typedef struct _py_internal {
     PyObject*globals;
+    /* globals right after initialization, for reset_py() */
+    PyObject*pristine_globals;
     PyObject*module;
     language_t*li;
     char*buffer;
+    volatile sig_atomic_t interrupted;
+    PyObject*trace_arg;
+    profile_t*profile;
+    char*backtrace;
+    size_t heap_start;
+    /* the cyclic collector is switched off while gc_policy is
+       GC_BETWEEN_CALLS. Reference counting still frees everything else. */
+    bool gc_disabled;
 } py_internal_t;
 
 static PyTypeObject FunctionProxyClass;
+static bool trace_intact(language_t*li);
 
 typedef struct {
     PyObject_HEAD
@@ -23,12 +37,23 @@ typedef struct {
     function_t*function;
 } FunctionProxyObject;
 
-static value_t* pyobject_to_value(language_t*li, PyObject*o)
+static value_t* pyobject_to_scalar(language_t*li, PyObject*o)
 {
     if(o == Py_None) {
         return value_new_void();
     } else if(PyUnicode_Check(o)) {
-        return value_new_string(PyUnicode_AS_DATA(o));
+        PyObject*utf8 = PyUnicode_AsUTF8String(o);
+        if(!utf8) {
+            PyErr_Clear();
+            language_error(li, "Can't encode string as UTF-8");
+            return NULL;
+        }
+        value_t*v = value_new_string(PyString_AsString(utf8));
+        Py_DECREF(utf8);
+        return v;
+    } else if(PyBool_Check(o)) {
+        /* before PyInt_Check(), since bool is a subclass of int */
+        return value_new_boolean(o == Py_True);
     } else if(PyString_Check(o)) {
         return value_new_string(PyString_AsString(o));
     } else if(PyLong_Check(o)) {
@@ -41,84 +66,170 @@ static value_t* pyobject_to_value(language_t*li, PyObject*o)
     } else if(PyDouble_Check(o)) {
         return value_new_float32(PyDouble_AsDouble(o));
 #endif
-    } else if(PyBool_Check(o)) {
-        return value_new_boolean(o == Py_True);
-    } else if(PyList_Check(o)) {
-        int i;
-        int l = PyList_GET_SIZE(o);
-
-        value_t*array = array_new();
-        for(i=0;i<l;i++) {
-            PyObject*e = PyList_GetItem(o, i);
-            if(e == NULL)
-                return NULL;
-            array_append(array, pyobject_to_value(li, e));
-        }
-        return array;
-    } else if(PyTuple_Check(o)) {
-        int i;
-        int l = PyTuple_GET_SIZE(o);
-        value_t*array = array_new();
-        for(i=0;i<l;i++) {
-            PyObject*e = PyTuple_GetItem(o, i);
-            if(e == NULL)
-                return NULL;
-            array_append(array, pyobject_to_value(li, e));
-        }
-        return array;
     } else {
         language_error(li, "Can't convert type %s", o->ob_type->tp_name);
         return NULL;
     }
 }
 
-static PyObject* value_to_pyobject(language_t*li, value_t*value, bool arrays_as_tuples)
+typedef struct _py_frame {
+    PyObject*seq;
+    PyObject**items;
+    Py_ssize_t pos;
+    Py_ssize_t length;
+    value_t*array;
+} py_frame_t;
+
+static value_t* pyobject_to_value(language_t*li, PyObject*o)
 {
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(py_frame_t));
+    py_frame_t*frame;
+    value_t*root = NULL;
+
+    while(1) {
+        PyObject*seq = NULL;
+        value_t*v;
+        if(PyList_Check(o) || PyTuple_Check(o)) {
+            /* for lists and tuples, this just returns a new reference,
+               and gives us direct access to the item array */
+            seq = PySequence_Fast(o, "not a sequence");
+            if(!seq)
+                goto error;
+            v = array_new_sized(PySequence_Fast_GET_SIZE(seq));
+        } else {
+            v = pyobject_to_scalar(li, o);
+            if(!v)
+                goto error;
+        }
+
+        py_frame_t*parent = walk_stack_top(&stack);
+        if(parent) {
+            array_append(parent->array, v);
+        } else {
+            root = v;
+        }
+
+        if(seq) {
+            frame = walk_stack_push(&stack);
+            frame->seq = seq;
+            frame->items = PySequence_Fast_ITEMS(seq);
+            frame->pos = 0;
+            frame->length = PySequence_Fast_GET_SIZE(seq);
+            frame->array = v;
+        }
+
+        /* find the next entry to convert */
+        while((frame = walk_stack_top(&stack))) {
+            if(frame->pos < frame->length) {
+                o = frame->items[frame->pos++];
+                break;
+            }
+            Py_DECREF(frame->seq);
+            walk_stack_pop(&stack);
+        }
+        if(!frame) {
+            walk_stack_destroy(&stack);
+            return root;
+        }
+    }
+
+error:
+    while((frame = walk_stack_top(&stack))) {
+        Py_DECREF(frame->seq);
+        walk_stack_pop(&stack);
+    }
+    walk_stack_destroy(&stack);
+    if(root)
+        value_destroy(root);
+    return NULL;
+}
+
+typedef struct _to_pyobject_context {
+    language_t*li;
+    walk_stack_t stack;
+    PyObject*root;
+    bool arrays_as_tuples;
+} to_pyobject_context_t;
+
+static bool to_pyobject_visit(void*_context, value_t*value, int index)
+{
+    to_pyobject_context_t*context = _context;
+    PyObject*o;
     switch(value->type) {
         case TYPE_VOID:
-            return Py_BuildValue("s", NULL);
+            o = Py_BuildValue("s", NULL);
         break;
         case TYPE_FLOAT32:
-            return PyFloat_FromDouble(value->f32);
+            o = PyFloat_FromDouble(value->f32);
         break;
         case TYPE_INT32:
-            return PyInt_FromLong(value->i32);
+            o = PyInt_FromLong(value->i32);
         break;
         case TYPE_BOOLEAN:
-            return PyBool_FromLong(value->b);
+            o = PyBool_FromLong(value->b);
         break;
         case TYPE_STRING: {
-            return PyUnicode_FromString(value->str);
+            o = PyUnicode_FromString(value->str);
         }
         break;
         case TYPE_ARRAY: {
-            if(arrays_as_tuples) {
-                PyObject *array = PyTuple_New(value->length);
-                int i;
-                for(i=0;i<value->length;i++) {
-                    PyObject*entry = value_to_pyobject(li, value->data[i], false);
-                    if(!entry)
-                        return NULL;
-                    PyTuple_SetItem(array, i, entry);
-                }
-                return array;
+            /* only the outermost array may become a tuple */
+            if(context->arrays_as_tuples && index < 0) {
+                o = PyTuple_New(value->length);
             } else {
-                PyObject *array = PyList_New(value->length);
-                int i;
-                for(i=0;i<value->length;i++) {
-                    PyObject*entry = value_to_pyobject(li, value->data[i], false);
-                    if(!entry)
-                        return NULL;
-                    PyList_SetItem(array, i, entry);
-                }
-                return array;
+                o = PyList_New(value->length);
             }
         }
         break;
         default: {
-            return NULL;
+            o = NULL;
+        }
+    }
+    if(!o)
+        return false;
+
+    PyObject**parent = walk_stack_top(&context->stack);
+    if(parent) {
+        /* containers are attached to their parent right away, so that
+           everything is owned by the root object */
+        if(PyTuple_Check(*parent)) {
+            PyTuple_SET_ITEM(*parent, index, o);
+        } else {
+            PyList_SET_ITEM(*parent, index, o);
         }
+    } else {
+        context->root = o;
+    }
+    if(value->type == TYPE_ARRAY) {
+        *(PyObject**)walk_stack_push(&context->stack) = o;
+    }
+    return true;
+}
+
+static bool to_pyobject_leave(void*_context, value_t*array)
+{
+    to_pyobject_context_t*context = _context;
+    walk_stack_pop(&context->stack);
+    return true;
+}
+
+static PyObject* value_to_pyobject(language_t*li, value_t*value, bool arrays_as_tuples)
+{
+    static const value_visitor_t to_pyobject_visitor = {to_pyobject_visit, to_pyobject_leave};
+    to_pyobject_context_t context;
+    context.li = li;
+    context.root = NULL;
+    context.arrays_as_tuples = arrays_as_tuples;
+    walk_stack_init(&context.stack, sizeof(PyObject*));
+    bool ok = value_walk(value, &to_pyobject_visitor, &context);
+    walk_stack_destroy(&context.stack);
+    if(!ok) {
+        /* unset entries of lists and tuples are NULL, which dealloc handles */
+        Py_XDECREF(context.root);
+        return NULL;
     }
+    return context.root;
 }
 
 static PyObject* python_method_proxy(PyObject* _self, PyObject* _args)
@@ -132,6 +243,10 @@ static PyObject* python_method_proxy(PyObject* _self, PyObject* _args)
 #endif
 
     language_t*li = self->py_internal->li;
+    if(!trace_intact(li)) {
+        PyErr_SetString(PyExc_KeyboardInterrupt, "trace function removed");
+        return NULL;
+    }
     value_t*args = pyobject_to_value(li, _args);
     value_t*ret = self->function->call(self->function, args);
     value_destroy(args);
@@ -142,11 +257,32 @@ static PyObject* python_method_proxy(PyObject* _self, PyObject* _args)
     return pret;
 }
 
+/* the frames of a traceback stay alive, including the ones they were
+   called from, so we can walk outwards from the innermost one */
+static void capture_backtrace(py_internal_t*py, PyTracebackObject*tb)
+{
+    free(py->backtrace);
+    py->backtrace = NULL;
+    if(!tb)
+        return;
+    while(tb->tb_next)
+        tb = tb->tb_next;
+    PyFrameObject*frame;
+    for(frame=tb->tb_frame;frame;frame=frame->f_back) {
+        py->backtrace = backtrace_add_frame(py->backtrace,
+                                PyString_AsString(frame->f_code->co_name),
+                                PyString_AsString(frame->f_code->co_filename),
+                                frame == tb->tb_frame ? tb->tb_lineno : PyFrame_GetLineNumber(frame));
+    }
+}
+
 static void handle_exception(language_t*li)
 {
+    py_internal_t*py = (py_internal_t*)li->internal;
     PyObject *exception, *v, *_tb;
     PyErr_Fetch(&exception, &v, &_tb);
     PyErr_NormalizeException(&exception, &v, &_tb);
+    capture_backtrace(py, (PyTracebackObject*)_tb);
 
     language_error(li, "Traceback (most recent call last):");
 
@@ -185,20 +321,120 @@ static void handle_exception(language_t*li)
     Py_DECREF(_tb);
 }
 
+static int raise_interrupt(void*_py)
+{
+    py_internal_t*py = (py_internal_t*)_py;
+    if(!py->interrupted)
+        return 0;
+    py->interrupted = 0;
+    PyErr_SetString(PyExc_KeyboardInterrupt, "interrupted");
+    return -1;
+}
+
+static void sample_stack(PyFrameObject*frame, profile_t*profile)
+{
+    profile_sample_begin(profile);
+    for(;frame;frame=frame->f_back) {
+        profile_sample_frame(profile, PyString_AsString(frame->f_code->co_name),
+                                      PyString_AsString(frame->f_code->co_filename),
+                                      PyFrame_GetLineNumber(frame));
+    }
+    profile_sample_end(profile);
+}
+
+/* trace function for counting operations: every executed line, and every
+   call, counts as one */
+static int count_ops(PyObject*arg, PyFrameObject*frame, int what, PyObject*unused)
+{
+    if(what != PyTrace_LINE && what != PyTrace_CALL)
+        return 0;
+    py_internal_t*py = (py_internal_t*)PyCapsule_GetPointer(arg, NULL);
+    language_t*li = py->li;
+    ++li->ops;
+    if(profile_due(py->profile, li->ops)) {
+        sample_stack(frame, py->profile);
+    }
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        li->timeout = true;
+        PyErr_SetString(PyExc_KeyboardInterrupt, "operation budget exceeded");
+        return -1;
+    }
+    return 0;
+}
+
+/* sys.settrace() and sys.setprofile() are removed, but guests can get
+   them back with reload(sys). If they replace or remove count_ops, the
+   budget and the profiler stop working, so the operation fails. */
+static bool trace_intact(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    if(!li->ops_budget && !li->profile_interval)
+        return true;
+    PyThreadState*tstate = PyThreadState_GET();
+    if(tstate->c_tracefunc == count_ops && tstate->c_traceobj == py->trace_arg)
+        return true;
+    li->timeout = true;
+    return false;
+}
+
+/* called before running any guest code */
+static void begin_operation(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    py->interrupted = 0;
+    li->timeout = false;
+    li->ops = 0;
+    free(py->backtrace);
+    py->backtrace = NULL;
+    py->heap_start = heap_in_use();
+    profile_start(py->profile, li->profile_interval);
+    if(li->ops_budget || li->profile_interval) {
+        PyEval_SetTrace(count_ops, py->trace_arg);
+    } else {
+        PyEval_SetTrace(NULL, NULL);
+    }
+    bool disable_gc = li->gc_policy == GC_BETWEEN_CALLS;
+    if(disable_gc != py->gc_disabled) {
+        PyObject*gc = PyImport_ImportModule("gc");
+        if(gc) {
+            PyObject*ret = PyObject_CallMethod(gc, disable_gc ? "disable" : "enable", NULL);
+            Py_XDECREF(ret);
+            Py_DECREF(gc);
+            py->gc_disabled = disable_gc;
+        }
+        PyErr_Clear();
+    }
+}
+
+static void interrupt_py(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    /* the pending call runs on the next tick of the interpreter loop */
+    py->interrupted = 1;
+    Py_AddPendingCall(raise_interrupt, py);
+}
+
 static bool compile_script_py(language_t*li, const char*script)
 {
     py_internal_t*py = (py_internal_t*)li->internal;
     log_dbg("[python] compiling script");
+    begin_operation(li);
 
     // test memory allocation
     PyObject* tmp = PyString_FromString("test");
     Py_DECREF(tmp);
 
+    PROBE2(guest__compile__start, li->name, strlen(script));
     PyObject* ret = PyRun_String(script, Py_file_input, py->globals, NULL);
+    PROBE2(guest__compile__done, li->name, ret != NULL);
     if(ret == NULL) {
         handle_exception(li);
         PyErr_Print();
         PyErr_Clear();
+    } else if(!trace_intact(li)) {
+        language_error(li, "Script removed the operation counter");
+        Py_DECREF(ret);
+        ret = NULL;
     }
 #ifdef DEBUG
     if(ret!=NULL) {
@@ -210,6 +446,63 @@ static bool compile_script_py(language_t*li, const char*script)
     return ret!=NULL;
 }
 
+static bool compile_to_bytecode_py(language_t*li, const char*script, void**data, int*len)
+{
+    log_dbg("[python] compiling script to bytecode");
+
+    PyObject*code = Py_CompileString(script, "<string>", Py_file_input);
+    if(code == NULL) {
+        handle_exception(li);
+        PyErr_Print();
+        PyErr_Clear();
+        return false;
+    }
+    PyObject*marshalled = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+    Py_DECREF(code);
+    if(marshalled == NULL) {
+        PyErr_Clear();
+        return false;
+    }
+    char*buffer = NULL;
+    Py_ssize_t size = 0;
+    PyString_AsStringAndSize(marshalled, &buffer, &size);
+    *data = memdup(buffer, size);
+    *len = size;
+    Py_DECREF(marshalled);
+    return true;
+}
+
+static bool load_bytecode_py(language_t*li, const void*data, int len)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    log_dbg("[python] loading %d bytes of bytecode", len);
+    begin_operation(li);
+
+    PyObject*code = PyMarshal_ReadObjectFromString((char*)data, len);
+    if(code == NULL || !PyCode_Check(code)) {
+        language_error(li, "invalid bytecode");
+        Py_XDECREF(code);
+        PyErr_Clear();
+        return false;
+    }
+    PROBE2(guest__compile__start, li->name, len);
+    PyObject* ret = PyEval_EvalCode((PyCodeObject*)code, py->globals, NULL);
+    PROBE2(guest__compile__done, li->name, ret != NULL);
+    Py_DECREF(code);
+    if(ret == NULL) {
+        handle_exception(li);
+        PyErr_Print();
+        PyErr_Clear();
+        return false;
+    }
+    Py_DECREF(ret);
+    if(!trace_intact(li)) {
+        language_error(li, "Script removed the operation counter");
+        return false;
+    }
+    return true;
+}
+
 static bool is_function_py(language_t*li, const char*name)
 {
     py_internal_t*py = (py_internal_t*)li->internal;
@@ -219,10 +512,9 @@ static bool is_function_py(language_t*li, const char*name)
     return function != NULL;
 }
 
-static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
+static PyObject* find_function_py(language_t*li, const char*name)
 {
     py_internal_t*py = (py_internal_t*)li->internal;
-    log_dbg("[python] calling function %s", name);
 
     PyObject*function = PyDict_GetItemString(py->globals, name);
     if(function == NULL) {
@@ -240,14 +532,15 @@ static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
         language_error(li, "Object %s is not callable", name);
         return NULL;
     }
+    return function;
+}
 
-    PyObject*args = value_to_pyobject(li, _args, true);
-    if(!args)
-        return NULL;
-    PyObject*kwargs = PyDict_New();
-    //PyObject*ret = PyObject_Call(function, args, kwargs);
+/* calls function, and releases args. NULL if the call failed. */
+static PyObject* call_object_py(language_t*li, const char*name, PyObject*function, PyObject*args)
+{
+    PROBE2(guest__call__start, li->name, name);
     PyObject*ret = PyObject_CallObject(function, args);
-    Py_DECREF(kwargs);
+    PROBE3(guest__call__done, li->name, name, ret != NULL);
     Py_DECREF(args);
 
     if(ret == NULL) {
@@ -255,9 +548,190 @@ static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
         PyErr_Print();
         PyErr_Clear();
         return NULL;
+    } else if(!trace_intact(li)) {
+        language_error(li, "%s removed the operation counter", name);
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+static value_t* call_function_py(language_t*li, const char*name, value_t*_args)
+{
+    log_dbg("[python] calling function %s", name);
+    begin_operation(li);
+
+    PyObject*function = find_function_py(li, name);
+    if(!function)
+        return NULL;
+
+    PyObject*args = value_to_pyobject(li, _args, true);
+    if(!args)
+        return NULL;
+    PyObject*ret = call_object_py(li, name, function, args);
+    if(!ret)
+        return NULL;
+    value_t*value = pyobject_to_value(li, ret);
+    Py_DECREF(ret);
+    return value;
+}
+
+/* an argument of a declared type, straight from the typed encoding */
+static PyObject* typed_to_pyobject(typed_reader_t*r, char type)
+{
+    bool b;
+    int32_t i32;
+    float f32;
+    const char*s;
+    int length, i;
+    switch(type) {
+        case 'b':
+            return typed_read_boolean(r, &b) ? PyBool_FromLong(b) : NULL;
+        case 'i':
+            return typed_read_int32(r, &i32) ? PyInt_FromLong(i32) : NULL;
+        case 'f':
+            return typed_read_float32(r, &f32) ? PyFloat_FromDouble(f32) : NULL;
+        case 's':
+            return typed_read_string(r, &s, &length) ? PyUnicode_FromStringAndSize(s, length) : NULL;
+    }
+
+    if(!typed_read_length(r, &length))
+        return NULL;
+    PyObject*list = PyList_New(length);
+    if(!list)
+        return NULL;
+    for(i=0;i<length;i++) {
+        PyObject*o = typed_to_pyobject(r, type - 'A' + 'a');
+        if(!o) {
+            /* unset entries are NULL, which dealloc handles */
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, o);
+    }
+    return list;
+}
+
+/* whole numbers in the int32 range, like value_matches_type() */
+static bool pyobject_to_int32(PyObject*o, int32_t*i32)
+{
+    double d;
+    if(PyInt_Check(o)) {
+        d = PyInt_AS_LONG(o);
+    } else if(PyLong_Check(o) || PyFloat_Check(o)) {
+        d = PyFloat_AsDouble(o);
+        if(d == -1.0 && PyErr_Occurred()) {
+            PyErr_Clear();
+            return false;
+        }
     } else {
-        return pyobject_to_value(li, ret);
+        return false;
     }
+    if(!(d >= -2147483648.0 && d < 2147483648.0) || d != (double)(int32_t)d)
+        return false;
+    *i32 = (int32_t)d;
+    return true;
+}
+
+/* false if o doesn't have the declared type */
+static bool write_typed_scalar(PyObject*o, char type, typed_writer_t*w)
+{
+    int32_t i32;
+    switch(type) {
+        case 'b':
+            if(!PyBool_Check(o))
+                return false;
+            typed_write_boolean(w, o == Py_True);
+            return true;
+        case 'i':
+            if(!pyobject_to_int32(o, &i32))
+                return false;
+            typed_write_int32(w, i32);
+            return true;
+        case 'f': {
+            if(!PyInt_Check(o) && !PyLong_Check(o) && !PyFloat_Check(o))
+                return false;
+            double d = PyFloat_AsDouble(o);
+            if(d == -1.0 && PyErr_Occurred()) {
+                PyErr_Clear();
+                return false;
+            }
+            typed_write_float32(w, d);
+            return true;
+        }
+        case 's': {
+            if(PyString_Check(o)) {
+                typed_write_string(w, PyString_AS_STRING(o), PyString_GET_SIZE(o));
+                return true;
+            }
+            if(!PyUnicode_Check(o))
+                return false;
+            PyObject*utf8 = PyUnicode_AsUTF8String(o);
+            if(!utf8) {
+                PyErr_Clear();
+                return false;
+            }
+            typed_write_string(w, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+            Py_DECREF(utf8);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool write_typed_py(PyObject*o, char type, typed_writer_t*w)
+{
+    if(type != 'B' && type != 'I' && type != 'F' && type != 'S')
+        return write_typed_scalar(o, type, w);
+    if(!PyList_Check(o) && !PyTuple_Check(o))
+        return false;
+    Py_ssize_t length = PySequence_Fast_GET_SIZE(o);
+    PyObject**items = PySequence_Fast_ITEMS(o);
+    Py_ssize_t i;
+    typed_write_length(w, length);
+    for(i=0;i<length;i++) {
+        if(!write_typed_scalar(items[i], type - 'A' + 'a', w))
+            return false;
+    }
+    return true;
+}
+
+static bool call_typed_py(language_t*li, const char*name, const char*params, const char*ret_type,
+                          typed_reader_t*args, typed_writer_t*ret)
+{
+    log_dbg("[python] calling function %s", name);
+    begin_operation(li);
+
+    PyObject*function = find_function_py(li, name);
+    if(!function)
+        return false;
+
+    int num_params = strlen(params);
+    PyObject*tuple = PyTuple_New(num_params);
+    if(!tuple)
+        return false;
+    int i;
+    for(i=0;i<num_params;i++) {
+        PyObject*o = typed_to_pyobject(args, params[i]);
+        if(!o) {
+            PyErr_Clear();
+            Py_DECREF(tuple);
+            language_error(li, "%s: invalid argument %d", name, i+1);
+            return false;
+        }
+        PyTuple_SET_ITEM(tuple, i, o);
+    }
+
+    PyObject*value = call_object_py(li, name, function, tuple);
+    if(!value)
+        return false;
+    bool ok = !ret_type[0] || write_typed_py(value, ret_type[0], ret);
+    if(!ok) {
+        language_error(li, "%s: return value should be %s, not %s", name,
+                type_code_to_string(ret_type[0]), value->ob_type->tp_name);
+    }
+    Py_DECREF(value);
+    return ok;
 }
 
 static void define_constant_py(language_t*li, const char*name, value_t*value)
@@ -325,22 +799,43 @@ static bool initialize_py(language_t*li, size_t mem_size)
     py->li = li;
 
     if(py_reference_count==0) {
+        if(li->init_profile == INIT_PROFILE_MINIMAL) {
+            /* don't import site (which scans sys.path for .pth files), and
+               ignore PYTHON* environment variables */
+            Py_NoSiteFlag = 1;
+            Py_IgnoreEnvironmentFlag = 1;
+        }
         void*old = signal(2, SIG_IGN);
         Py_Initialize();
 #if PY_MAJOR_VERSION < 3
         FunctionProxyClass.ob_type = &PyType_Type;
 #endif
         signal(2, old);
+
+        /* the operation counter is a trace function (see trace_intact()) */
+        PyObject*sys = PyImport_ImportModule("sys");
+        if(sys) {
+            PyObject_DelAttrString(sys, "settrace");
+            PyObject_DelAttrString(sys, "setprofile");
+            Py_DECREF(sys);
+        }
+        PyErr_Clear();
     }
     py_reference_count++;
+    li->version = runtime_version(PY_VERSION, (void*)Py_Initialize);
 
     py->globals = PyDict_New();
     py->buffer = malloc(65536);
+    py->trace_arg = PyCapsule_New(py, NULL, NULL);
+    py->profile = profile_new();
 
     py->module = PyImport_AddModule("__main__");
-    PyObject* globals = PyModule_GetDict(py->module);
-
-    PyDict_Update(py->globals, globals);
+    if(li->init_profile == INIT_PROFILE_MINIMAL) {
+        PyDict_SetItemString(py->globals, "__builtins__", PyEval_GetBuiltins());
+    } else {
+        PyObject* globals = PyModule_GetDict(py->module);
+        PyDict_Update(py->globals, globals);
+    }
 
     //globals->ob_type->tp_print(globals, stdout, 0);
     
@@ -350,19 +845,67 @@ static bool initialize_py(language_t*li, size_t mem_size)
        it needs for compiling (encodingsmodule etc.) */
     PyRun_String("None", Py_file_input, py->globals, NULL);
 
+    py->pristine_globals = PyDict_Copy(py->globals);
+    return true;
+}
+
+static bool reset_py(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    PyObject*globals = PyDict_Copy(py->pristine_globals);
+    if(!globals)
+        return false;
+    Py_DECREF(py->globals);
+    py->globals = globals;
+    free(py->backtrace);
+    py->backtrace = NULL;
+    PyGC_Collect();
+    return true;
+}
+
+static bool collect_garbage_py(language_t*li)
+{
+    PyGC_Collect();
+    return true;
+}
+
+/* python 2 has no allocator hooks, so all we can see is how the heap
+   changed */
+static bool get_stats_py(language_t*li, call_stats_t*stats)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    size_t heap = heap_in_use();
+    stats->allocated_bytes = heap > py->heap_start ? heap - py->heap_start : 0;
+    stats->peak_heap = heap > py->heap_start ? heap : py->heap_start;
     return true;
 }
 
+static char* get_backtrace_py(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    return py->backtrace ? strdup(py->backtrace) : NULL;
+}
+
+static char* get_profile_py(language_t*li)
+{
+    py_internal_t*py = (py_internal_t*)li->internal;
+    return profile_folded(py->profile);
+}
+
 static void destroy_py(language_t* li)
 {
     if(li->internal) {
         py_internal_t*py = (py_internal_t*)li->internal;
         free(py->buffer);
+        profile_destroy(py->profile);
+        free(py->backtrace);
+        Py_XDECREF(py->pristine_globals);
         free(py);
         if(--py_reference_count==0) {
             Py_Finalize();
         }
     }
+    free(li->version);
     free(li);
 }
 
@@ -372,8 +915,17 @@ language_t* python_interpreter_new()
     li->name = "py";
     li->initialize = initialize_py;
     li->compile_script = compile_script_py;
+    li->compile_to_bytecode = compile_to_bytecode_py;
+    li->load_bytecode = load_bytecode_py;
+    li->interrupt = interrupt_py;
+    li->get_profile = get_profile_py;
+    li->get_stats = get_stats_py;
+    li->get_backtrace = get_backtrace_py;
+    li->reset = reset_py;
+    li->collect_garbage = collect_garbage_py;
     li->is_function = is_function_py;
     li->call_function = call_function_py;
+    li->call_typed = call_typed_py;
     li->define_constant = define_constant_py;
     li->define_function = define_function_py;
     li->destroy = destroy_py;
@@ -0,0 +1,741 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <malloc.h>
+#include <quickjs.h>
+
+#include "language.h"
+#include "probes.h"
+#include "profile.h"
+#include "util.h"
+
+/* javascript on QuickJS: a runtime and context are a few hundred
+   kilobytes and take well under a millisecond to create, where
+   spidermonkey needs megabytes. There's no JIT, so long running scripts
+   are slower. */
+
+/* QuickJS calls the interrupt handler about every this many function
+   calls and backward jumps, which is what we count as operations */
+#define OPS_PER_INTERRUPT 10000
+
+/* QuickJS's own initial GC threshold */
+#define DEFAULT_GC_THRESHOLD (256 * 1024)
+
+typedef struct _qjs_internal {
+    language_t*li;
+    JSRuntime*rt;
+    JSContext*cx;
+    volatile sig_atomic_t interrupted;
+    profile_t*profile;
+    char*backtrace;
+    size_t memory_limit;
+    bool gc_suppressed;
+    /* why the interrupt handler stopped the script, if it did */
+    const char*abort_reason;
+
+    /* functions from define_function(), indexed by the "magic" number of
+       their javascript proxies */
+    function_t**functions;
+    int num_functions;
+
+    /* allocator accounting */
+    size_t heap;
+    size_t peak_heap;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+} qjs_internal_t;
+
+static size_t qjs_malloc_usable_size(const void*ptr)
+{
+    return ptr ? malloc_usable_size((void*)ptr) : 0;
+}
+
+static void count_allocation(JSMallocState*s, size_t old_size, size_t new_size)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)s->opaque;
+    s->malloc_size += new_size - old_size;
+    qjs->heap = s->malloc_size;
+    if(new_size > old_size)
+        qjs->allocated_bytes += new_size - old_size;
+    if(qjs->heap > qjs->peak_heap)
+        qjs->peak_heap = qjs->heap;
+}
+
+static void* qjs_malloc(JSMallocState*s, size_t size)
+{
+    if(s->malloc_size + size > s->malloc_limit)
+        return NULL;
+    void*ptr = malloc(size);
+    if(!ptr)
+        return NULL;
+    s->malloc_count++;
+    ((qjs_internal_t*)s->opaque)->allocations++;
+    count_allocation(s, 0, qjs_malloc_usable_size(ptr));
+    return ptr;
+}
+
+static void qjs_free(JSMallocState*s, void*ptr)
+{
+    if(!ptr)
+        return;
+    s->malloc_count--;
+    s->malloc_size -= qjs_malloc_usable_size(ptr);
+    ((qjs_internal_t*)s->opaque)->heap = s->malloc_size;
+    free(ptr);
+}
+
+static void* qjs_realloc(JSMallocState*s, void*ptr, size_t size)
+{
+    if(!ptr)
+        return size ? qjs_malloc(s, size) : NULL;
+    size_t old_size = qjs_malloc_usable_size(ptr);
+    if(!size) {
+        qjs_free(s, ptr);
+        return NULL;
+    }
+    if(s->malloc_size + size - old_size > s->malloc_limit)
+        return NULL;
+    void*data = realloc(ptr, size);
+    if(!data)
+        return NULL;
+    count_allocation(s, old_size, qjs_malloc_usable_size(data));
+    return data;
+}
+
+static const JSMallocFunctions qjs_malloc_functions = {
+    qjs_malloc, qjs_free, qjs_realloc, qjs_malloc_usable_size,
+};
+
+/* Exceptions carry their stack as text, one "    at function (file:line)"
+   per frame, innermost first. */
+typedef void (*frame_visitor_t)(void*data, const char*function, const char*file, int line);
+
+static void walk_stack_string(const char*stack, frame_visitor_t visit, void*data)
+{
+    while(stack && *stack) {
+        const char*end = strchr(stack, '\n');
+        if(!end)
+            end = stack + strlen(stack);
+        const char*at = strstr(stack, "at ");
+        const char*open = at ? memchr(at, '(', end - at) : NULL;
+        const char*close = open ? memchr(open, ')', end - open) : NULL;
+        if(close) {
+            char*function = strndup(at + 3, open - (at + 3));
+            char*file = strndup(open + 1, close - (open + 1));
+            int line = 0;
+            char*colon = strchr(file, ':');
+            if(colon) {
+                *colon = 0;
+                line = atoi(colon + 1);
+            }
+            /* strip the space between name and location */
+            size_t len = strlen(function);
+            if(len && function[len-1] == ' ')
+                function[len-1] = 0;
+            visit(data, *function ? function : "(anonymous)", file, line);
+            free(function);
+            free(file);
+        }
+        stack = *end ? end + 1 : end;
+    }
+}
+
+static void sample_frame(void*data, const char*function, const char*file, int line)
+{
+    profile_sample_frame((profile_t*)data, function, file, line);
+}
+
+static void backtrace_frame(void*data, const char*function, const char*file, int line)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)data;
+    qjs->backtrace = backtrace_add_frame(qjs->backtrace, function, file, line);
+}
+
+/* QuickJS doesn't let us walk the stack, but every error it throws
+   records it */
+static void sample_stack(qjs_internal_t*qjs)
+{
+    JS_ThrowInternalError(qjs->cx, "profile");
+    JSValue error = JS_GetException(qjs->cx);
+    const char*stack = NULL;
+    JSValue s = JS_GetPropertyStr(qjs->cx, error, "stack");
+    if(JS_IsString(s))
+        stack = JS_ToCString(qjs->cx, s);
+    profile_sample_begin(qjs->profile);
+    walk_stack_string(stack, sample_frame, qjs->profile);
+    profile_sample_end(qjs->profile);
+    if(stack)
+        JS_FreeCString(qjs->cx, stack);
+    JS_FreeValue(qjs->cx, s);
+    JS_FreeValue(qjs->cx, error);
+}
+
+/* reports the pending exception, and keeps its stack as backtrace */
+static void report_exception(qjs_internal_t*qjs, const char*what)
+{
+    JSContext*cx = qjs->cx;
+    JSValue error = JS_GetException(cx);
+    const char*message = qjs->abort_reason ? NULL : JS_ToCString(cx, error);
+    if(JS_IsError(cx, error)) {
+        JSValue s = JS_GetPropertyStr(cx, error, "stack");
+        const char*stack = JS_IsString(s) ? JS_ToCString(cx, s) : NULL;
+        if(stack) {
+            free(qjs->backtrace);
+            qjs->backtrace = NULL;
+            walk_stack_string(stack, backtrace_frame, qjs);
+            JS_FreeCString(cx, stack);
+        }
+        JS_FreeValue(cx, s);
+    }
+    language_error(qjs->li, "%s: %s\n", what, message ? message :
+                   (qjs->abort_reason ? qjs->abort_reason : "(unknown error)"));
+    if(message)
+        JS_FreeCString(cx, message);
+    JS_FreeValue(cx, error);
+}
+
+/* returning nonzero makes QuickJS throw an exception the script can't
+   catch */
+static int interrupt_handler(JSRuntime*rt, void*opaque)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)opaque;
+    language_t*li = qjs->li;
+    if(qjs->interrupted) {
+        qjs->interrupted = 0;
+        qjs->abort_reason = "interrupted";
+        return 1;
+    }
+    if(!li->ops_budget && !li->profile_interval)
+        return 0;
+    li->ops += OPS_PER_INTERRUPT;
+    if(profile_due(qjs->profile, li->ops)) {
+        sample_stack(qjs);
+    }
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        li->timeout = true;
+        qjs->abort_reason = "operation budget exceeded";
+        return 1;
+    }
+    return 0;
+}
+
+/* called before running any guest code */
+static void begin_operation(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    qjs->interrupted = 0;
+    li->timeout = false;
+    li->ops = 0;
+    free(qjs->backtrace);
+    qjs->backtrace = NULL;
+    qjs->abort_reason = NULL;
+    qjs->peak_heap = qjs->heap;
+    qjs->allocations = 0;
+    qjs->allocated_bytes = 0;
+    profile_start(qjs->profile, li->profile_interval);
+
+    /* QuickJS frees most garbage right away, by reference counting. For
+       GC_BETWEEN_CALLS, we only delay the cycle collector, which runs
+       once the heap has grown past the threshold. Every collection moves
+       the threshold, so this is set again for every operation. */
+    if(li->gc_policy == GC_BETWEEN_CALLS) {
+        JS_SetGCThreshold(qjs->rt, qjs->memory_limit / 2);
+        qjs->gc_suppressed = true;
+    } else if(qjs->gc_suppressed) {
+        JS_SetGCThreshold(qjs->rt, li->tuning.gc_malloc_bytes ? li->tuning.gc_malloc_bytes : DEFAULT_GC_THRESHOLD);
+        qjs->gc_suppressed = false;
+    }
+
+    /* stack overflow checks are relative to where the runtime was last
+       used, which might have been another thread */
+    JS_UpdateStackTop(qjs->rt);
+}
+
+static void interrupt_qjs(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    qjs->interrupted = 1;
+}
+
+/* INIT_PROFILE_MINIMAL leaves out Date, RegExp, Proxy, Map/Set, typed
+   arrays and Promise */
+static JSContext* new_context(qjs_internal_t*qjs, init_profile_t profile)
+{
+    JSContext*cx;
+    if(profile == INIT_PROFILE_MINIMAL) {
+        cx = JS_NewContextRaw(qjs->rt);
+        if(!cx)
+            return NULL;
+        JS_AddIntrinsicBaseObjects(cx);
+        JS_AddIntrinsicEval(cx);
+        JS_AddIntrinsicJSON(cx);
+    } else {
+        cx = JS_NewContext(qjs->rt);
+        if(!cx)
+            return NULL;
+    }
+    JS_SetContextOpaque(cx, qjs);
+    return cx;
+}
+
+static bool initialize_qjs(language_t*li, size_t mem_size)
+{
+    if(li->internal)
+        return true; //already initialized
+
+    li->internal = calloc(1, sizeof(qjs_internal_t));
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    qjs->li = li;
+    qjs->profile = profile_new();
+    qjs->memory_limit = mem_size;
+
+    log_dbg("[qjs] initializing: %dMB of memory", mem_size / 1048576);
+
+    qjs->rt = JS_NewRuntime2(&qjs_malloc_functions, qjs);
+    if(!qjs->rt)
+        return false;
+    li->version = runtime_version("QuickJS", (void*)JS_NewRuntime2);
+    JS_SetMemoryLimit(qjs->rt, mem_size);
+    if(li->tuning.gc_malloc_bytes)
+        JS_SetGCThreshold(qjs->rt, li->tuning.gc_malloc_bytes);
+    JS_SetInterruptHandler(qjs->rt, interrupt_handler, qjs);
+
+    qjs->cx = new_context(qjs, li->init_profile);
+    return qjs->cx != NULL;
+}
+
+/* A new context gets a new global object, in the same runtime. */
+static bool reset_qjs(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    JSContext*cx = new_context(qjs, li->init_profile);
+    if(!cx)
+        return false;
+    JS_FreeContext(qjs->cx);
+    qjs->cx = cx;
+    free(qjs->functions);
+    qjs->functions = NULL;
+    qjs->num_functions = 0;
+    free(qjs->backtrace);
+    qjs->backtrace = NULL;
+    JS_RunGC(qjs->rt);
+    return true;
+}
+
+typedef struct _qjs_frame {
+    JSValue obj;
+    uint32_t pos;
+    uint32_t length;
+    value_t*array;
+} qjs_frame_t;
+
+static value_t* jsvalue_to_value(qjs_internal_t*qjs, JSValueConst root_value)
+{
+    JSContext*cx = qjs->cx;
+    walk_stack_t stack;
+    walk_stack_init(&stack, sizeof(qjs_frame_t));
+    value_t*root = NULL;
+    /* array elements we fetch are ours to free, the root isn't */
+    JSValue v = JS_DupValue(cx, root_value);
+
+    while(1) {
+        value_t*value;
+        bool is_array = false;
+        uint32_t length = 0;
+        switch(JS_VALUE_GET_TAG(v)) {
+            case JS_TAG_NULL:
+            case JS_TAG_UNDEFINED:
+                value = value_new_void();
+            break;
+            case JS_TAG_INT:
+                value = value_new_int32(JS_VALUE_GET_INT(v));
+            break;
+            case JS_TAG_FLOAT64:
+                value = value_new_float32(JS_VALUE_GET_FLOAT64(v));
+            break;
+            case JS_TAG_BOOL:
+                value = value_new_boolean(JS_VALUE_GET_BOOL(v));
+            break;
+            case JS_TAG_STRING: {
+                const char*s = JS_ToCString(cx, v);
+                if(!s)
+                    goto error;
+                value = value_new_string(s);
+                JS_FreeCString(cx, s);
+            }
+            break;
+            default: {
+                if(!JS_IsArray(cx, v)) {
+                    language_error(qjs->li, "Can't convert javascript type to a value.\n");
+                    goto error;
+                }
+                JSValue l = JS_GetPropertyStr(cx, v, "length");
+                int ok = JS_ToUint32(cx, &length, l);
+                JS_FreeValue(cx, l);
+                if(ok < 0) {
+                    language_error(qjs->li, "Can't determine array length\n");
+                    goto error;
+                }
+                value = array_new_sized(length);
+                is_array = true;
+            }
+        }
+
+        qjs_frame_t*parent = walk_stack_top(&stack);
+        if(parent) {
+            array_append(parent->array, value);
+        } else {
+            root = value;
+        }
+        if(is_array) {
+            qjs_frame_t*frame = walk_stack_push(&stack);
+            frame->obj = v;
+            frame->pos = 0;
+            frame->length = length;
+            frame->array = value;
+        } else {
+            JS_FreeValue(cx, v);
+        }
+        v = JS_UNDEFINED;
+
+        /* fetch the next array element */
+        qjs_frame_t*frame;
+        while((frame = walk_stack_top(&stack))) {
+            if(frame->pos < frame->length) {
+                v = JS_GetPropertyUint32(cx, frame->obj, frame->pos++);
+                if(JS_IsException(v)) {
+                    language_error(qjs->li, "Can't retrieve array element\n");
+                    goto error;
+                }
+                break;
+            }
+            JS_FreeValue(cx, frame->obj);
+            walk_stack_pop(&stack);
+        }
+        if(!frame) {
+            walk_stack_destroy(&stack);
+            return root;
+        }
+    }
+
+error:
+    JS_FreeValue(cx, v);
+    qjs_frame_t*frame;
+    while((frame = walk_stack_top(&stack))) {
+        JS_FreeValue(cx, frame->obj);
+        walk_stack_pop(&stack);
+    }
+    walk_stack_destroy(&stack);
+    if(root)
+        value_destroy(root);
+    return NULL;
+}
+
+typedef struct _to_jsvalue_context {
+    JSContext*cx;
+    walk_stack_t stack;
+    JSValue root;
+} to_jsvalue_context_t;
+
+/* Arrays are stored into their parent as soon as they're created, so
+   the stack only holds borrowed references. */
+static bool to_jsvalue_visit(void*_context, value_t*value, int index)
+{
+    to_jsvalue_context_t*context = _context;
+    JSContext*cx = context->cx;
+    JSValue v;
+    switch(value->type) {
+        case TYPE_FLOAT32:
+            v = JS_NewFloat64(cx, value->f32);
+        break;
+        case TYPE_INT32:
+            v = JS_NewInt32(cx, value->i32);
+        break;
+        case TYPE_BOOLEAN:
+            v = JS_NewBool(cx, value->b);
+        break;
+        case TYPE_STRING:
+            v = JS_NewString(cx, value->str);
+        break;
+        case TYPE_ARRAY:
+            v = JS_NewArray(cx);
+        break;
+        default:
+            v = JS_NULL;
+    }
+    if(JS_IsException(v))
+        return false;
+
+    JSValue*parent = walk_stack_top(&context->stack);
+    if(parent) {
+        if(JS_SetPropertyUint32(cx, *parent, index, v) < 0)
+            return false;
+    } else {
+        context->root = v;
+    }
+    if(value->type == TYPE_ARRAY) {
+        *(JSValue*)walk_stack_push(&context->stack) = v;
+    }
+    return true;
+}
+
+static bool to_jsvalue_leave(void*_context, value_t*array)
+{
+    to_jsvalue_context_t*context = _context;
+    walk_stack_pop(&context->stack);
+    return true;
+}
+
+static JSValue value_to_jsvalue(JSContext*cx, value_t*value)
+{
+    static const value_visitor_t to_jsvalue_visitor = {to_jsvalue_visit, to_jsvalue_leave};
+    to_jsvalue_context_t context;
+    context.cx = cx;
+    context.root = JS_NULL;
+    walk_stack_init(&context.stack, sizeof(JSValue));
+    if(!value_walk(value, &to_jsvalue_visitor, &context)) {
+        JS_FreeValue(cx, context.root);
+        context.root = JS_NULL;
+    }
+    walk_stack_destroy(&context.stack);
+    return context.root;
+}
+
+static JSValue qjs_function_proxy(JSContext*cx, JSValueConst this_val, int argc, JSValueConst*argv, int magic)
+{
+    qjs_internal_t*qjs = JS_GetContextOpaque(cx);
+    if(magic < 0 || magic >= qjs->num_functions) {
+        return JS_ThrowInternalError(cx, "Internal error: unknown native function %d", magic);
+    }
+    function_t*f = qjs->functions[magic];
+
+    value_t*args = array_new();
+    int i;
+    for(i=0;i<argc;i++) {
+        value_t*arg = jsvalue_to_value(qjs, argv[i]);
+        if(!arg) {
+            value_destroy(args);
+            return JS_ThrowTypeError(cx, "Can't convert argument %d", i);
+        }
+        array_append(args, arg);
+    }
+    value_t*value = f->call(f, args);
+    value_destroy(args);
+    if(value == NULL) {
+        return JS_ThrowInternalError(cx, "Failed calling native function");
+    }
+
+    JSValue ret = value_to_jsvalue(cx, value);
+    value_destroy(value);
+    log_dbg("[qjs] callback successful");
+    return ret;
+}
+
+static void define_function_qjs(language_t*li, const char*name, function_t*f)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    qjs->functions = realloc(qjs->functions, sizeof(function_t*) * (qjs->num_functions + 1));
+    int magic = qjs->num_functions++;
+    qjs->functions[magic] = f;
+
+    JSValue global = JS_GetGlobalObject(qjs->cx);
+    JSValue func = JS_NewCFunctionMagic(qjs->cx, (JSCFunctionMagic*)qjs_function_proxy, name, 0, JS_CFUNC_generic_magic, magic);
+    JS_SetPropertyStr(qjs->cx, global, name, func);
+    JS_FreeValue(qjs->cx, global);
+}
+
+static void define_constant_qjs(language_t*li, const char*name, value_t*value)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    JSValue global = JS_GetGlobalObject(qjs->cx);
+    if(JS_SetPropertyStr(qjs->cx, global, name, value_to_jsvalue(qjs->cx, value)) < 0) {
+        language_error(li, "Couldn't define constant %s", name);
+    }
+    JS_FreeValue(qjs->cx, global);
+}
+
+static bool compile_script_qjs(language_t*li, const char*script)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    begin_operation(li);
+
+    log_dbg("[qjs] compiling script");
+    PROBE2(guest__compile__start, li->name, strlen(script));
+    JSValue ret = JS_Eval(qjs->cx, script, strlen(script), "__main__", JS_EVAL_TYPE_GLOBAL);
+    bool ok = !JS_IsException(ret);
+    PROBE2(guest__compile__done, li->name, ok);
+    if(!ok) {
+        report_exception(qjs, "Couldn't compile javascript program");
+    }
+    JS_FreeValue(qjs->cx, ret);
+    return ok;
+}
+
+static bool compile_to_bytecode_qjs(language_t*li, const char*script, void**data, int*len)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+
+    log_dbg("[qjs] compiling script to bytecode");
+    JSValue code = JS_Eval(qjs->cx, script, strlen(script), "__main__",
+                           JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+    if(JS_IsException(code)) {
+        report_exception(qjs, "Couldn't compile javascript program");
+        return false;
+    }
+    size_t size = 0;
+    uint8_t*buffer = JS_WriteObject(qjs->cx, &size, code, JS_WRITE_OBJ_BYTECODE);
+    JS_FreeValue(qjs->cx, code);
+    if(!buffer)
+        return false;
+    *data = memdup(buffer, size);
+    *len = size;
+    js_free(qjs->cx, buffer);
+    return true;
+}
+
+static bool load_bytecode_qjs(language_t*li, const void*data, int len)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    log_dbg("[qjs] loading %d bytes of bytecode", len);
+    begin_operation(li);
+
+    JSValue code = JS_ReadObject(qjs->cx, data, len, JS_READ_OBJ_BYTECODE);
+    if(JS_IsException(code)) {
+        report_exception(qjs, "invalid bytecode");
+        return false;
+    }
+
+    PROBE2(guest__compile__start, li->name, len);
+    /* takes over our reference to code */
+    JSValue ret = JS_EvalFunction(qjs->cx, code);
+    bool ok = !JS_IsException(ret);
+    PROBE2(guest__compile__done, li->name, ok);
+    if(!ok) {
+        report_exception(qjs, "Couldn't run javascript program");
+    }
+    JS_FreeValue(qjs->cx, ret);
+    return ok;
+}
+
+static bool is_function_qjs(language_t*li, const char*name)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    log_dbg("[qjs] is_function %s", name);
+    JSValue global = JS_GetGlobalObject(qjs->cx);
+    JSValue f = JS_GetPropertyStr(qjs->cx, global, name);
+    bool ret = JS_IsFunction(qjs->cx, f);
+    JS_FreeValue(qjs->cx, f);
+    JS_FreeValue(qjs->cx, global);
+    return ret;
+}
+
+static value_t* call_function_qjs(language_t*li, const char*name, value_t*_args)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    JSContext*cx = qjs->cx;
+    log_dbg("[qjs] calling function %s", name);
+    begin_operation(li);
+
+    JSValue global = JS_GetGlobalObject(cx);
+    JSValue f = JS_GetPropertyStr(cx, global, name);
+    if(!JS_IsFunction(cx, f)) {
+        language_error(li, "%s is not a function", name);
+        JS_FreeValue(cx, f);
+        JS_FreeValue(cx, global);
+        return NULL;
+    }
+
+    JSValue*args = malloc(sizeof(JSValue) * (_args->length + 1));
+    int i;
+    for(i=0;i<_args->length;i++) {
+        args[i] = value_to_jsvalue(cx, _args->data[i]);
+    }
+
+    PROBE2(guest__call__start, li->name, name);
+    JSValue ret = JS_Call(cx, f, global, _args->length, args);
+    PROBE3(guest__call__done, li->name, name, !JS_IsException(ret));
+
+    for(i=0;i<_args->length;i++) {
+        JS_FreeValue(cx, args[i]);
+    }
+    free(args);
+    JS_FreeValue(cx, f);
+    JS_FreeValue(cx, global);
+
+    if(JS_IsException(ret)) {
+        report_exception(qjs, "execution of function failed");
+        return NULL;
+    }
+    value_t*val = jsvalue_to_value(qjs, ret);
+    JS_FreeValue(cx, ret);
+    return val;
+}
+
+static bool collect_garbage_qjs(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    JS_RunGC(qjs->rt);
+    return true;
+}
+
+static bool get_stats_qjs(language_t*li, call_stats_t*stats)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    stats->allocations = qjs->allocations;
+    stats->allocated_bytes = qjs->allocated_bytes;
+    stats->peak_heap = qjs->peak_heap;
+    return true;
+}
+
+static char* get_backtrace_qjs(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    return qjs->backtrace ? strdup(qjs->backtrace) : NULL;
+}
+
+static char* get_profile_qjs(language_t*li)
+{
+    qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+    return profile_folded(qjs->profile);
+}
+
+static void destroy_qjs(language_t*li)
+{
+    if(li->internal) {
+        qjs_internal_t*qjs = (qjs_internal_t*)li->internal;
+        if(qjs->cx)
+            JS_FreeContext(qjs->cx);
+        if(qjs->rt)
+            JS_FreeRuntime(qjs->rt);
+        profile_destroy(qjs->profile);
+        free(qjs->functions);
+        free(qjs->backtrace);
+        free(qjs);
+    }
+    free(li->version);
+    free(li);
+}
+
+language_t* quickjs_interpreter_new()
+{
+    language_t * li = calloc(1, sizeof(language_t));
+    li->name = "qjs";
+    li->initialize = initialize_qjs;
+    li->compile_script = compile_script_qjs;
+    li->compile_to_bytecode = compile_to_bytecode_qjs;
+    li->load_bytecode = load_bytecode_qjs;
+    li->interrupt = interrupt_qjs;
+    li->get_profile = get_profile_qjs;
+    li->get_stats = get_stats_qjs;
+    li->get_backtrace = get_backtrace_qjs;
+    li->reset = reset_qjs;
+    li->collect_garbage = collect_garbage_qjs;
+    li->is_function = is_function_qjs;
+    li->call_function = call_function_qjs;
+    li->define_function = define_function_qjs;
+    li->define_constant = define_constant_qjs;
+    li->destroy = destroy_qjs;
+    return li;
+}
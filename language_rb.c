@@ -1,18 +1,68 @@
 #include <ruby.h>
 #include <stdbool.h>
 #include <string.h>
+#include <signal.h>
 #include "language.h"
+#include "probes.h"
+#include "profile.h"
 #include "dict.h"
 
 typedef struct _rb_internal {
     language_t*li;
     VALUE object;
     dict_t*functions;
+    profile_t*profile;
+    char*backtrace;
+    size_t heap_start;
+
+    /* top-level names that existed right after initialization, for
+       reset_rb() */
+    VALUE pristine_methods;
+    VALUE pristine_kernel_methods;
+    VALUE pristine_constants;
+    VALUE pristine_globals;
+
+    /* GC.count at the start of the current operation */
+    long gc_count_start;
 } rb_internal_t;
 
 static rb_internal_t*global;
 static int rb_reference_count = 0;
 
+/* Ruby's own handler for SIGUSR1, which makes the main thread raise
+   SignalException at its next interrupt check */
+static struct sigaction ruby_sigusr1;
+
+/* GC::Profiler, which times collections for get_stats_rb() */
+static VALUE gc_profiler = Qnil;
+static bool gc_disabled = false;
+
+static long gc_count()
+{
+    return NUM2LONG(rb_funcall(rb_const_get(rb_cObject, rb_intern("GC")), rb_intern("count"), 0));
+}
+
+/* top-level methods (guest code's "def" and our define_function()) end up
+   as instance methods of Object or Kernel */
+static VALUE own_methods(VALUE module)
+{
+    VALUE methods = rb_funcall(module, rb_intern("private_instance_methods"), 1, Qfalse);
+    return rb_ary_concat(methods, rb_funcall(module, rb_intern("public_instance_methods"), 1, Qfalse));
+}
+
+static VALUE added_since(VALUE now, VALUE before)
+{
+    return rb_funcall(now, rb_intern("-"), 1, before);
+}
+
+static void remove_all(VALUE module, const char*method, VALUE names)
+{
+    long i;
+    for(i=0;i<RARRAY_LEN(names);i++) {
+        rb_funcall(module, rb_intern(method), 1, rb_ary_entry(names, i));
+    }
+}
+
 static bool initialize_rb(language_t*li, size_t mem_size)
 {
     if(li->internal)
@@ -23,18 +73,159 @@ static bool initialize_rb(language_t*li, size_t mem_size)
     li->internal = calloc(1, sizeof(rb_internal_t));
     rb_internal_t*rb = (rb_internal_t*)li->internal;
     rb->li = li;
+    rb->profile = profile_new();
 
     if(rb_reference_count==0) {
         ruby_init();
+        sigaction(SIGUSR1, NULL, &ruby_sigusr1);
         global = rb;
     }
     rb_reference_count++;
 
     rb->object = rb_eval_string("Object");
 
+    rb->pristine_methods = own_methods(rb_cObject);
+    rb->pristine_kernel_methods = own_methods(rb_mKernel);
+    rb->pristine_constants = rb_funcall(rb_cObject, rb_intern("constants"), 0);
+    rb->pristine_globals = rb_funcall(rb_mKernel, rb_intern("global_variables"), 0);
+    rb_gc_register_address(&rb->pristine_methods);
+    rb_gc_register_address(&rb->pristine_kernel_methods);
+    rb_gc_register_address(&rb->pristine_constants);
+    rb_gc_register_address(&rb->pristine_globals);
+
+    gc_profiler = rb_const_get(rb_const_get(rb_cObject, rb_intern("GC")), rb_intern("Profiler"));
+    rb_gc_register_address(&gc_profiler);
+    rb_funcall(gc_profiler, rb_intern("enable"), 0);
     return true;
 }
 
+/* the interpreter whose guest code is currently counting operations */
+static language_t*counting = NULL;
+/* set while we call into ruby to look at the guest's stack. The event
+   hook ignores (and doesn't count) those calls. */
+static bool inspecting = false;
+
+/* entries of Kernel#caller and Exception#backtrace look like
+   "file:line:in `method'" */
+static const char* parse_backtrace_entry(VALUE entry, char*location, int size, int*line)
+{
+    int len = RSTRING_LEN(entry) < size ? RSTRING_LEN(entry) : size - 1;
+    memcpy(location, RSTRING_PTR(entry), len);
+    location[len] = 0;
+
+    const char*method = "(main)";
+    char*in = strstr(location, ":in `");
+    if(in) {
+        *in = 0;
+        method = in + 5;
+        char*quote = strrchr(method, '\'');
+        if(quote)
+            *quote = 0;
+    }
+    *line = 0;
+    char*colon = strrchr(location, ':');
+    if(colon) {
+        *colon = 0;
+        *line = atoi(colon + 1);
+    }
+    return method;
+}
+
+static void sample_stack(profile_t*profile)
+{
+    inspecting = true;
+    volatile VALUE backtrace = rb_funcall(rb_mKernel, rb_intern("caller"), 1, INT2FIX(0));
+    inspecting = false;
+
+    profile_sample_begin(profile);
+    long i;
+    for(i=0;i<RARRAY_LEN(backtrace);i++) {
+        char location[256];
+        int line;
+        const char*method = parse_backtrace_entry(RARRAY_PTR(backtrace)[i], location, sizeof(location), &line);
+        profile_sample_frame(profile, method, location, line);
+    }
+    profile_sample_end(profile);
+}
+
+static void capture_backtrace(rb_internal_t*rb, VALUE exception)
+{
+    free(rb->backtrace);
+    rb->backtrace = NULL;
+    inspecting = true;
+    volatile VALUE backtrace = rb_funcall(exception, rb_intern("backtrace"), 0);
+    inspecting = false;
+    if(TYPE(backtrace) != T_ARRAY)
+        return;
+    long i;
+    for(i=0;i<RARRAY_LEN(backtrace);i++) {
+        char location[256];
+        int line;
+        const char*method = parse_backtrace_entry(RARRAY_PTR(backtrace)[i], location, sizeof(location), &line);
+        rb->backtrace = backtrace_add_frame(rb->backtrace, method, location, line);
+    }
+}
+
+/* every executed line, and every method call, counts as one operation */
+static void count_ops(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass)
+{
+    language_t*li = counting;
+    if(!li || inspecting)
+        return;
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    ++li->ops;
+    if(profile_due(rb->profile, li->ops)) {
+        sample_stack(rb->profile);
+    }
+    if(li->ops_budget && li->ops > li->ops_budget) {
+        li->timeout = true;
+        rb_raise(rb_eInterrupt, "operation budget exceeded");
+    }
+}
+
+/* called before running any guest code */
+static void begin_operation(language_t*li)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    li->timeout = false;
+    li->ops = 0;
+    free(rb->backtrace);
+    rb->backtrace = NULL;
+    rb->heap_start = heap_in_use();
+    profile_start(rb->profile, li->profile_interval);
+    if(counting) {
+        rb_remove_event_hook(count_ops);
+        counting = NULL;
+    }
+    if(li->ops_budget || li->profile_interval) {
+        counting = li;
+        rb_add_event_hook(count_ops, RUBY_EVENT_LINE | RUBY_EVENT_CALL | RUBY_EVENT_C_CALL, Qnil);
+    }
+    bool disable_gc = li->gc_policy == GC_BETWEEN_CALLS;
+    if(disable_gc != gc_disabled) {
+        if(disable_gc)
+            rb_gc_disable();
+        else
+            rb_gc_enable();
+        gc_disabled = disable_gc;
+    }
+    rb->gc_count_start = gc_count();
+    if(gc_profiler != Qnil)
+        rb_funcall(gc_profiler, rb_intern("clear"), 0);
+}
+
+static void interrupt_rb(language_t*li)
+{
+    if(ruby_sigusr1.sa_flags & SA_SIGINFO) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        info.si_signo = SIGUSR1;
+        ruby_sigusr1.sa_sigaction(SIGUSR1, &info, NULL);
+    } else if(ruby_sigusr1.sa_handler != SIG_DFL && ruby_sigusr1.sa_handler != SIG_IGN) {
+        ruby_sigusr1.sa_handler(SIGUSR1);
+    }
+}
+
 static void rb_report_error(VALUE error)
 {
     volatile VALUE message = rb_obj_as_string(error);
@@ -45,76 +236,152 @@ static void rb_report_error(VALUE error)
     }
 }
 
+typedef struct _rb_frame {
+    VALUE ary;
+    long pos;
+    value_t*array;
+} rb_frame_t;
+
 static value_t* ruby_to_value(VALUE v)
 {
-  switch (TYPE(v)) {
-    case T_NIL:
-      return value_new_void();
-    case T_BIGNUM:
-    case T_FIXNUM:
-      return value_new_int32(NUM2INT(v));
-    case T_TRUE:
-      return value_new_boolean(true);
-    case T_FALSE:
-      return value_new_boolean(false);
-    case T_FLOAT:
-      return value_new_float32(NUM2DBL(v));
-    case T_SYMBOL:
-      return value_new_string(rb_id2name(SYM2ID(v)));
-    case T_STRING:
-      return value_new_string(StringValuePtr(v));
-    case T_ARRAY: {
-      /* process Array */
-      value_t*array = array_new();
-      int len = RARRAY(v)->as.heap.len;
-      int i;
-      for(i=0;i<len;i++) {
-          volatile VALUE item = RARRAY(v)->as.heap.ptr[i];
-          array_append(array, ruby_to_value(item));
+  walk_stack_t stack;
+  walk_stack_init(&stack, sizeof(rb_frame_t));
+  value_t*root = NULL;
+
+  while(1) {
+    value_t*value;
+    switch (TYPE(v)) {
+      case T_NIL:
+        value = value_new_void();
+      break;
+      case T_BIGNUM:
+      case T_FIXNUM:
+        value = value_new_int32(NUM2INT(v));
+      break;
+      case T_TRUE:
+        value = value_new_boolean(true);
+      break;
+      case T_FALSE:
+        value = value_new_boolean(false);
+      break;
+      case T_FLOAT:
+        value = value_new_float32(NUM2DBL(v));
+      break;
+      case T_SYMBOL:
+        value = value_new_string(rb_id2name(SYM2ID(v)));
+      break;
+      case T_STRING:
+        value = value_new_string(StringValuePtr(v));
+      break;
+      case T_ARRAY:
+        value = array_new();
+      break;
+      default:
+        walk_stack_destroy(&stack);
+        if(root)
+          value_destroy(root);
+        /* raise exception */
+        rb_raise(rb_eTypeError, "not valid value");
+    }
+
+    rb_frame_t*parent = walk_stack_top(&stack);
+    if(parent) {
+      array_append(parent->array, value);
+    } else {
+      root = value;
+    }
+    if(TYPE(v) == T_ARRAY) {
+      rb_frame_t*frame = walk_stack_push(&stack);
+      frame->ary = v;
+      frame->pos = 0;
+      frame->array = value;
+    }
+
+    /* process Array */
+    rb_frame_t*frame;
+    while((frame = walk_stack_top(&stack))) {
+      if(frame->pos < RARRAY_LEN(frame->ary)) {
+        v = RARRAY_PTR(frame->ary)[frame->pos++];
+        break;
       }
-      return array;
+      walk_stack_pop(&stack);
+    }
+    if(!frame) {
+      walk_stack_destroy(&stack);
+      return root;
     }
-    default:
-      /* raise exception */
-      rb_raise(rb_eTypeError, "not valid value");
   }
 }
 
-static VALUE value_to_ruby(value_t*v)
+typedef struct _to_ruby_context {
+    walk_stack_t stack;
+    VALUE root;
+} to_ruby_context_t;
+
+static bool to_ruby_visit(void*_context, value_t*v, int index)
 {
+    to_ruby_context_t*context = _context;
+    volatile VALUE r;
     switch(v->type) {
         case TYPE_VOID:
-            return Qnil;
+            r = Qnil;
         break;
         case TYPE_FLOAT32:
-            return rb_float_new(v->f32);
+            r = rb_float_new(v->f32);
         break;
         case TYPE_INT32:
-            return INT2FIX(v->i32);
+            r = INT2FIX(v->i32);
         break;
         case TYPE_BOOLEAN:
             if(v->b) {
-                return Qtrue;
+                r = Qtrue;
             } else {
-                return Qfalse;
+                r = Qfalse;
             }
         break;
         case TYPE_STRING: {
-            return rb_str_new2(v->str);
+            r = rb_str_new2(v->str);
         }
         break;
         case TYPE_ARRAY: {
-            volatile VALUE a = rb_ary_new2(v->length);
-            int i;
-            for(i=0;i<v->length;i++) {
-                rb_ary_store(a, i, value_to_ruby(v->data[i]));
-            }
-            return a;
+            r = rb_ary_new2(v->length);
         }
         break;
         default:
-            return Qnil;
+            r = Qnil;
+    }
+
+    /* arrays are stored in their parent right away, so everything
+       stays reachable from the root */
+    VALUE*parent = walk_stack_top(&context->stack);
+    if(parent) {
+        rb_ary_store(*parent, index, r);
+    } else {
+        context->root = r;
+    }
+    if(v->type == TYPE_ARRAY) {
+        *(VALUE*)walk_stack_push(&context->stack) = r;
     }
+    return true;
+}
+
+static bool to_ruby_leave(void*_context, value_t*array)
+{
+    to_ruby_context_t*context = _context;
+    walk_stack_pop(&context->stack);
+    return true;
+}
+
+static VALUE value_to_ruby(value_t*v)
+{
+    static const value_visitor_t to_ruby_visitor = {to_ruby_visit, to_ruby_leave};
+    to_ruby_context_t context;
+    context.root = Qnil;
+    walk_stack_init(&context.stack, sizeof(VALUE));
+    value_walk(v, &to_ruby_visitor, &context);
+    walk_stack_destroy(&context.stack);
+    volatile VALUE root = context.root;
+    return root;
 }
 
 typedef struct _ruby_dfunc {
@@ -137,6 +404,7 @@ static VALUE compile_script_internal(VALUE _dfunc)
 static VALUE compile_script_exception(VALUE _dfunc, VALUE exc)
 {
     ruby_dfunc_t*dfunc = (ruby_dfunc_t*)_dfunc;
+    capture_backtrace((rb_internal_t*)dfunc->li->internal, exc);
     rb_report_error(exc);
     dfunc->fail = true;
     return Qfalse;
@@ -145,11 +413,14 @@ static VALUE compile_script_exception(VALUE _dfunc, VALUE exc)
 static bool compile_script_rb(language_t*li, const char*script)
 {
     log_dbg("[ruby] compile_script");
+    begin_operation(li);
     ruby_dfunc_t dfunc;
     dfunc.li = li;
     dfunc.script = script;
     dfunc.fail = false;
+    PROBE2(guest__compile__start, li->name, strlen(script));
     volatile VALUE ret = rb_rescue2(compile_script_internal, (VALUE)&dfunc, compile_script_exception, (VALUE)&dfunc, rb_eException, (VALUE)0);
+    PROBE2(guest__compile__done, li->name, !dfunc.fail);
     return !dfunc.fail;
 }
 
@@ -157,6 +428,12 @@ static VALUE ruby_function_proxy(VALUE self, VALUE _args)
 {
     ID id = rb_frame_this_func();
 
+    /* reset_rb() drops the functions, but the guest can still hold on to
+       a method object */
+    if(!global->functions) {
+        rb_raise(rb_eNameError, "%s was removed by a reset", rb_id2name(id));
+    }
+
     value_t* value = dict_lookup(global->functions, (void*)id);
 
     if(!value) {
@@ -244,19 +521,23 @@ static VALUE call_function_exception(VALUE _fcall, VALUE exc)
 {
     log_dbg("[rb] call_function_exception");
     ruby_fcall_t*fcall = (ruby_fcall_t*)_fcall;
+    capture_backtrace((rb_internal_t*)fcall->li->internal, exc);
     rb_report_error(exc);
     fcall->fail = true;
 }
 static value_t* call_function_rb(language_t*li, const char*name, value_t*args)
 {
     log_dbg("[ruby] calling function %s", name);
+    begin_operation(li);
     ruby_fcall_t fcall;
     fcall.li = li;
     fcall.fail = false;
     fcall.args = args;
     fcall.function_name = name;
 
-    volatile VALUE ret = rb_rescue(call_function_internal, (VALUE)&fcall, call_function_exception, (VALUE)&fcall);
+    PROBE2(guest__call__start, li->name, name);
+    volatile VALUE ret = rb_rescue2(call_function_internal, (VALUE)&fcall, call_function_exception, (VALUE)&fcall, rb_eStandardError, rb_eSignal, (VALUE)0);
+    PROBE3(guest__call__done, li->name, name, !fcall.fail);
 
     if(fcall.fail) {
         return NULL;
@@ -265,6 +546,79 @@ static value_t* call_function_rb(language_t*li, const char*name, value_t*args)
     }
 }
 
+/* object slots and strings both live on the malloc() heap */
+static bool get_stats_rb(language_t*li, call_stats_t*stats)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    size_t heap = heap_in_use();
+    stats->allocated_bytes = heap > rb->heap_start ? heap - rb->heap_start : 0;
+    stats->peak_heap = heap > rb->heap_start ? heap : rb->heap_start;
+    stats->gc_collections = gc_count() - rb->gc_count_start;
+    if(gc_profiler != Qnil)
+        stats->gc_time = NUM2DBL(rb_funcall(gc_profiler, rb_intern("total_time"), 0));
+    return true;
+}
+
+/* rb_gc() does nothing while the collector is disabled */
+static bool collect_garbage_rb(language_t*li)
+{
+    if(gc_disabled)
+        rb_gc_enable();
+    rb_gc();
+    if(gc_disabled)
+        rb_gc_disable();
+    return true;
+}
+
+static char* get_backtrace_rb(language_t*li)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    return rb->backtrace ? strdup(rb->backtrace) : NULL;
+}
+
+static char* get_profile_rb(language_t*li)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    return profile_folded(rb->profile);
+}
+
+static VALUE reset_internal(VALUE _rb)
+{
+    rb_internal_t*rb = (rb_internal_t*)_rb;
+    remove_all(rb_cObject, "remove_method", added_since(own_methods(rb_cObject), rb->pristine_methods));
+    remove_all(rb_mKernel, "remove_method", added_since(own_methods(rb_mKernel), rb->pristine_kernel_methods));
+    remove_all(rb_cObject, "remove_const", added_since(rb_funcall(rb_cObject, rb_intern("constants"), 0), rb->pristine_constants));
+
+    /* global variables can't be removed */
+    VALUE globals = added_since(rb_funcall(rb_mKernel, rb_intern("global_variables"), 0), rb->pristine_globals);
+    long i;
+    for(i=0;i<RARRAY_LEN(globals);i++) {
+        rb_gv_set(rb_id2name(SYM2ID(rb_ary_entry(globals, i))), Qnil);
+    }
+    return Qtrue;
+}
+
+static VALUE reset_exception(VALUE _rb, VALUE exc)
+{
+    rb_report_error(exc);
+    return Qfalse;
+}
+
+/* Ruby has a single interpreter per process, so this resets all of them */
+static bool reset_rb(language_t*li)
+{
+    rb_internal_t*rb = (rb_internal_t*)li->internal;
+    volatile VALUE ret = rb_rescue2(reset_internal, (VALUE)rb, reset_exception, (VALUE)rb, rb_eException, (VALUE)0);
+    if(global->functions) {
+        dict_destroy_shallow(global->functions);
+        global->functions = NULL;
+    }
+    free(rb->backtrace);
+    rb->backtrace = NULL;
+    collect_garbage_rb(li);
+    return ret == Qtrue;
+}
+
 static void destroy_rb(language_t* li)
 {
     if(li->internal) {
@@ -272,6 +626,8 @@ static void destroy_rb(language_t* li)
         if(--rb_reference_count == 0) {
             ruby_finalize();
         }
+        profile_destroy(rb->profile);
+        free(rb->backtrace);
         free(rb);
     }
     free(li);
@@ -287,6 +643,12 @@ language_t* ruby_interpreter_new()
     li->define_constant = define_constant_rb;
     li->define_function = define_function_rb;
     li->call_function = call_function_rb;
+    li->interrupt = interrupt_rb;
+    li->get_profile = get_profile_rb;
+    li->get_stats = get_stats_rb;
+    li->get_backtrace = get_backtrace_rb;
+    li->reset = reset_rb;
+    li->collect_garbage = collect_garbage_rb;
     li->destroy = destroy_rb;
     return li;
 }
@@ -0,0 +1,35 @@
+#ifndef __probes_h__
+#define __probes_h__
+
+/* USDT (statically defined tracing) probes, for perf, bpftrace and
+   systemtap. Each probe is a single nop unless a tracer is attached.
+   Without <sys/sdt.h>, or with -DNO_PROBES, they compile to nothing.
+
+   List them with e.g.
+       bpftrace -l 'usdt:./libcagekeeper.so:cagekeeper:*'
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE(name) DTRACE_PROBE(cagekeeper, name)
+#define PROBE1(name,a) DTRACE_PROBE1(cagekeeper, name, a)
+#define PROBE2(name,a,b) DTRACE_PROBE2(cagekeeper, name, a, b)
+#define PROBE3(name,a,b,c) DTRACE_PROBE3(cagekeeper, name, a, b, c)
+#define PROBE4(name,a,b,c,d) DTRACE_PROBE4(cagekeeper, name, a, b, c, d)
+#define PROBE5(name,a,b,c,d,e) DTRACE_PROBE5(cagekeeper, name, a, b, c, d, e)
+#else
+#define PROBE(name)
+#define PROBE1(name,a)
+#define PROBE2(name,a,b)
+#define PROBE3(name,a,b,c)
+#define PROBE4(name,a,b,c,d)
+#define PROBE5(name,a,b,c,d,e)
+#endif
+
+#endif //__probes_h__
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "profile.h"
+#include "dict.h"
+
+struct _profile {
+    /* stack -> uint64_t* count */
+    dict_t*stacks;
+    uint64_t interval;
+    uint64_t next_sample;
+
+    char*frames[PROFILE_MAX_DEPTH];
+    int depth;
+    bool truncated;
+};
+
+profile_t* profile_new()
+{
+    profile_t*profile = calloc(1, sizeof(profile_t));
+    profile->stacks = dict_new(&charptr_type);
+    return profile;
+}
+
+void profile_start(profile_t*profile, uint64_t interval)
+{
+    profile->interval = interval;
+    profile->next_sample = interval;
+}
+
+bool profile_due(profile_t*profile, uint64_t ops)
+{
+    if(!profile->interval || ops < profile->next_sample)
+        return false;
+    /* if the hook fires less often than the interval, skip the missed
+       samples rather than counting this one several times */
+    profile->next_sample = (ops / profile->interval + 1) * profile->interval;
+    return true;
+}
+
+void profile_sample_begin(profile_t*profile)
+{
+    profile->depth = 0;
+    profile->truncated = false;
+}
+
+static void format_frame(char*buffer, int size, const char*function, const char*file, int line)
+{
+    if(file && line > 0) {
+        snprintf(buffer, size, "%s (%s:%d)", function ? function : "?", file, line);
+    } else {
+        snprintf(buffer, size, "%s", function ? function : "?");
+    }
+    /* ';' separates frames, and newlines separate stacks */
+    char*p;
+    for(p=buffer;*p;p++) {
+        if(*p == ';' || *p == '\n' || *p == '\r')
+            *p = '_';
+    }
+}
+
+void profile_sample_frame(profile_t*profile, const char*function, const char*file, int line)
+{
+    if(profile->depth == PROFILE_MAX_DEPTH) {
+        profile->truncated = true;
+        return;
+    }
+    char buffer[256];
+    format_frame(buffer, sizeof(buffer), function, file, line);
+    profile->frames[profile->depth++] = strdup(buffer);
+}
+
+void profile_sample_end(profile_t*profile)
+{
+    int i;
+    int len = profile->truncated ? 4 : 0;
+    for(i=0;i<profile->depth;i++) {
+        len += strlen(profile->frames[i]) + 1;
+    }
+    char*stack = malloc(len + 1);
+    char*p = stack;
+    if(profile->truncated) {
+        strcpy(p, "...;");
+        p += 4;
+    }
+    for(i=profile->depth-1;i>=0;i--) {
+        int l = strlen(profile->frames[i]);
+        memcpy(p, profile->frames[i], l);
+        p += l;
+        if(i)
+            *p++ = ';';
+        free(profile->frames[i]);
+    }
+    *p = 0;
+    profile->depth = 0;
+
+    uint64_t*count = dict_lookup(profile->stacks, stack);
+    if(!count) {
+        count = calloc(1, sizeof(uint64_t));
+        dict_put(profile->stacks, stack, count);
+    }
+    (*count)++;
+    free(stack);
+}
+
+char* profile_folded(profile_t*profile)
+{
+    char*result = NULL;
+    size_t size = 0;
+    FILE*fi = open_memstream(&result, &size);
+    DICT_ITERATE_ITEMS(profile->stacks, const char*, stack, uint64_t*, count) {
+        fprintf(fi, "%s %llu\n", stack, (unsigned long long)*count);
+    }
+    fclose(fi);
+
+    dict_destroy_with_data(profile->stacks);
+    profile->stacks = dict_new(&charptr_type);
+    return result;
+}
+
+void profile_destroy(profile_t*profile)
+{
+    if(!profile)
+        return;
+    dict_destroy_with_data(profile->stacks);
+    free(profile);
+}
+
+char* backtrace_add_frame(char*backtrace, const char*function, const char*file, int line)
+{
+    int len = backtrace ? strlen(backtrace) : 0;
+    if(len >= BACKTRACE_MAX_SIZE) {
+        /* deep recursion. We keep the innermost frames. */
+        return backtrace;
+    }
+    char buffer[256];
+    format_frame(buffer, sizeof(buffer), function, file, line);
+    int l = strlen(buffer);
+    backtrace = realloc(backtrace, len + l + 2);
+    memcpy(backtrace + len, buffer, l);
+    backtrace[len + l] = '\n';
+    backtrace[len + l + 1] = 0;
+    return backtrace;
+}
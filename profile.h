@@ -0,0 +1,42 @@
+#ifndef __profile_h__
+#define __profile_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Aggregates samples of guest call stacks, for the language backends'
+   get_profile(). Samples are taken from the operation counting hooks,
+   every language_t.profile_interval operations. */
+
+#define PROFILE_MAX_DEPTH 64
+
+typedef struct _profile profile_t;
+
+profile_t* profile_new();
+
+/* called at the start of every operation (when ops is reset) */
+void profile_start(profile_t*profile, uint64_t interval);
+
+/* true if a sample should be taken now */
+bool profile_due(profile_t*profile, uint64_t ops);
+
+/* builds a sample. Frames are passed innermost first. */
+void profile_sample_begin(profile_t*profile);
+void profile_sample_frame(profile_t*profile, const char*function, const char*file, int line);
+void profile_sample_end(profile_t*profile);
+
+/* returns all samples in folded stack format ("outer;inner count" lines,
+   as read by flamegraph.pl), and clears them. Free with free(). */
+char* profile_folded(profile_t*profile);
+
+void profile_destroy(profile_t*profile);
+
+/* Backtraces, for get_backtrace(), are built from the same frames: one per
+   line, innermost first. backtrace_add_frame() appends a frame to a
+   malloc()ed backtrace (which may be NULL) and returns the new one. */
+
+#define BACKTRACE_MAX_SIZE 8192
+
+char* backtrace_add_frame(char*backtrace, const char*function, const char*file, int line);
+
+#endif
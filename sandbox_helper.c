@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "language.h"
+#include "settings.h"
+
+/* cagekeeper-sandbox: a sandbox process that doesn't start as a copy of
+   the host. When config_sandbox_helper points to this binary, the proxy
+   posix_spawn()s it with the pipes on fds 3 and 4, and it does what the
+   forked child would do: initialize the interpreter, lock down, and serve
+   commands. */
+
+void proxy_serve(language_t*language);
+
+int main(int argn, char*argv[])
+{
+    init_profile_t profile = INIT_PROFILE_FULL;
+    language_tuning_t tuning;
+    memset(&tuning, 0, sizeof(tuning));
+    int c;
+    while((c = getopt(argn, argv, "m:p:i:t:")) != -1) {
+        switch(c) {
+            case 'm':
+                config_maxmem = atoi(optarg);
+                break;
+            case 'p':
+                config_plugin_dir = optarg;
+                break;
+            case 'i':
+                profile = strcmp(optarg, "minimal") ? INIT_PROFILE_FULL : INIT_PROFILE_MINIMAL;
+                break;
+            case 't':
+                if(!language_tuning_parse(&tuning, optarg)) {
+                    fprintf(stderr, "%s: invalid tuning: %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m maxmem] [-p plugin_dir] [-i full|minimal] [-t tuning] language\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argn) {
+        fprintf(stderr, "Usage: %s [-m maxmem] [-p plugin_dir] [-i full|minimal] [-t tuning] language\n", argv[0]);
+        return 1;
+    }
+
+    language_t*li = raw_interpreter_by_name(argv[optind]);
+    if(!li) {
+        fprintf(stderr, "%s: can't create interpreter for %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+    li->init_profile = profile;
+    li->tuning = tuning;
+    proxy_serve(li);
+    return 0;
+}
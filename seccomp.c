@@ -21,6 +21,7 @@
 
 #include "settings.h"
 #include "util.h"
+#include "probes.h"
 
 #define CATCH_SIGNALS
 //#define HIJACK_SYSCALLS
@@ -232,10 +233,57 @@ static void handle_signal(int signal, siginfo_t*siginfo, void*ucontext)
 static struct sigaction sig;
 #endif
 
+static void (*crash_handler)(int signal) = NULL;
+
+static void handle_crash(int signal)
+{
+    crash_handler(signal);
+    _exit(128 + signal);
+}
+
+void seccomp_set_crash_handler(void (*handler)(int signal))
+{
+    crash_handler = handler;
+}
+
+static void install_crash_handler()
+{
+    /* on a separate stack, so that we can report stack overflows, too */
+    static char crash_stack[65536];
+    stack_t ss;
+    ss.ss_sp = crash_stack;
+    ss.ss_size = sizeof(crash_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_crash;
+    sa.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    int i;
+    for(i=0;i<sizeof(signals)/sizeof(signals[0]);i++) {
+        sigaction(signals[i], &sa, NULL);
+    }
+}
+
+static bool allow_mprotect = false;
+
+void seccomp_allow_mprotect()
+{
+    allow_mprotect = true;
+}
+
 void seccomp_lockdown()
 {
+    PROBE(lockdown);
     setenv("MALLOC_CHECK_", "0", 1);
 
+    if(crash_handler) {
+        install_crash_handler();
+    }
+
 #ifdef CATCH_SIGNALS
     sig.sa_sigaction = handle_signal;
     sig.sa_flags = SA_SIGINFO;
@@ -267,6 +315,13 @@ void seccomp_lockdown()
 
         ALLOW_ANYARGS(__NR_gettimeofday),
         ALLOW_ANYARGS(__NR_time),
+        /* stats_now() and the garbage collection timing run in here, too.
+           Usually the vDSO answers these, but not for every clock. */
+        ALLOW_ANYARGS(__NR_clock_gettime),
+#ifdef __NR_clock_gettime64
+        ALLOW_ANYARGS(__NR_clock_gettime64),
+#endif
+        ALLOW_ANYARGS(__NR_getrusage),
         ALLOW_ANYARGS(__NR_read),
         ALLOW_ANYARGS(__NR_readv),
         ALLOW_ANYARGS(__NR_write),
@@ -276,7 +331,12 @@ void seccomp_lockdown()
         ALLOW_ANYARGS(__NR_munmap),
         ALLOW_ANYARGS(__NR_futex),
         ALLOW_ANYARGS(__NR_sigprocmask),
+        ALLOW_ANYARGS(__NR_sigreturn),
+        ALLOW_ANYARGS(__NR_rt_sigreturn),
         ALLOW_ANYARGS(__NR_exit),
+        /* mmap2() can already map executable memory, so this doesn't give
+           the guest anything new. Without it, the rule just repeats exit. */
+        ALLOW_ANYARGS(allow_mprotect ? __NR_mprotect : __NR_exit),
 
         {code: BPF_RET+BPF_K,         jt: 0, jf: 0, k: SECCOMP_RET_ERRNO | 1},
     };
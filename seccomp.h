@@ -4,5 +4,12 @@
 /* logging function, writes directly to fd 1 using a system call */
 void stdout_printf(const char*format, ...);
 
+/* called (in the sandbox) when the guest crashes, before the process exits */
+void seccomp_set_crash_handler(void (*handler)(int signal));
+
+/* also allow mprotect() after lockdown, for JITs that keep their code
+   write protected while it runs */
+void seccomp_allow_mprotect();
+
 void seccomp_lockdown();
 #endif
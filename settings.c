@@ -1,4 +1,13 @@
+#include <stddef.h>
 #include "settings.h"
 
 int config_maxmem = 128 * 1048576;
 int config_maxtime = 10;
+bool config_compile_cache = true;
+const char*config_compile_cache_dir = NULL;
+int config_compile_cache_size = 64 * 1048576;
+int config_interrupt_grace_ms = 1000;
+const char*config_journal_dir = NULL;
+int config_journal_events = 65536;
+const char*config_sandbox_helper = NULL;
+const char*config_plugin_dir = NULL;
@@ -5,5 +5,13 @@
 
 extern int config_maxmem;
 extern int config_maxtime;
+extern bool config_compile_cache;
+extern const char*config_compile_cache_dir;
+extern int config_compile_cache_size;
+extern int config_interrupt_grace_ms;
+extern const char*config_journal_dir;
+extern int config_journal_events;
+extern const char*config_sandbox_helper;
+extern const char*config_plugin_dir;
 
 #endif
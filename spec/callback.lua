@@ -26,6 +26,8 @@ function test()
     assert(fadd3(3.0,4.0,-5.0) == 2.0)
 
     assert(concat_strings("foo", "bar") == "foobar")
+    -- strings that look like numbers stay strings
+    assert(concat_strings("1", "2.") == "12.")
 
     a1 = {}
     a2 = {}
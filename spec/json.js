@@ -0,0 +1,39 @@
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function test() {
+    var valid = [
+        ['"a\\"b\\\\c\\/d\\n\\tA"', '"a\\"b\\\\c/d\\n\\tA"'],
+        ['"\\u00e9"', '"\\xc3\\xa9"'],
+        ['"\\ud83d\\ude00"', '"\\xf0\\x9f\\x98\\x80"'],
+        ['"\\ud83dx"', '"\\xef\\xbf\\xbdx"'],
+        ['"\\ude00"', '"\\xef\\xbf\\xbd"'],
+        ['2147483647', '2147483647'],
+        ['-2147483648', '-2147483648'],
+        ['2147483648', '2.14748365e+09'],
+        ['1.5', '1.5'],
+        ['-0.25e1', '-2.5'],
+        ['1E2', '100'],
+        [' [ 1 , true , false , null ] ', '[1,true,false,null]'],
+        ['{"a":1,"b":[{}]}', '[["a",1],["b",[[]]]]'],
+    ];
+    for(var i=0;i<valid.length;i++) {
+        assert(json_roundtrip(valid[i][0]) == valid[i][1]);
+    }
+
+    var invalid = ['1.', '1.e5', '.5', '01', '-', '1e', '1e+', '+1', '[1,]', '[1 2]',
+                   '{"a" 1}', '{1:2}', '{"a":1,}', '"abc', '"\\x"', '"\\u12"', '"a\tb"',
+                   'tru', 'nul', '[', ']', '', '1 2', '[1]x'];
+    for(var i=0;i<invalid.length;i++) {
+        assert(json_roundtrip(invalid[i]) == "error");
+    }
+
+    // strings a sandboxed guest passes to the host are limited to 4096 bytes
+    var deep = new Array(2001).join("[") + new Array(2001).join("]");
+    assert(json_roundtrip(deep) == deep);
+    assert(json_roundtrip(deep.substr(1)) == "error");
+    return "ok";
+}
@@ -0,0 +1,30 @@
+def test():
+    valid = [
+        (r'"a\"b\\c\/d\n\tA"', r'"a\"b\\c/d\n\tA"'),
+        (r'"\u00e9"', r'"\xc3\xa9"'),
+        (r'"\ud83d\ude00"', r'"\xf0\x9f\x98\x80"'),
+        (r'"\ud83dx"', r'"\xef\xbf\xbdx"'),
+        (r'"\ude00"', r'"\xef\xbf\xbd"'),
+        ('2147483647', '2147483647'),
+        ('-2147483648', '-2147483648'),
+        ('2147483648', '2.14748365e+09'),
+        ('1.5', '1.5'),
+        ('-0.25e1', '-2.5'),
+        ('1E2', '100'),
+        (' [ 1 , true , false , null ] ', '[1,true,false,null]'),
+        ('{"a":1,"b":[{}]}', '[["a",1],["b",[[]]]]'),
+    ]
+    for json, expected in valid:
+        assert(json_roundtrip(json) == expected)
+
+    invalid = ['1.', '1.e5', '.5', '01', '-', '1e', '1e+', '+1', '[1,]', '[1 2]',
+               '{"a" 1}', '{1:2}', '{"a":1,}', '"abc', r'"\x"', r'"\u12"', '"a\tb"',
+               'tru', 'nul', '[', ']', '', '1 2', '[1]x']
+    for json in invalid:
+        assert(json_roundtrip(json) == "error")
+
+    # strings a sandboxed guest passes to the host are limited to 4096 bytes
+    deep = "[" * 2000 + "]" * 2000
+    assert(json_roundtrip(deep) == deep)
+    assert(json_roundtrip(deep[1:]) == "error")
+    return "ok"
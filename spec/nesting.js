@@ -0,0 +1,16 @@
+function assert(b) {
+    if(!b) {
+        throw "assertion failed";
+    }
+}
+
+function test() {
+    var a = nest(10000);
+    var depth = 1;
+    while(a.length) {
+        a = a[0];
+        depth++;
+    }
+    assert(depth == 10000);
+    return "ok";
+}
@@ -0,0 +1,19 @@
+function assert(b)
+    if not b then
+        error("assertion failed")
+    end
+end
+
+function test()
+    -- nesting depth is limited by the size of the Lua stack
+    local a = nest(1000)
+    local depth = 1
+    while a[0] do
+        a = a[0]
+        depth = depth + 1
+    end
+    assert(depth == 1000)
+    -- deeper values make the call fail, instead of arriving as nil
+    assert(not pcall(nest, 100000))
+    return "ok"
+end
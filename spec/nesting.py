@@ -0,0 +1,8 @@
+def test():
+    a = nest(10000)
+    depth = 1
+    while len(a):
+        a = a[0]
+        depth += 1
+    assert(depth == 10000)
+    return "ok"
@@ -0,0 +1,14 @@
+def assert(b)
+    raise if not b
+end
+
+def test()
+    a = nest(10000)
+    depth = 1
+    while a.length > 0
+        a = a[0]
+        depth += 1
+    end
+    assert(depth == 10000)
+    return "ok"
+end
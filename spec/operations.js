@@ -0,0 +1,35 @@
+// spec/run calls these from the host, to check timeouts, budgets,
+// errors, garbage collection and resets
+
+function spin() {
+    while(true) {
+    }
+}
+
+function count(n) {
+    var i = 0;
+    while(i < n) {
+        i++;
+    }
+    return i;
+}
+
+function explode() {
+    throw new Error("exploded");
+}
+
+function garbage() {
+    for(var i=0;i<1000;i++) {
+        var a = [i];
+        a.push(a);
+    }
+    return 1;
+}
+
+function echo(x) {
+    return x;
+}
+
+function test() {
+    return "ok";
+}
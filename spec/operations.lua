@@ -0,0 +1,35 @@
+-- spec/run calls these from the host, to check timeouts, budgets,
+-- errors, garbage collection and resets
+
+function spin()
+    while true do
+    end
+end
+
+function count(n)
+    local i = 0
+    while i < n do
+        i = i + 1
+    end
+    return i
+end
+
+function explode()
+    error("exploded")
+end
+
+function garbage()
+    for i=1,1000 do
+        local a = {i}
+        a[2] = a
+    end
+    return 1
+end
+
+function echo(x)
+    return x
+end
+
+function test()
+    return "ok"
+end
@@ -0,0 +1,27 @@
+# spec/run calls these from the host, to check timeouts, budgets,
+# errors, garbage collection and resets
+
+def spin():
+    while True:
+        pass
+
+def count(n):
+    i = 0
+    while i < n:
+        i += 1
+    return i
+
+def explode():
+    raise Exception("exploded")
+
+def garbage():
+    for i in range(1000):
+        a = [i]
+        a.append(a)
+    return 1
+
+def echo(x):
+    return x
+
+def test():
+    return "ok"
@@ -0,0 +1,35 @@
+# spec/run calls these from the host, to check timeouts, budgets,
+# errors, garbage collection and resets
+
+def spin
+    while true
+    end
+end
+
+def count(n)
+    i = 0
+    while i < n
+        i += 1
+    end
+    i
+end
+
+def explode
+    raise "exploded"
+end
+
+def garbage
+    1000.times do |i|
+        a = [i]
+        a << a
+    end
+    1
+end
+
+def echo(x)
+    x
+end
+
+def test
+    "ok"
+end
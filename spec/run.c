@@ -3,6 +3,8 @@
 #include <sys/prctl.h>
 #include <unistd.h>
 #include "../language.h"
+#include "../settings.h"
+#include "../stats.h"
 
 static void trace(void*context, char*s)
 {
@@ -22,6 +24,39 @@ static value_t* get_array(void*context, int width, int height)
     }
     return columns;
 }
+static value_t* nest(void*context, int depth)
+{
+    value_t*array = array_new();
+    while(depth-- > 1) {
+        value_t*outer = array_new();
+        array_append(outer, array);
+        array = outer;
+    }
+    return array;
+}
+/* parses s, and writes it back as JSON, or returns "error". Non-ASCII
+   bytes come out as \xhh, so specs only need ASCII string literals. */
+static char* json_roundtrip(void*context, char*s)
+{
+    value_t*v = value_from_json(s, -1);
+    if(!v)
+        return strdup("error");
+    char*json = value_to_json(v);
+    value_destroy(v);
+    char*out = malloc(strlen(json)*4+1);
+    char*o = out;
+    unsigned char*c;
+    for(c=(unsigned char*)json;*c;c++) {
+        if(*c >= 0x80) {
+            o += sprintf(o, "\\x%02x", *c);
+        } else {
+            *o++ = *c;
+        }
+    }
+    *o = 0;
+    free(json);
+    return out;
+}
 static int add2(void*context, int x, int y)
 {
     return x+y;
@@ -65,10 +100,52 @@ static bool negate(void*context, bool b)
     return !b;
 }
 
+/* host side checks, for guest functions with well-known names */
+static bool failed = false;
+static void check(bool ok, const char*what)
+{
+    if(!ok) {
+        printf("failed: %s\n", what);
+        failed = true;
+    }
+}
+static bool has_backtrace(language_t*l)
+{
+    char*backtrace = get_guest_backtrace(l);
+    bool ok = backtrace && backtrace[0];
+    free(backtrace);
+    return ok;
+}
+static value_t* call_with_int(language_t*l, const char*name, int i)
+{
+    value_t*args = value_new_array();
+    array_append_int32(args, i);
+    value_t*ret = l->call_function(l, name, args);
+    value_destroy(args);
+    return ret;
+}
+
+/* calls a guest function with the arguments in args_json, and compares
+   what it returns as JSON */
+static void check_call(language_t*l, const char*name, const char*args_json, const char*expected)
+{
+    value_t*args = value_from_json(args_json, -1);
+    value_t*v = l->call_function(l, name, args);
+    value_destroy(args);
+    char*json = v ? value_to_json(v) : NULL;
+    char what[256];
+    snprintf(what, sizeof(what), "%s%s should return %s", name, args_json, expected);
+    check(json && !strcmp(json, expected), what);
+    free(json);
+    if(v)
+        value_destroy(v);
+}
+
 int main(int argn, char*argv[])
 {
     char*program = argv[0];
     bool sandbox = true;
+    const char*language = NULL;
 
     int i,j=0;
     for(i=1;i<argn;i++) {
@@ -77,6 +154,16 @@ int main(int argn, char*argv[])
                 case 'u':
                     sandbox = false;
                 break;
+                case 'x':
+                    /* start the sandbox through the helper instead of fork() */
+                    config_sandbox_helper = "./cagekeeper-sandbox";
+                break;
+                case 'l':
+                    /* e.g. "-l luajit": use this language instead of the
+                       one the file extension implies */
+                    if(i+1 < argn)
+                        language = argv[++i];
+                break;
             }
         } else {
             argv[j++] = argv[i];
@@ -92,7 +179,15 @@ int main(int argn, char*argv[])
     char*filename = argv[0];
 
     language_t*l;
-    if(sandbox) {
+    if(language) {
+        l = raw_interpreter_by_name(language);
+        if(l && sandbox) {
+            l = wrap_sandbox(l);
+        } else if(l && !l->initialize(l, config_maxmem)) {
+            l->destroy(l);
+            l = NULL;
+        }
+    } else if(sandbox) {
         l = interpreter_by_extension(filename);
     } else {
         l = unsafe_interpreter_by_extension(filename);
@@ -104,6 +199,8 @@ int main(int argn, char*argv[])
 
     define_function(l, "trace", trace, NULL, "s",""),
     define_function(l, "get_array", get_array, NULL, "ii","["),
+    define_function(l, "nest", nest, NULL, "i","["),
+    define_function(l, "json_roundtrip", json_roundtrip, NULL, "s","s"),
     define_function(l, "add2", add2, NULL, "ii", "i"),
     define_function(l, "add3", add3, NULL, "iii", "i"),
     define_function(l, "fadd2", fadd2, NULL, "ff", "f"),
@@ -126,6 +223,11 @@ int main(int argn, char*argv[])
     bool compiled = l->compile_script(l, script);
     if(!compiled) {
         fprintf(stderr, "Error compiling script\n");
+        char*backtrace = get_guest_backtrace(l);
+        if(backtrace) {
+            fprintf(stderr, "%s", backtrace);
+            free(backtrace);
+        }
         l->destroy(l);
         return 1;
     }
@@ -186,13 +288,109 @@ int main(int argn, char*argv[])
         value_destroy(args);
     }
 
+    value_t*v;
+    if(l->is_function(l, "spin")) {
+        /* the interpreter has to be usable after an interrupted call. A
+           sandbox running luajit machine code doesn't react to the
+           interrupt, and is replaced (without a backtrace) instead. */
+        bool killed = sandbox && language && !strcmp(language, "luajit");
+        /* don't wait long for that, run_specs doesn't */
+        config_interrupt_grace_ms = 200;
+        bool timeout = false;
+        v = call_function_with_timeout_ms(l, "spin", NO_ARGS, 200, &timeout);
+        check(!v && timeout, "spin() should time out");
+        check(killed || has_backtrace(l), "spin() should leave a backtrace");
+        if(killed) {
+            /* only the interpreter reacts to the interrupt, so the kill
+               shows that spin() ran as machine code */
+            char*metrics = cagekeeper_stats_prometheus();
+            check(metrics && strstr(metrics, "cagekeeper_kills_total{language=\"luajit\"} 1\n"), "spin() should run with the JIT on");
+            free(metrics);
+        }
+        v = l->call_function(l, "test", NO_ARGS);
+        check(v != NULL, "test() should work after a timeout");
+        if(v)
+            value_destroy(v);
+    }
+    if(l->is_function(l, "count")) {
+        l->ops_budget = 1000;
+        v = call_with_int(l, "count", 1000000);
+        check(!v && l->timeout, "count(1000000) should exceed a budget of 1000");
+        check(has_backtrace(l), "count() should leave a backtrace");
+        l->ops_budget = UINT64_MAX;
+        v = call_with_int(l, "count", 100000);
+        check(v && !l->timeout, "count(100000) should work without a limit");
+        check(l->ops > 0, "count(100000) should count operations");
+        if(v)
+            value_destroy(v);
+        l->ops_budget = 0;
+    }
+    if(l->is_function(l, "explode")) {
+        v = l->call_function(l, "explode", NO_ARGS);
+        check(!v && !l->timeout, "explode() should fail with an exception");
+        check(has_backtrace(l), "explode() should leave a backtrace");
+    }
+    if(l->is_function(l, "garbage")) {
+        l->gc_policy = GC_BETWEEN_CALLS;
+        v = l->call_function(l, "garbage", NO_ARGS);
+        check(v != NULL, "garbage() failed");
+        if(v)
+            value_destroy(v);
+        check(collect_guest_garbage(l), "collect_guest_garbage() failed");
+        call_stats_t stats;
+        check(get_call_stats(l, &stats), "get_call_stats() failed");
+        l->gc_policy = GC_AUTOMATIC;
+        if(sandbox) {
+            char*metrics = cagekeeper_stats_prometheus();
+            check(metrics && strstr(metrics, "cagekeeper_call_seconds_count{language="), "calls should show up in the stats");
+            free(metrics);
+        }
+    }
+
+    if(l->is_function(l, "sum")) {
+        declare_guest_function(l, "sum", "I", "i");
+        declare_guest_function(l, "join", "Ss", "s");
+        declare_guest_function(l, "invert", "B", "B");
+        declare_guest_function(l, "scale", "Ff", "F");
+        declare_guest_function(l, "first", "[", "i");
+        declare_guest_function(l, "wrong", "", "i");
+        check_call(l, "sum", "[[1,2,3]]", "6");
+        check_call(l, "sum", "[[]]", "0");
+        check_call(l, "join", "[[\"a\",\"b\",\"c\"],\"-\"]", "\"a-b-c\"");
+        check_call(l, "invert", "[[true,false]]", "[false,true]");
+        check_call(l, "scale", "[[1.5,-2],2]", "[3,-4]");
+        check_call(l, "first", "[[7,\"x\"]]", "7");
+        v = l->call_function(l, "wrong", NO_ARGS);
+        check(!sandbox || !v, "wrong() should fail its signature");
+        if(v)
+            value_destroy(v);
+    }
+
     if(l->is_function(l, "test")) {
         ret = l->call_function(l, "test", NO_ARGS);
     }
 
+    if(l->is_function(l, "echo")) {
+        /* a reset forgets declared signatures, too */
+        declare_guest_function(l, "echo", "s", "s");
+        v = call_with_int(l, "echo", 1);
+        check(!sandbox || !v, "echo(1) should fail its signature");
+        if(v)
+            value_destroy(v);
+        check(reset_interpreter(l), "reset_interpreter() failed");
+        check(!l->is_function(l, "echo"), "echo() should be gone after a reset");
+        check(l->compile_script(l, script), "compiling after a reset failed");
+        v = call_with_int(l, "echo", 1);
+        check(v != NULL, "echo(1) should work after a reset");
+        if(v)
+            value_destroy(v);
+    }
+
     l->destroy(l);
 
-    if(ret && ret->type == TYPE_STRING) {
+    if(failed) {
+        return 1;
+    } else if(ret && ret->type == TYPE_STRING) {
         fputs(ret->str, stdout);
         fputc('\n', stdout);
         if(!strcmp(ret->str, "ok"))
@@ -0,0 +1,33 @@
+// spec/run declares the signatures of these, and calls them from the host
+
+function sum(a) {
+    var s = 0;
+    for(var i=0;i<a.length;i++) {
+        s += a[i];
+    }
+    return s;
+}
+
+function join(a, separator) {
+    return a.join(separator);
+}
+
+function invert(a) {
+    return a.map(function(x) { return !x; });
+}
+
+function scale(a, f) {
+    return a.map(function(x) { return x * f; });
+}
+
+function first(a) {
+    return a[0];
+}
+
+function wrong() {
+    return "not an int";
+}
+
+function test() {
+    return "ok";
+}
@@ -0,0 +1,56 @@
+-- spec/run declares the signatures of these, and calls them from the host
+
+function sum(a)
+    local s = 0
+    local i = 0
+    while a[i] ~= nil do
+        s = s + a[i]
+        i = i + 1
+    end
+    return s
+end
+
+function join(a, separator)
+    local s = ""
+    local i = 0
+    while a[i] ~= nil do
+        if i > 0 then
+            s = s .. separator
+        end
+        s = s .. a[i]
+        i = i + 1
+    end
+    return s
+end
+
+function invert(a)
+    local r = {}
+    local i = 0
+    while a[i] ~= nil do
+        r[i] = not a[i]
+        i = i + 1
+    end
+    return r
+end
+
+function scale(a, f)
+    local r = {}
+    local i = 0
+    while a[i] ~= nil do
+        r[i] = a[i] * f
+        i = i + 1
+    end
+    return r
+end
+
+function first(a)
+    return a[0]
+end
+
+function wrong()
+    return "not an int"
+end
+
+function test()
+    return "ok"
+end
@@ -0,0 +1,25 @@
+# spec/run declares the signatures of these, and calls them from the host
+
+def sum(a):
+    s = 0
+    for x in a:
+        s += x
+    return s
+
+def join(a, separator):
+    return separator.join(a)
+
+def invert(a):
+    return [not x for x in a]
+
+def scale(a, f):
+    return [x * f for x in a]
+
+def first(a):
+    return a[0]
+
+def wrong():
+    return "not an int"
+
+def test():
+    return "ok"
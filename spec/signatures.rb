@@ -0,0 +1,29 @@
+# spec/run declares the signatures of these, and calls them from the host
+
+def sum(a)
+    a.inject(0) { |s, x| s + x }
+end
+
+def join(a, separator)
+    a.join(separator)
+end
+
+def invert(a)
+    a.map { |x| !x }
+end
+
+def scale(a, f)
+    a.map { |x| x * f }
+end
+
+def first(a)
+    a[0]
+end
+
+def wrong
+    "not an int"
+end
+
+def test
+    "ok"
+end
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static language_stats_t languages[STATS_MAX_LANGUAGES];
+
+static const char*histogram_names[NUM_HISTOGRAMS] = {
+    "spawn", "compile", "call", "callback", "serialize",
+    "spawn_fork", "spawn_close_fds", "spawn_initialize", "spawn_lockdown",
+    "gc",
+};
+static const char*histogram_help[NUM_HISTOGRAMS] = {
+    "Time to start a sandbox process, until it's ready to run guest code",
+    "Time to compile a script, including its top-level code",
+    "Round trip time of a guest function call",
+    "Round trip time of a call from the guest into the host",
+    "Time spent encoding arguments and decoding return values",
+    "Time from calling fork() until the sandbox process runs",
+    "Time the sandbox process spends closing inherited file descriptors",
+    "Time the sandbox process spends initializing the interpreter",
+    "Time the sandbox process spends installing the seccomp filter",
+    "Full garbage collections a sandbox ran between calls",
+};
+static const char*counter_names[NUM_COUNTERS] = {
+    "timeouts", "errors", "spawns", "kills"
+};
+static const char*counter_help[NUM_COUNTERS] = {
+    "Compiles and calls that ran out of time or operations",
+    "Compiles and calls that failed",
+    "Sandbox processes started",
+    "Sandbox processes killed because they didn't react to an interrupt",
+};
+
+/* Slots are claimed on first use, and never released. Language names are
+   expected to be string constants. */
+static language_stats_t* get_language(const char*name)
+{
+    int i;
+    for(i=0;i<STATS_MAX_LANGUAGES;i++) {
+        const char*n = __atomic_load_n(&languages[i].name, __ATOMIC_ACQUIRE);
+        if(!n) {
+            const char*expected = NULL;
+            if(__atomic_compare_exchange_n(&languages[i].name, &expected, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return &languages[i];
+            n = expected;
+        }
+        if(!strcmp(n, name))
+            return &languages[i];
+    }
+    return NULL;
+}
+
+static int bucket_index(uint64_t v)
+{
+    if(v < (1 << HISTOGRAM_SUB_BUCKET_BITS))
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (v >> (e - HISTOGRAM_SUB_BUCKET_BITS)) & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1);
+    return ((e - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS) + sub;
+}
+
+/* smallest value that doesn't go into this bucket anymore */
+uint64_t histogram_bucket_limit(int index)
+{
+    int sub_buckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    if(index < sub_buckets)
+        return index + 1;
+    int e = (index >> HISTOGRAM_SUB_BUCKET_BITS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+    int sub = index & (sub_buckets - 1);
+    if(index == HISTOGRAM_BUCKETS - 1)
+        return UINT64_MAX;
+    return (uint64_t)(sub_buckets + sub + 1) << (e - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+void histogram_add(histogram_t*h, uint64_t value)
+{
+    __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void stats_record(const char*language, histogram_id_t id, uint64_t nanoseconds)
+{
+    language_stats_t*l = get_language(language);
+    if(!l)
+        return;
+    histogram_add(&l->histograms[id], nanoseconds);
+}
+
+void stats_count(const char*language, counter_id_t id)
+{
+    language_stats_t*l = get_language(language);
+    if(!l)
+        return;
+    __atomic_fetch_add(&l->counters[id], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t histogram_percentile(const histogram_t*h, double percentile)
+{
+    uint64_t total = 0;
+    int i;
+    for(i=0;i<HISTOGRAM_BUCKETS;i++)
+        total += h->buckets[i];
+    if(!total)
+        return 0;
+    uint64_t rank = (uint64_t)(total * percentile / 100.0);
+    if(rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for(i=0;i<HISTOGRAM_BUCKETS;i++) {
+        seen += h->buckets[i];
+        if(seen > rank) {
+            uint64_t low = i ? histogram_bucket_limit(i-1) : 0;
+            return low + (histogram_bucket_limit(i) - low) / 2;
+        }
+    }
+    return 0;
+}
+
+static void add_stats(language_stats_t*to, const language_stats_t*from)
+{
+    int i, j;
+    for(i=0;i<NUM_HISTOGRAMS;i++) {
+        to->histograms[i].count += from->histograms[i].count;
+        to->histograms[i].sum += from->histograms[i].sum;
+        for(j=0;j<HISTOGRAM_BUCKETS;j++) {
+            to->histograms[i].buckets[j] += from->histograms[i].buckets[j];
+        }
+    }
+    for(i=0;i<NUM_COUNTERS;i++) {
+        to->counters[i] += from->counters[i];
+    }
+}
+
+cagekeeper_stats_t* cagekeeper_stats_snapshot()
+{
+    cagekeeper_stats_t*stats = calloc(1, sizeof(cagekeeper_stats_t));
+    stats->total.name = "total";
+    int i, j, k;
+    for(i=0;i<STATS_MAX_LANGUAGES;i++) {
+        const char*name = __atomic_load_n(&languages[i].name, __ATOMIC_ACQUIRE);
+        if(!name)
+            break;
+        language_stats_t*to = &stats->languages[stats->num_languages++];
+        to->name = name;
+        for(j=0;j<NUM_HISTOGRAMS;j++) {
+            const histogram_t*h = &languages[i].histograms[j];
+            for(k=0;k<HISTOGRAM_BUCKETS;k++) {
+                to->histograms[j].buckets[k] = __atomic_load_n(&h->buckets[k], __ATOMIC_RELAXED);
+            }
+            to->histograms[j].sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            to->histograms[j].count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        }
+        for(j=0;j<NUM_COUNTERS;j++) {
+            to->counters[j] = __atomic_load_n(&languages[i].counters[j], __ATOMIC_RELAXED);
+        }
+        add_stats(&stats->total, to);
+    }
+    return stats;
+}
+
+/* Exported "le" boundaries: powers of two from 1.024us to 68.7s, the
+   upper limits of the merged bucket groups 7 to 33. Every series gets all
+   of them, so they can be aggregated across languages and scrapes. */
+#define PROMETHEUS_FIRST_GROUP 7
+#define PROMETHEUS_LAST_GROUP 33
+
+/* Buckets are merged to powers of two. Counts are derived from the
+   buckets, since the snapshot of count and buckets isn't atomic. */
+static void prometheus_histogram(FILE*fi, const char*metric, const char*language, const histogram_t*h)
+{
+    int sub_buckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    int groups = HISTOGRAM_BUCKETS / sub_buckets;
+    int g, i;
+    uint64_t cumulative = 0;
+    for(g=0;g<groups;g++) {
+        for(i=0;i<sub_buckets;i++) {
+            cumulative += h->buckets[g*sub_buckets+i];
+        }
+        if(g >= PROMETHEUS_FIRST_GROUP && g <= PROMETHEUS_LAST_GROUP) {
+            fprintf(fi, "%s_bucket{language=\"%s\",le=\"%.9g\"} %llu\n", metric, language,
+                    histogram_bucket_limit(g*sub_buckets + sub_buckets-1) / 1e9, (unsigned long long)cumulative);
+        }
+    }
+    fprintf(fi, "%s_bucket{language=\"%s\",le=\"+Inf\"} %llu\n", metric, language, (unsigned long long)cumulative);
+    fprintf(fi, "%s_sum{language=\"%s\"} %g\n", metric, language, h->sum / 1e9);
+    fprintf(fi, "%s_count{language=\"%s\"} %llu\n", metric, language, (unsigned long long)cumulative);
+}
+
+char* cagekeeper_stats_prometheus()
+{
+    cagekeeper_stats_t*stats = cagekeeper_stats_snapshot();
+    char*text = NULL;
+    size_t size = 0;
+    FILE*fi = open_memstream(&text, &size);
+    if(!fi) {
+        free(stats);
+        return NULL;
+    }
+    int i, j;
+    for(i=0;i<NUM_HISTOGRAMS;i++) {
+        char metric[64];
+        snprintf(metric, sizeof(metric), "cagekeeper_%s_seconds", histogram_names[i]);
+        fprintf(fi, "# HELP %s %s.\n", metric, histogram_help[i]);
+        fprintf(fi, "# TYPE %s histogram\n", metric);
+        for(j=0;j<stats->num_languages;j++) {
+            prometheus_histogram(fi, metric, stats->languages[j].name, &stats->languages[j].histograms[i]);
+        }
+    }
+    for(i=0;i<NUM_COUNTERS;i++) {
+        fprintf(fi, "# HELP cagekeeper_%s_total %s.\n", counter_names[i], counter_help[i]);
+        fprintf(fi, "# TYPE cagekeeper_%s_total counter\n", counter_names[i]);
+        for(j=0;j<stats->num_languages;j++) {
+            fprintf(fi, "cagekeeper_%s_total{language=\"%s\"} %llu\n", counter_names[i],
+                    stats->languages[j].name, (unsigned long long)stats->languages[j].counters[i]);
+        }
+    }
+    fclose(fi);
+    free(stats);
+    return text;
+}
@@ -0,0 +1,71 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Latency histograms and event counters, kept per language and updated
+   without locks by the sandbox proxy. All times are in nanoseconds. */
+
+typedef enum {
+    HISTOGRAM_SPAWN,
+    HISTOGRAM_COMPILE,
+    HISTOGRAM_CALL,
+    HISTOGRAM_CALLBACK,
+    HISTOGRAM_SERIALIZE,
+    HISTOGRAM_SPAWN_FORK,
+    HISTOGRAM_SPAWN_CLOSE_FDS,
+    HISTOGRAM_SPAWN_INITIALIZE,
+    HISTOGRAM_SPAWN_LOCKDOWN,
+    HISTOGRAM_GC,
+    NUM_HISTOGRAMS
+} histogram_id_t;
+
+typedef enum {
+    COUNTER_TIMEOUTS,
+    COUNTER_ERRORS,
+    COUNTER_SPAWNS,
+    COUNTER_KILLS,
+    NUM_COUNTERS
+} counter_id_t;
+
+/* log-linear buckets: 8 per power of two */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS)
+
+#define STATS_MAX_LANGUAGES 16
+
+typedef struct _histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct _language_stats {
+    const char*name;
+    histogram_t histograms[NUM_HISTOGRAMS];
+    uint64_t counters[NUM_COUNTERS];
+} language_stats_t;
+
+typedef struct _cagekeeper_stats {
+    int num_languages;
+    language_stats_t languages[STATS_MAX_LANGUAGES];
+    /* all languages combined */
+    language_stats_t total;
+} cagekeeper_stats_t;
+
+void stats_record(const char*language, histogram_id_t histogram, uint64_t nanoseconds);
+void stats_count(const char*language, counter_id_t counter);
+uint64_t stats_now();
+
+/* copy of the current values. Free with free(). */
+cagekeeper_stats_t* cagekeeper_stats_snapshot();
+
+/* text in Prometheus exposition format. Free with free(). */
+char* cagekeeper_stats_prometheus();
+
+void histogram_add(histogram_t*histogram, uint64_t value);
+uint64_t histogram_percentile(const histogram_t*histogram, double percentile);
+uint64_t histogram_bucket_limit(int index);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../journal.h"
+
+/* Decodes a journal written by journal_record(), oldest event first.
+   Works on the file of a running process, too: slots that are being
+   written while we read them are skipped. */
+
+static void usage(const char*name)
+{
+    fprintf(stderr, "Usage: %s [-n events] [-s seconds] <file.journal>\n", name);
+    fprintf(stderr, "  -n N  only print the last N events\n");
+    fprintf(stderr, "  -s S  only print events from the last S seconds before the newest event\n");
+    exit(1);
+}
+
+static void print_event(const journal_event_t*e)
+{
+    char language[sizeof(e->language) + 1];
+    memcpy(language, e->language, sizeof(e->language));
+    language[sizeof(e->language)] = 0;
+
+    time_t seconds = e->timestamp / 1000000000ull;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%06d %8llu pid=%-6d %-4s %-9s %-7s %10.3fms sent=%llu received=%llu ops=%llu\n",
+            date, (int)(e->timestamp % 1000000000ull / 1000),
+            (unsigned long long)e->sequence, e->sandbox, language,
+            journal_type_name(e->type), journal_status_name(e->status),
+            e->duration / 1e6,
+            (unsigned long long)e->bytes_sent,
+            (unsigned long long)e->bytes_received,
+            (unsigned long long)e->ops);
+}
+
+int main(int argn, char*argv[])
+{
+    long long max_events = -1;
+    double max_seconds = -1;
+    int c;
+    while((c = getopt(argn, argv, "n:s:")) != -1) {
+        switch(c) {
+            case 'n': max_events = atoll(optarg); break;
+            case 's': max_seconds = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind != argn - 1)
+        usage(argv[0]);
+    const char*filename = argv[optind];
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        perror(filename);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if(st.st_size < sizeof(journal_header_t)) {
+        fprintf(stderr, "%s: file too small\n", filename);
+        return 1;
+    }
+    void*map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const journal_header_t*header = map;
+    if(memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) ||
+       header->version != JOURNAL_VERSION ||
+       header->event_size != sizeof(journal_event_t)) {
+        fprintf(stderr, "%s: not a journal file, or unsupported version\n", filename);
+        return 1;
+    }
+    uint64_t capacity = header->capacity;
+    if(sizeof(journal_header_t) + capacity * sizeof(journal_event_t) > st.st_size) {
+        fprintf(stderr, "%s: truncated journal\n", filename);
+        return 1;
+    }
+    const journal_event_t*events = (const journal_event_t*)(header + 1);
+
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > capacity ? head - capacity : 0;
+    if(max_events >= 0 && head - first > max_events)
+        first = head - max_events;
+
+    /* copy out everything first, so that the time filter can look at the
+       newest event */
+    journal_event_t*copy = malloc((head - first) * sizeof(journal_event_t));
+    int count = 0;
+    uint64_t i;
+    for(i=first;i<head;i++) {
+        const journal_event_t*e = &events[i % capacity];
+        uint64_t seq = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+        copy[count] = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(seq != i + 1 || __atomic_load_n(&e->sequence, __ATOMIC_RELAXED) != seq)
+            continue; // overwritten, or still being written
+        count++;
+    }
+
+    uint64_t newest = 0;
+    for(i=0;i<count;i++) {
+        if(copy[i].timestamp > newest)
+            newest = copy[i].timestamp;
+    }
+
+    printf("# pid %d, %llu events written, %d readable\n", header->pid, (unsigned long long)head, count);
+    for(i=0;i<count;i++) {
+        if(max_seconds >= 0 && copy[i].timestamp + (uint64_t)(max_seconds * 1e9) < newest)
+            continue;
+        print_event(&copy[i]);
+    }
+    free(copy);
+    munmap(map, st.st_size);
+    return 0;
+}
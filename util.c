@@ -1,12 +1,17 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <malloc.h>
+#include <link.h>
 #include "util.h"
 
 char* dbg_printf(const char*format, ...)
@@ -149,34 +154,55 @@ bool read_with_retry(int fd, void* data, int len)
     return true;
 }
 
+/* Like select() on Linux, this counts the time spent waiting down in
+   *timeout, and leaves it at zero if it ran out. Uses poll() since
+   select() can't handle descriptors >= FD_SETSIZE, which processes with
+   many open files easily get for their sandbox pipes. */
+static bool wait_readable(int fd, struct timeval* timeout)
+{
+    while(1) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        int ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+        int ret = poll(&p, 1, ms);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int64_t left = timeout->tv_sec * 1000000ll + timeout->tv_usec
+                     - ((end.tv_sec - start.tv_sec) * 1000000ll + (end.tv_nsec - start.tv_nsec) / 1000);
+        if(left < 0 || ret == 0)
+            left = 0;
+        timeout->tv_sec = left / 1000000;
+        timeout->tv_usec = left % 1000000;
+
+        if(ret<0) {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+        // zero means timeout. POLLHUP and POLLERR are reported by the read.
+        return ret > 0;
+    }
+}
+
 bool read_with_timeout(int fd, void* data, int len, struct timeval* timeout)
 {
     if(!timeout) {
         return read_with_retry(fd, data, len);
     }
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
 
     int pos = 0;
     while(pos<len) {
-        int ret;
-        while(1) {
-            ret = select(fd+1, &readfds, NULL, NULL, timeout);
-            if(ret<0) {
-                if(errno == EINTR || errno == EAGAIN)
-                    continue;
-                return false;
-            }
-            if(ret>=0)
-                break;
-        }
-        if(!FD_ISSET(fd, &readfds)) {
+        if(!wait_readable(fd, timeout)) {
             // timeout
             return false;
         }
 
-        ret = read(fd, data+pos, len-pos);
+        int ret = read(fd, data+pos, len-pos);
         if(ret<0) {
             if(errno == EINTR || errno == EAGAIN)
                 continue;
@@ -191,3 +217,68 @@ bool read_with_timeout(int fd, void* data, int len, struct timeval* timeout)
     }
     return true;
 }
+
+size_t heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    return info.uordblks + info.hblkhd;
+}
+
+typedef struct _build_id_search {
+    uintptr_t address;
+    char id[128];
+} build_id_search_t;
+
+/* dl_iterate_phdr() callback: finds the object that contains
+   search->address, and reads its build ID note */
+static int find_build_id(struct dl_phdr_info*info, size_t size, void*data)
+{
+    build_id_search_t*search = data;
+    int i;
+    for(i=0;i<info->dlpi_phnum;i++) {
+        const ElfW(Phdr)*ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        if(ph->p_type == PT_LOAD && search->address >= start && search->address < start + ph->p_memsz)
+            break;
+    }
+    if(i == info->dlpi_phnum)
+        return 0;
+
+    for(i=0;i<info->dlpi_phnum;i++) {
+        const ElfW(Phdr)*ph = &info->dlpi_phdr[i];
+        if(ph->p_type != PT_NOTE)
+            continue;
+        size_t align = ph->p_align == 8 ? 8 : 4;
+        const char*p = (const char*)(info->dlpi_addr + ph->p_vaddr);
+        const char*end = p + ph->p_memsz;
+        while(p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)*note = (const ElfW(Nhdr)*)p;
+            const char*name = p + sizeof(ElfW(Nhdr));
+            const unsigned char*desc = (const unsigned char*)name + ((note->n_namesz + align - 1) & ~(align - 1));
+            if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && !memcmp(name, "GNU", 4)) {
+                int j;
+                for(j=0;j<note->n_descsz && j*2+2 < sizeof(search->id);j++) {
+                    sprintf(search->id + j*2, "%02x", desc[j]);
+                }
+                return 1;
+            }
+            p = (const char*)desc + ((note->n_descsz + align - 1) & ~(align - 1));
+        }
+    }
+    return 1;
+}
+
+char* runtime_version(const char*version, const void*symbol)
+{
+    build_id_search_t search;
+    memset(&search, 0, sizeof(search));
+    search.address = (uintptr_t)symbol;
+    dl_iterate_phdr(find_build_id, &search);
+    if(!search.id[0])
+        return strdup(version);
+    return allocprintf("%s %s", version, search.id);
+}
@@ -55,6 +55,14 @@ char*read_file(const char*filename);
 bool read_with_retry(int fd, void* data, int len);
 bool read_with_timeout(int fd, void* data, int len, struct timeval* timeout);
 
+/* bytes currently allocated through malloc() */
+size_t heap_in_use();
+
+/* version, followed by the GNU build ID of the library (or executable)
+   that contains symbol, if it has one. Tells two builds of a runtime with
+   the same version number apart. Free with free(). */
+char* runtime_version(const char*version, const void*symbol);
+
 #ifdef __cplusplus
 }
 #endif